@@ -0,0 +1,167 @@
+#include <stdio.h>
+#include <string.h>
+#include <chrono>
+
+#include <vgpu.h>
+
+/******************************************************************************\
+ *
+ *  Records runs of indexed draws from one index buffer with the same pipeline,
+ *  switching the resource table between runs, with and without the GL backend
+ *  merging them into multi draws. Times recording up to the end of the
+ *  command list, where the last batch is flushed, and reports the draw calls
+ *  that reached the driver from vgpu_get_frame_stats.
+ *
+\******************************************************************************/
+
+static const uint32_t NUM_DRAWS = 4096;
+static const uint32_t NUM_MESHES = 64;
+static const uint32_t INDICES_PER_MESH = 36;
+static const uint32_t VERTICES_PER_MESH = 24;
+static const uint32_t NUM_TABLES = 8;
+static const uint32_t NUM_FRAMES = 65; // the first one is warmup
+
+static const char vertex_glsl[] =
+	"#version 440 core\n"
+	"void main() { gl_Position = vec4(float(gl_VertexID % 3), 0.0, 0.0, 1.0); }\n";
+
+static const char fragment_glsl[] =
+	"#version 440 core\n"
+	"out vec4 color;\n"
+	"void main() { color = vec4(1.0); }\n";
+
+static int error_func(const char* file, unsigned int line, const char* cond, const char* fmt, ...)
+{
+	fprintf(stderr, "%s(%u): %s\n", file, line, cond);
+	return 0;
+}
+
+static void run(const char* name, uint32_t run_length, uint32_t force_disable_flags)
+{
+	vgpu_create_device_params_t device_params;
+	memset(&device_params, 0, sizeof(device_params));
+	device_params.error_func = error_func;
+	device_params.error_check_mode = VGPU_ERROR_CHECK_NONE;
+	device_params.force_disable_flags = force_disable_flags;
+	vgpu_device_t* device = vgpu_create_device(&device_params);
+
+	vgpu_root_layout_slot_t slot;
+	memset(&slot, 0, sizeof(slot));
+	slot.type = VGPU_ROOT_SLOT_TYPE_TABLE;
+	vgpu_root_layout_t* root_layout = vgpu_create_root_layout(device, &slot, 1);
+
+	vgpu_create_program_params_t program_params;
+	memset(&program_params, 0, sizeof(program_params));
+	program_params.data = (const uint8_t*)vertex_glsl;
+	program_params.size = strlen(vertex_glsl);
+	program_params.program_type = VGPU_VERTEX_PROGRAM;
+	vgpu_program_t* vertex_program = vgpu_create_program(device, &program_params);
+	program_params.data = (const uint8_t*)fragment_glsl;
+	program_params.size = strlen(fragment_glsl);
+	program_params.program_type = VGPU_FRAGMENT_PROGRAM;
+	vgpu_program_t* fragment_program = vgpu_create_program(device, &program_params);
+
+	vgpu_create_pipeline_params_t pipeline_params;
+	memset(&pipeline_params, 0, sizeof(pipeline_params));
+	pipeline_params.root_layout = root_layout;
+	pipeline_params.vertex_program = vertex_program;
+	pipeline_params.fragment_program = fragment_program;
+	pipeline_params.primitive_type = VGPU_PRIMITIVE_TRIANGLES;
+	vgpu_pipeline_t* pipeline = vgpu_create_pipeline(device, &pipeline_params);
+
+	vgpu_create_buffer_params_t buffer_params;
+	memset(&buffer_params, 0, sizeof(buffer_params));
+	buffer_params.num_bytes = NUM_MESHES * INDICES_PER_MESH * sizeof(uint16_t);
+	buffer_params.flags = VGPU_BUFFER_FLAG_INDEX_BUFFER;
+	vgpu_buffer_t* index_buffer = vgpu_create_buffer(device, &buffer_params);
+
+	buffer_params.num_bytes = 256;
+	buffer_params.flags = 0;
+	vgpu_buffer_t* table_buffer = vgpu_create_buffer(device, &buffer_params);
+
+	vgpu_resource_table_t* tables[NUM_TABLES];
+	for(uint32_t i = 0; i < NUM_TABLES; ++i)
+	{
+		vgpu_resource_table_entry_t entry;
+		memset(&entry, 0, sizeof(entry));
+		entry.type = VGPU_RESOURCE_BUFFER;
+		entry.resource = table_buffer;
+		entry.location = i;
+		entry.num_bytes = 256;
+		tables[i] = vgpu_create_resource_table(device, root_layout, 0, &entry, 1);
+	}
+
+	vgpu_create_thread_context_params_t thread_context_params;
+	memset(&thread_context_params, 0, sizeof(thread_context_params));
+	vgpu_thread_context_t* thread_context = vgpu_create_thread_context(device, &thread_context_params);
+
+	vgpu_create_command_list_params_t command_list_params;
+	memset(&command_list_params, 0, sizeof(command_list_params));
+	command_list_params.type = VGPU_COMMAND_LIST_IMMEDIATE_GRAPHICS;
+	vgpu_command_list_t* command_list = vgpu_create_command_list(device, &command_list_params);
+
+	uint16_t indices[NUM_MESHES * INDICES_PER_MESH];
+	for(uint32_t i = 0; i < NUM_MESHES * INDICES_PER_MESH; ++i)
+		indices[i] = (uint16_t)(i % VERTICES_PER_MESH);
+
+	double record_ns = 0.0;
+	vgpu_frame_stats_t stats;
+	memset(&stats, 0, sizeof(stats));
+	for(uint32_t f = 0; f < NUM_FRAMES; ++f)
+	{
+		vgpu_prepare_thread_context(device, thread_context);
+		vgpu_begin_command_list(thread_context, command_list, NULL);
+		if(f == 0)
+			vgpu_set_buffer_data(command_list, index_buffer, 0, indices, sizeof(indices));
+
+		auto start = std::chrono::high_resolution_clock::now();
+		vgpu_set_pipeline(command_list, pipeline);
+		vgpu_set_index_buffer(command_list, VGPU_DATA_TYPE_UINT16, index_buffer);
+		for(uint32_t i = 0; i < NUM_DRAWS; ++i)
+		{
+			if(i % run_length == 0)
+				vgpu_set_resource_table(command_list, 0, tables[(i / run_length) % NUM_TABLES]);
+			uint32_t mesh = i % NUM_MESHES;
+			vgpu_draw_indexed(command_list, 0, 1, mesh * INDICES_PER_MESH, INDICES_PER_MESH, mesh * VERTICES_PER_MESH);
+		}
+		vgpu_end_command_list(command_list);
+		auto end = std::chrono::high_resolution_clock::now();
+
+		vgpu_apply_command_lists(device, 1, &command_list);
+		vgpu_present(device);
+		vgpu_get_frame_stats(device, &stats);
+
+		if(f == 0)
+			continue;
+		record_ns += (double)std::chrono::duration_cast<std::chrono::nanoseconds>(end - start).count();
+	}
+
+	printf("%-16s %6u %10.1f ns %12llu %12llu\n", name, run_length, record_ns / ((NUM_FRAMES - 1) * NUM_DRAWS),
+		(unsigned long long)stats.num_draws, (unsigned long long)stats.num_driver_draws);
+
+	vgpu_destroy_command_list(device, command_list);
+	vgpu_destroy_thread_context(device, thread_context);
+	for(uint32_t i = 0; i < NUM_TABLES; ++i)
+		vgpu_destroy_resource_table(device, tables[i]);
+	vgpu_destroy_buffer(device, table_buffer);
+	vgpu_destroy_buffer(device, index_buffer);
+	vgpu_destroy_pipeline(device, pipeline);
+	vgpu_destroy_program(device, fragment_program);
+	vgpu_destroy_program(device, vertex_program);
+	vgpu_destroy_root_layout(device, root_layout);
+	vgpu_destroy_device(device);
+}
+
+int main(int argc, char** argv)
+{
+	printf("%u indexed draws per frame\n", NUM_DRAWS);
+	printf("%-16s %6s %13s %12s %12s\n", "", "run", "per draw", "draws", "driver draws");
+	static const uint32_t run_lengths[] = { 1, 8, 64, 512 };
+	for(uint32_t i = 0; i < sizeof(run_lengths) / sizeof(run_lengths[0]); ++i)
+	{
+		run("separate draws", run_lengths[i], VGPU_CAPS_FLAG_DRAW_MERGING);
+		run("merged draws", run_lengths[i], 0);
+	}
+
+	return 0;
+}
@@ -0,0 +1,137 @@
+#include <stdio.h>
+#include <string.h>
+#include <chrono>
+
+#include <vgpu.h>
+#include "vgpu_internal.h"
+
+/******************************************************************************\
+ *
+ *  Records frames of draws that each upload a small constant block through
+ *  vgpu_lock_buffer, and compares it to the same scratch allocations going
+ *  straight to the default allocator, either freed right away or kept until
+ *  the end of the frame like data the GPU still has to read
+ *
+ *  The frame allocator only wins over freeing at the end of the frame. An
+ *  allocation freed right away at unlock is faster, but cannot be used for
+ *  data the GPU reads later. The vgpu_lock_buffer row also pays for the
+ *  lock and unlock calls, the default allocator rows do not
+ *
+\******************************************************************************/
+
+static const uint32_t NUM_FRAMES = 200;
+static const uint32_t DRAWS_PER_FRAME = 10000;
+static const size_t CONSTANTS_SIZE = 256;
+
+static int error_func(const char* file, unsigned int line, const char* cond, const char* fmt, ...)
+{
+	fprintf(stderr, "%s(%u): %s\n", file, line, cond);
+	return 1;
+}
+
+typedef void (*upload_func_t)(vgpu_command_list_t* command_list, vgpu_buffer_t* buffer, uint32_t draw);
+typedef void (*end_frame_func_t)();
+
+static void* frame_scratch[DRAWS_PER_FRAME];
+
+static void upload_lock_buffer(vgpu_command_list_t* command_list, vgpu_buffer_t* buffer, uint32_t draw)
+{
+	vgpu_lock_buffer_params_t lock_params;
+	memset(&lock_params, 0, sizeof(lock_params));
+	lock_params.buffer = buffer;
+	lock_params.num_bytes = CONSTANTS_SIZE;
+
+	void* ptr = vgpu_lock_buffer(command_list, &lock_params);
+	memset(ptr, (int)draw, CONSTANTS_SIZE);
+	vgpu_unlock_buffer(command_list, &lock_params);
+}
+
+// What vgpu_lock_buffer did on the null device before it used the frame allocator
+static void upload_heap(vgpu_command_list_t* command_list, vgpu_buffer_t* buffer, uint32_t draw)
+{
+	extern vgpu_allocator_t vgpu_allocator_default;
+
+	void* ptr = VGPU_ALLOC(&vgpu_allocator_default, CONSTANTS_SIZE, 16);
+	memset(ptr, (int)draw, CONSTANTS_SIZE);
+	VGPU_FREE(&vgpu_allocator_default, ptr);
+}
+
+static void upload_heap_held(vgpu_command_list_t* command_list, vgpu_buffer_t* buffer, uint32_t draw)
+{
+	extern vgpu_allocator_t vgpu_allocator_default;
+
+	void* ptr = VGPU_ALLOC(&vgpu_allocator_default, CONSTANTS_SIZE, 16);
+	memset(ptr, (int)draw, CONSTANTS_SIZE);
+	frame_scratch[draw] = ptr;
+}
+
+static void end_frame_heap_held()
+{
+	extern vgpu_allocator_t vgpu_allocator_default;
+
+	for(uint32_t d = 0; d < DRAWS_PER_FRAME; ++d)
+		VGPU_FREE(&vgpu_allocator_default, frame_scratch[d]);
+}
+
+static double run(const char* name, vgpu_device_t* device, vgpu_thread_context_t* thread_context, vgpu_command_list_t* command_list, vgpu_buffer_t* buffer, upload_func_t upload, end_frame_func_t end_frame)
+{
+	auto start = std::chrono::high_resolution_clock::now();
+	for(uint32_t f = 0; f < NUM_FRAMES; ++f)
+	{
+		vgpu_prepare_thread_context(device, thread_context);
+		vgpu_begin_command_list(thread_context, command_list, NULL);
+		for(uint32_t d = 0; d < DRAWS_PER_FRAME; ++d)
+		{
+			upload(command_list, buffer, d);
+			vgpu_draw(command_list, 0, 1, 0, 3);
+		}
+		vgpu_end_command_list(command_list);
+		vgpu_apply_command_lists(device, 1, &command_list);
+		vgpu_present(device);
+
+		if(end_frame)
+			end_frame();
+	}
+	auto end = std::chrono::high_resolution_clock::now();
+
+	double ns = (double)std::chrono::duration_cast<std::chrono::nanoseconds>(end - start).count();
+	double ns_per_draw = ns / ((double)NUM_FRAMES * DRAWS_PER_FRAME);
+	printf("%-40s %8.1f ns per draw\n", name, ns_per_draw);
+	return ns_per_draw;
+}
+
+int main(int argc, char** argv)
+{
+	vgpu_create_device_params_t device_params;
+	memset(&device_params, 0, sizeof(device_params));
+	device_params.error_func = error_func;
+	vgpu_device_t* device = vgpu_create_device(&device_params);
+
+	vgpu_create_thread_context_params_t thread_context_params;
+	vgpu_thread_context_t* thread_context = vgpu_create_thread_context(device, &thread_context_params);
+
+	vgpu_create_command_list_params_t command_list_params;
+	memset(&command_list_params, 0, sizeof(command_list_params));
+	command_list_params.type = VGPU_COMMAND_LIST_GRAPHICS;
+	vgpu_command_list_t* command_list = vgpu_create_command_list(device, &command_list_params);
+
+	vgpu_create_buffer_params_t buffer_params;
+	memset(&buffer_params, 0, sizeof(buffer_params));
+	buffer_params.num_bytes = CONSTANTS_SIZE;
+	buffer_params.usage = VGPU_USAGE_DYNAMIC;
+	buffer_params.flags = VGPU_BUFFER_FLAG_CONSTANT_BUFFER;
+	buffer_params.name = "constants";
+	vgpu_buffer_t* buffer = vgpu_create_buffer(device, &buffer_params);
+
+	printf("%u frames of %u draws, %u byte constant upload per draw\n", NUM_FRAMES, DRAWS_PER_FRAME, (uint32_t)CONSTANTS_SIZE);
+	run("default allocator, freed at unlock", device, thread_context, command_list, buffer, upload_heap, NULL);
+	run("default allocator, freed at frame end", device, thread_context, command_list, buffer, upload_heap_held, end_frame_heap_held);
+	run("vgpu_lock_buffer (frame allocator)", device, thread_context, command_list, buffer, upload_lock_buffer, NULL);
+
+	vgpu_destroy_buffer(device, buffer);
+	vgpu_destroy_command_list(device, command_list);
+	vgpu_destroy_thread_context(device, thread_context);
+	vgpu_destroy_device(device);
+
+	return 0;
+}
@@ -0,0 +1,96 @@
+#include <stdio.h>
+#include <chrono>
+#include <mutex>
+#include <thread>
+
+#include <vgpu.h>
+#include "vgpu_internal.h"
+#include "vgpu_id_pool.h"
+#include "vgpu_atomic_id_pool.h"
+
+/******************************************************************************\
+ *
+ *  Every thread allocates a small batch of ids and frees them again, the way
+ *  loader threads create and destroy render passes
+ *
+\******************************************************************************/
+
+static const uint32_t CAPACITY = 65536;
+static const uint32_t OPS_PER_THREAD = 200000;
+static const uint32_t BATCH = 8;
+static const uint32_t MAX_THREADS = 32;
+
+// The plain pool behind a global mutex, which is what callers have to do today
+struct locked_id_pool_t
+{
+	vgpu_id_pool_t<uint32_t> pool;
+	std::mutex mutex;
+
+	locked_id_pool_t(vgpu_allocator_t* alloc, size_t capacity) : pool(alloc, capacity) { }
+
+	uint32_t alloc_handle()
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		return pool.alloc_handle();
+	}
+
+	void free_handle(uint32_t handle)
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		pool.free_handle(handle);
+	}
+};
+
+template<class POOL>
+static void worker(POOL* pool)
+{
+	uint32_t handles[BATCH];
+	for(uint32_t i = 0; i < OPS_PER_THREAD; i += BATCH)
+	{
+		for(uint32_t j = 0; j < BATCH; ++j)
+			handles[j] = pool->alloc_handle();
+		for(uint32_t j = 0; j < BATCH; ++j)
+			pool->free_handle(handles[j]);
+	}
+}
+
+template<class POOL>
+static double run(POOL* pool, uint32_t num_threads)
+{
+	std::thread threads[MAX_THREADS];
+
+	auto start = std::chrono::high_resolution_clock::now();
+	for(uint32_t i = 0; i < num_threads; ++i)
+		threads[i] = std::thread(worker<POOL>, pool);
+	for(uint32_t i = 0; i < num_threads; ++i)
+		threads[i].join();
+	auto end = std::chrono::high_resolution_clock::now();
+
+	double s = (double)std::chrono::duration_cast<std::chrono::nanoseconds>(end - start).count() * 1e-9;
+	return (double)num_threads * OPS_PER_THREAD / s * 1e-6;
+}
+
+int main(int argc, char** argv)
+{
+	extern vgpu_allocator_t vgpu_allocator_default;
+	vgpu_allocator_t* allocator = &vgpu_allocator_default;
+
+	printf("%u alloc+free pairs per thread in batches of %u, %u hardware threads\n", OPS_PER_THREAD, BATCH, std::thread::hardware_concurrency());
+	printf("%8s %24s %24s\n", "threads", "mutex + vgpu_id_pool_t", "vgpu_atomic_id_pool_t");
+
+	for(uint32_t num_threads = 1; num_threads <= MAX_THREADS; num_threads *= 2)
+	{
+		locked_id_pool_t locked_pool(allocator, CAPACITY);
+		vgpu_atomic_id_pool_t<uint32_t> atomic_pool(allocator, CAPACITY);
+
+		double locked_mops = run(&locked_pool, num_threads);
+		double atomic_mops = run(&atomic_pool, num_threads);
+
+		VGPU_HARD_ASSERT(locked_pool.pool.num_free() == CAPACITY, "ids lost");
+		VGPU_HARD_ASSERT(atomic_pool.num_free() == CAPACITY, "ids lost");
+
+		printf("%8u %18.2f Mop/s %18.2f Mop/s\n", num_threads, locked_mops, atomic_mops);
+	}
+
+	return 0;
+}
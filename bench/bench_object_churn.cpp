@@ -0,0 +1,210 @@
+#include <stdio.h>
+#include <string.h>
+#include <chrono>
+
+#include <vgpu.h>
+#include "vgpu_internal.h"
+#include "vgpu_slab_pool.h"
+
+/******************************************************************************\
+ *
+ *  Keeps a set of buffers and resource tables alive and replaces random ones,
+ *  the way streaming creates and destroys objects every frame. Runs through
+ *  the device API of whichever backend this is linked against, then replays
+ *  the same trace on the default allocator and on vgpu_slab_pool_t directly
+ *  with structs the size of the GL objects
+ *
+\******************************************************************************/
+
+static const uint32_t NUM_LIVE = 4096;
+static const uint32_t NUM_OPS = 1000000;
+static const uint32_t NUM_TABLE_ENTRIES = 4;
+
+static uint32_t victims[NUM_OPS];
+
+static int error_func(const char* file, unsigned int line, const char* cond, const char* fmt, ...)
+{
+	fprintf(stderr, "%s(%u): %s\n", file, line, cond);
+	return 1;
+}
+
+static uint32_t xorshift32(uint32_t* state)
+{
+	uint32_t x = *state;
+	x ^= x << 13;
+	x ^= x >> 17;
+	x ^= x << 5;
+	*state = x;
+	return x;
+}
+
+static double ns_per_op(std::chrono::high_resolution_clock::time_point start, std::chrono::high_resolution_clock::time_point end)
+{
+	double ns = (double)std::chrono::duration_cast<std::chrono::nanoseconds>(end - start).count();
+	return ns / NUM_OPS;
+}
+
+/******************************************************************************\
+ *
+ *  Device API
+ *
+\******************************************************************************/
+
+static void churn_buffers(vgpu_device_t* device)
+{
+	static vgpu_buffer_t* live[NUM_LIVE];
+
+	vgpu_create_buffer_params_t params;
+	memset(&params, 0, sizeof(params));
+	params.num_bytes = 256;
+	params.usage = VGPU_USAGE_DYNAMIC;
+	params.flags = VGPU_BUFFER_FLAG_CONSTANT_BUFFER;
+	params.name = "churn";
+
+	for(uint32_t i = 0; i < NUM_LIVE; ++i)
+		live[i] = vgpu_create_buffer(device, &params);
+
+	auto start = std::chrono::high_resolution_clock::now();
+	for(uint32_t i = 0; i < NUM_OPS; ++i)
+	{
+		uint32_t v = victims[i];
+		vgpu_destroy_buffer(device, live[v]);
+		live[v] = vgpu_create_buffer(device, &params);
+	}
+	auto end = std::chrono::high_resolution_clock::now();
+
+	for(uint32_t i = 0; i < NUM_LIVE; ++i)
+		vgpu_destroy_buffer(device, live[i]);
+
+	printf("%-40s %8.1f ns per destroy+create\n", "vgpu_create_buffer", ns_per_op(start, end));
+}
+
+static void churn_resource_tables(vgpu_device_t* device)
+{
+	static vgpu_resource_table_t* live[NUM_LIVE];
+
+	vgpu_root_layout_slot_t slot;
+	memset(&slot, 0, sizeof(slot));
+	slot.type = VGPU_ROOT_SLOT_TYPE_TABLE;
+	slot.table.range_constant_buffers.count = NUM_TABLE_ENTRIES;
+	vgpu_root_layout_t* root_layout = vgpu_create_root_layout(device, &slot, 1);
+
+	vgpu_resource_table_entry_t entries[NUM_TABLE_ENTRIES];
+	memset(entries, 0, sizeof(entries));
+	for(uint32_t i = 0; i < NUM_TABLE_ENTRIES; ++i)
+	{
+		entries[i].location = (uint8_t)i;
+		entries[i].type = VGPU_RESOURCE_BUFFER;
+		entries[i].treat_as_constant_buffer = true;
+	}
+
+	for(uint32_t i = 0; i < NUM_LIVE; ++i)
+		live[i] = vgpu_create_resource_table(device, root_layout, 0, entries, NUM_TABLE_ENTRIES);
+
+	auto start = std::chrono::high_resolution_clock::now();
+	for(uint32_t i = 0; i < NUM_OPS; ++i)
+	{
+		uint32_t v = victims[i];
+		vgpu_destroy_resource_table(device, live[v]);
+		live[v] = vgpu_create_resource_table(device, root_layout, 0, entries, NUM_TABLE_ENTRIES);
+	}
+	auto end = std::chrono::high_resolution_clock::now();
+
+	for(uint32_t i = 0; i < NUM_LIVE; ++i)
+		vgpu_destroy_resource_table(device, live[i]);
+	vgpu_destroy_root_layout(device, root_layout);
+
+	printf("%-40s %8.1f ns per destroy+create\n", "vgpu_create_resource_table", ns_per_op(start, end));
+}
+
+/******************************************************************************\
+ *
+ *  Allocator only
+ *
+\******************************************************************************/
+
+// Same sizes as the GL backend structs
+struct buffer_sized_t
+{
+	uint32_t gl_id;
+	size_t num_bytes;
+};
+
+struct resource_table_sized_t
+{
+	size_t num_entries;
+	vgpu_resource_table_entry_t entries[64];
+};
+
+template<class T>
+struct heap_pool_t
+{
+	vgpu_allocator_t* alloc_;
+
+	T* alloc() { return VGPU_ALLOC_TYPE(alloc_, T); }
+	void free(T* object) { VGPU_FREE(alloc_, object); }
+};
+
+template<class T, class POOL>
+static double churn_pool(POOL* pool)
+{
+	static T* live[NUM_LIVE];
+
+	for(uint32_t i = 0; i < NUM_LIVE; ++i)
+		live[i] = pool->alloc();
+
+	auto start = std::chrono::high_resolution_clock::now();
+	for(uint32_t i = 0; i < NUM_OPS; ++i)
+	{
+		uint32_t v = victims[i];
+		pool->free(live[v]);
+		live[v] = pool->alloc();
+		*(volatile size_t*)live[v] = v;
+	}
+	auto end = std::chrono::high_resolution_clock::now();
+
+	for(uint32_t i = 0; i < NUM_LIVE; ++i)
+		pool->free(live[i]);
+
+	return ns_per_op(start, end);
+}
+
+template<class T>
+static void compare_pools(const char* name)
+{
+	extern vgpu_allocator_t vgpu_allocator_default;
+
+	heap_pool_t<T> heap_pool = { &vgpu_allocator_default };
+	vgpu_slab_pool_t<T> slab_pool(&vgpu_allocator_default, VGPU_OBJECTS_PER_SLAB);
+
+	double heap_ns = churn_pool<T>(&heap_pool);
+	double slab_ns = churn_pool<T>(&slab_pool);
+	VGPU_HARD_ASSERT(slab_pool.num_used() == 0, "slots lost");
+
+	printf("%-24s %5u bytes %12.1f ns %12.1f ns\n", name, (uint32_t)sizeof(T), heap_ns, slab_ns);
+}
+
+int main(int argc, char** argv)
+{
+	uint32_t state = 0x9E3779B9;
+	for(uint32_t i = 0; i < NUM_OPS; ++i)
+		victims[i] = xorshift32(&state) % NUM_LIVE;
+
+	vgpu_create_device_params_t device_params;
+	memset(&device_params, 0, sizeof(device_params));
+	device_params.error_func = error_func;
+	vgpu_device_t* device = vgpu_create_device(&device_params);
+
+	static const char* device_names[] = { "null", "dx11", "dx12", "gl", "vulkan" };
+	printf("%u live objects, %u replaced, %s device\n", NUM_LIVE, NUM_OPS, device_names[vgpu_get_device_type(device)]);
+	churn_buffers(device);
+	churn_resource_tables(device);
+
+	vgpu_destroy_device(device);
+
+	printf("\n%-24s %11s %15s %15s\n", "struct", "size", "default", "slab pool");
+	compare_pools<buffer_sized_t>("buffer");
+	compare_pools<resource_table_sized_t>("resource table");
+
+	return 0;
+}
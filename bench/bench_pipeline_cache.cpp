@@ -0,0 +1,176 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <dirent.h>
+#include <unistd.h>
+#include <chrono>
+
+#include <vgpu.h>
+
+/******************************************************************************\
+ *
+ *  Creates a set of pipelines the way a game does at startup, compiling from
+ *  source, with an empty pipeline cache and with the cache the previous run
+ *  filled. Sources are salted with the time so the first cached run starts
+ *  cold. The binaries are left in a cache directory given on the command
+ *  line, without one the cache goes to a temporary directory that is removed
+ *  at exit.
+ *
+ *  Times until vgpu_create_pipeline returned for all of them, and until
+ *  vgpu_is_pipeline_ready is true for all of them, with and without async
+ *  compiles.
+ *
+ *  usage: vgpu_bench_pipeline_cache_gl [cache directory]
+ *
+\******************************************************************************/
+
+static const uint32_t NUM_PIPELINES = 128;
+
+static const char vertex_glsl[] =
+	"#version 440 core\n"
+	"// %u %u\n"
+	"layout(location = 0) out vec4 color;\n"
+	"void main() {\n"
+	"	color = vec4(float(gl_VertexID) * %u.0);\n"
+	"	gl_Position = vec4(0.0, 0.0, 0.0, 1.0);\n"
+	"}\n";
+
+static const char fragment_glsl[] =
+	"#version 440 core\n"
+	"// %u %u\n"
+	"layout(location = 0) in vec4 color;\n"
+	"out vec4 frag_color;\n"
+	"void main() {\n"
+	"	vec4 c = color;\n"
+	"	for(int i = 0; i < %u; ++i)\n"
+	"		c = sin(c * 1.7 + vec4(0.1, 0.2, 0.3, 0.4));\n"
+	"	frag_color = c;\n"
+	"}\n";
+
+static int error_func(const char* file, unsigned int line, const char* cond, const char* fmt, ...)
+{
+	fprintf(stderr, "%s(%u): %s\n", file, line, cond);
+	return 0;
+}
+
+static void run(const char* name, const char* cache_path, uint32_t salt, uint32_t force_disable_flags)
+{
+	vgpu_create_device_params_t device_params;
+	memset(&device_params, 0, sizeof(device_params));
+	device_params.error_func = error_func;
+	device_params.pipeline_cache_path = cache_path;
+	device_params.force_disable_flags = force_disable_flags;
+	vgpu_device_t* device = vgpu_create_device(&device_params);
+
+	vgpu_root_layout_slot_t slot;
+	memset(&slot, 0, sizeof(slot));
+	slot.type = VGPU_ROOT_SLOT_TYPE_TABLE;
+	vgpu_root_layout_t* root_layout = vgpu_create_root_layout(device, &slot, 1);
+
+	vgpu_program_t* vertex_programs[NUM_PIPELINES];
+	vgpu_program_t* fragment_programs[NUM_PIPELINES];
+	vgpu_pipeline_t* pipelines[NUM_PIPELINES];
+
+	auto start = std::chrono::high_resolution_clock::now();
+	for(uint32_t i = 0; i < NUM_PIPELINES; ++i)
+	{
+		char source[1024];
+		vgpu_create_program_params_t program_params;
+		memset(&program_params, 0, sizeof(program_params));
+
+		snprintf(source, sizeof(source), vertex_glsl, salt, i, i);
+		program_params.data = (const uint8_t*)source;
+		program_params.size = strlen(source);
+		program_params.program_type = VGPU_VERTEX_PROGRAM;
+		vertex_programs[i] = vgpu_create_program(device, &program_params);
+
+		snprintf(source, sizeof(source), fragment_glsl, salt, i, 4 + i % 16);
+		program_params.data = (const uint8_t*)source;
+		program_params.size = strlen(source);
+		program_params.program_type = VGPU_FRAGMENT_PROGRAM;
+		fragment_programs[i] = vgpu_create_program(device, &program_params);
+
+		vgpu_create_pipeline_params_t pipeline_params;
+		memset(&pipeline_params, 0, sizeof(pipeline_params));
+		pipeline_params.root_layout = root_layout;
+		pipeline_params.vertex_program = vertex_programs[i];
+		pipeline_params.fragment_program = fragment_programs[i];
+		pipeline_params.primitive_type = VGPU_PRIMITIVE_TRIANGLES;
+		pipelines[i] = vgpu_create_pipeline(device, &pipeline_params);
+	}
+	auto created = std::chrono::high_resolution_clock::now();
+
+	for(uint32_t num_ready = 0; num_ready < NUM_PIPELINES; )
+	{
+		num_ready = 0;
+		for(uint32_t i = 0; i < NUM_PIPELINES; ++i)
+			num_ready += vgpu_is_pipeline_ready(device, pipelines[i]) ? 1 : 0;
+	}
+	auto ready = std::chrono::high_resolution_clock::now();
+
+	double created_ms = (double)std::chrono::duration_cast<std::chrono::microseconds>(created - start).count() / 1000.0;
+	double ready_ms = (double)std::chrono::duration_cast<std::chrono::microseconds>(ready - start).count() / 1000.0;
+	printf("%-24s %10.1f ms %10.1f ms %10.2f ms\n", name, created_ms, ready_ms, ready_ms / NUM_PIPELINES);
+
+	for(uint32_t i = 0; i < NUM_PIPELINES; ++i)
+	{
+		vgpu_destroy_pipeline(device, pipelines[i]);
+		vgpu_destroy_program(device, fragment_programs[i]);
+		vgpu_destroy_program(device, vertex_programs[i]);
+	}
+	vgpu_destroy_root_layout(device, root_layout);
+	vgpu_destroy_device(device);
+}
+
+// Removes the temporary cache directory and the binaries in it
+static void remove_cache(const char* cache_path)
+{
+	DIR* dir = opendir(cache_path);
+	if(dir)
+	{
+		while(struct dirent* entry = readdir(dir))
+		{
+			if(strncmp(entry->d_name, "gl_", 3) != 0)
+				continue;
+
+			char path[1024];
+			snprintf(path, sizeof(path), "%s/%s", cache_path, entry->d_name);
+			unlink(path);
+		}
+		closedir(dir);
+	}
+	rmdir(cache_path);
+}
+
+int main(int argc, char** argv)
+{
+	char temp_path[1024];
+	const char* cache_path = argc > 1 ? argv[1] : NULL;
+	if(cache_path == NULL)
+	{
+		const char* tmp = getenv("TMPDIR");
+		snprintf(temp_path, sizeof(temp_path), "%s/vgpu_pipeline_cache_XXXXXX", tmp && *tmp ? tmp : "/tmp");
+		cache_path = mkdtemp(temp_path);
+		if(cache_path == NULL)
+		{
+			fprintf(stderr, "Failed to create a temporary cache directory in %s\n", tmp && *tmp ? tmp : "/tmp");
+			return 1;
+		}
+	}
+	uint32_t salt = (uint32_t)time(NULL);
+
+	printf("%u pipelines, cache in %s\n", NUM_PIPELINES, cache_path);
+	printf("%-24s %13s %13s %13s\n", "", "created", "ready", "per pipeline");
+	run("no cache", NULL, salt, VGPU_CAPS_FLAG_ASYNC_PIPELINE_COMPILE);
+	run("no cache, async", NULL, salt + 1, 0);
+	run("cold cache", cache_path, salt + 2, VGPU_CAPS_FLAG_ASYNC_PIPELINE_COMPILE);
+	run("warm cache", cache_path, salt + 2, VGPU_CAPS_FLAG_ASYNC_PIPELINE_COMPILE);
+	run("cold cache, async", cache_path, salt + 3, 0);
+	run("warm cache, async", cache_path, salt + 3, 0);
+
+	if(argc <= 1)
+		remove_cache(cache_path);
+
+	return 0;
+}
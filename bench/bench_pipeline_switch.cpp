@@ -0,0 +1,259 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <algorithm>
+#include <chrono>
+
+#include <vgpu.h>
+
+/******************************************************************************\
+ *
+ *  Replays a sorted frame through vgpu_set_pipeline with the three ways the
+ *  GL backend can change pipeline state, selected with force_disable_flags:
+ *  everything every time, diffing against the shadow state and the pipeline
+ *  pair transition cache.
+ *
+ *  The frame is a shadow pass and an opaque pass sorted by pipeline, so
+ *  few switches, and a transparent pass sorted back to front which keeps
+ *  switching between the same few pipelines.
+ *
+\******************************************************************************/
+
+static const uint32_t NUM_PROGRAMS = 16;
+static const uint32_t NUM_SHADOW_DRAWS = 512;
+static const uint32_t NUM_OPAQUE_DRAWS = 2048;
+static const uint32_t NUM_TRANSPARENT_DRAWS = 512;
+static const uint32_t NUM_DRAWS = NUM_SHADOW_DRAWS + NUM_OPAQUE_DRAWS + NUM_TRANSPARENT_DRAWS;
+static const uint32_t NUM_FRAMES = 65; // the first one is warmup
+
+enum variant_t
+{
+	VARIANT_SHADOW,
+	VARIANT_OPAQUE,
+	VARIANT_ALPHA_TESTED,
+	VARIANT_TRANSPARENT,
+	VARIANT_ADDITIVE,
+	NUM_VARIANTS
+};
+
+static const char vertex_glsl[] =
+	"#version 440 core\n"
+	"void main() { gl_Position = vec4(0.0, 0.0, 0.0, 1.0); }\n";
+
+static const char fragment_glsl[] =
+	"#version 440 core\n"
+	"out vec4 color;\n"
+	"void main() { color = vec4(%f); }\n";
+
+struct draw_t
+{
+	uint32_t pipeline;
+	uint32_t sort_key;
+};
+
+static draw_t draws[NUM_DRAWS];
+
+static int error_func(const char* file, unsigned int line, const char* cond, const char* fmt, ...)
+{
+	fprintf(stderr, "%s(%u): %s\n", file, line, cond);
+	return 0;
+}
+
+static uint32_t xorshift32(uint32_t* state)
+{
+	uint32_t x = *state;
+	x ^= x << 13;
+	x ^= x >> 17;
+	x ^= x << 5;
+	*state = x;
+	return x;
+}
+
+static uint32_t pipeline_index(uint32_t variant, uint32_t program)
+{
+	return variant * NUM_PROGRAMS + program;
+}
+
+static void build_frame()
+{
+	uint32_t state = 0x9E3779B9;
+	draw_t* draw = draws;
+
+	// Passes sort by pipeline, bucketed by pass in the top bits
+	for(uint32_t i = 0; i < NUM_SHADOW_DRAWS; ++i, ++draw)
+	{
+		draw->pipeline = pipeline_index(VARIANT_SHADOW, xorshift32(&state) % NUM_PROGRAMS);
+		draw->sort_key = (0u << 30) | draw->pipeline;
+	}
+	for(uint32_t i = 0; i < NUM_OPAQUE_DRAWS; ++i, ++draw)
+	{
+		uint32_t variant = xorshift32(&state) % 4 == 0 ? VARIANT_ALPHA_TESTED : VARIANT_OPAQUE;
+		draw->pipeline = pipeline_index(variant, xorshift32(&state) % NUM_PROGRAMS);
+		draw->sort_key = (1u << 30) | draw->pipeline;
+	}
+	// Back to front, a handful of materials in random order
+	for(uint32_t i = 0; i < NUM_TRANSPARENT_DRAWS; ++i, ++draw)
+	{
+		uint32_t variant = xorshift32(&state) % 3 == 0 ? VARIANT_ADDITIVE : VARIANT_TRANSPARENT;
+		draw->pipeline = pipeline_index(variant, xorshift32(&state) % 4);
+		draw->sort_key = (2u << 30) | (xorshift32(&state) & 0xFFFFFF);
+	}
+
+	std::stable_sort(draws, draws + NUM_DRAWS, [](const draw_t& a, const draw_t& b) { return a.sort_key < b.sort_key; });
+}
+
+static void set_variant_state(vgpu_state_t* state, uint32_t variant)
+{
+	state->depth.func = VGPU_COMPARE_LESS_EQUAL;
+	switch(variant)
+	{
+		case VARIANT_SHADOW:
+			state->cull = VGPU_CULL_FRONT;
+			state->depth.enabled = true;
+			state->depth_bias = 4;
+			break;
+		case VARIANT_OPAQUE:
+			state->cull = VGPU_CULL_BACK;
+			state->depth.enabled = true;
+			break;
+		case VARIANT_ALPHA_TESTED:
+			state->cull = VGPU_CULL_NONE;
+			state->depth.enabled = true;
+			break;
+		case VARIANT_TRANSPARENT:
+		case VARIANT_ADDITIVE:
+			state->cull = VGPU_CULL_NONE;
+			state->depth.enabled = true;
+			state->blend[0].enabled = true;
+			state->blend[0].color_src = variant == VARIANT_ADDITIVE ? VGPU_BLEND_ELEM_ONE : VGPU_BLEND_ELEM_SRC_ALPHA;
+			state->blend[0].color_dst = variant == VARIANT_ADDITIVE ? VGPU_BLEND_ELEM_ONE : VGPU_BLEND_ELEM_INV_SRC_ALPHA;
+			state->blend[0].color_op = VGPU_BLEND_OP_ADD;
+			state->blend[0].alpha_src = VGPU_BLEND_ELEM_ONE;
+			state->blend[0].alpha_dst = VGPU_BLEND_ELEM_ONE;
+			state->blend[0].alpha_op = VGPU_BLEND_OP_ADD;
+			break;
+	}
+}
+
+static void run(const char* name, uint32_t force_disable_flags)
+{
+	vgpu_create_device_params_t device_params;
+	memset(&device_params, 0, sizeof(device_params));
+	device_params.error_func = error_func;
+	device_params.force_disable_flags = force_disable_flags;
+	vgpu_device_t* device = vgpu_create_device(&device_params);
+
+	vgpu_root_layout_slot_t slot;
+	memset(&slot, 0, sizeof(slot));
+	slot.type = VGPU_ROOT_SLOT_TYPE_TABLE;
+	vgpu_root_layout_t* root_layout = vgpu_create_root_layout(device, &slot, 1);
+
+	vgpu_create_program_params_t program_params;
+	memset(&program_params, 0, sizeof(program_params));
+	program_params.data = (const uint8_t*)vertex_glsl;
+	program_params.size = strlen(vertex_glsl);
+	program_params.program_type = VGPU_VERTEX_PROGRAM;
+	vgpu_program_t* vertex_program = vgpu_create_program(device, &program_params);
+
+	vgpu_program_t* fragment_programs[NUM_PROGRAMS];
+	for(uint32_t i = 0; i < NUM_PROGRAMS; ++i)
+	{
+		char source[256];
+		snprintf(source, sizeof(source), fragment_glsl, (float)i / NUM_PROGRAMS);
+		program_params.data = (const uint8_t*)source;
+		program_params.size = strlen(source);
+		program_params.program_type = VGPU_FRAGMENT_PROGRAM;
+		fragment_programs[i] = vgpu_create_program(device, &program_params);
+	}
+
+	vgpu_pipeline_t* pipelines[NUM_VARIANTS * NUM_PROGRAMS];
+	for(uint32_t v = 0; v < NUM_VARIANTS; ++v)
+	{
+		for(uint32_t p = 0; p < NUM_PROGRAMS; ++p)
+		{
+			vgpu_create_pipeline_params_t params;
+			memset(&params, 0, sizeof(params));
+			params.root_layout = root_layout;
+			params.vertex_program = vertex_program;
+			params.fragment_program = fragment_programs[p];
+			params.primitive_type = VGPU_PRIMITIVE_TRIANGLES;
+			set_variant_state(&params.state, v);
+			pipelines[pipeline_index(v, p)] = vgpu_create_pipeline(device, &params);
+		}
+	}
+
+	vgpu_create_thread_context_params_t thread_context_params;
+	memset(&thread_context_params, 0, sizeof(thread_context_params));
+	vgpu_thread_context_t* thread_context = vgpu_create_thread_context(device, &thread_context_params);
+
+	vgpu_create_command_list_params_t command_list_params;
+	memset(&command_list_params, 0, sizeof(command_list_params));
+	command_list_params.type = VGPU_COMMAND_LIST_IMMEDIATE_GRAPHICS;
+	vgpu_command_list_t* command_list = vgpu_create_command_list(device, &command_list_params);
+
+	uint32_t num_switches = 0;
+	for(uint32_t i = 0; i < NUM_DRAWS; ++i)
+		num_switches += (i == 0 || draws[i].pipeline != draws[i - 1].pipeline) ? 1 : 0;
+
+	// Switches only, then the full frame with draws
+	double switch_ns = 0.0;
+	double frame_ns = 0.0;
+	for(uint32_t f = 0; f < NUM_FRAMES; ++f)
+	{
+		vgpu_prepare_thread_context(device, thread_context);
+		vgpu_begin_command_list(thread_context, command_list, NULL);
+
+		auto start = std::chrono::high_resolution_clock::now();
+		for(uint32_t i = 0; i < NUM_DRAWS; ++i)
+		{
+			if(i == 0 || draws[i].pipeline != draws[i - 1].pipeline)
+				vgpu_set_pipeline(command_list, pipelines[draws[i].pipeline]);
+		}
+		auto middle = std::chrono::high_resolution_clock::now();
+		for(uint32_t i = 0; i < NUM_DRAWS; ++i)
+		{
+			if(i == 0 || draws[i].pipeline != draws[i - 1].pipeline)
+				vgpu_set_pipeline(command_list, pipelines[draws[i].pipeline]);
+			vgpu_draw(command_list, 0, 1, 0, 3);
+		}
+		auto end = std::chrono::high_resolution_clock::now();
+
+		vgpu_end_command_list(command_list);
+		vgpu_apply_command_lists(device, 1, &command_list);
+		vgpu_present(device);
+
+		if(f == 0)
+			continue;
+		switch_ns += (double)std::chrono::duration_cast<std::chrono::nanoseconds>(middle - start).count();
+		frame_ns += (double)std::chrono::duration_cast<std::chrono::nanoseconds>(end - middle).count();
+	}
+
+	printf("%-24s %10.1f ns %10.1f us\n", name, switch_ns / ((NUM_FRAMES - 1) * num_switches), frame_ns / (NUM_FRAMES - 1) / 1000.0);
+
+	vgpu_destroy_command_list(device, command_list);
+	vgpu_destroy_thread_context(device, thread_context);
+	for(uint32_t i = 0; i < NUM_VARIANTS * NUM_PROGRAMS; ++i)
+		vgpu_destroy_pipeline(device, pipelines[i]);
+	for(uint32_t i = 0; i < NUM_PROGRAMS; ++i)
+		vgpu_destroy_program(device, fragment_programs[i]);
+	vgpu_destroy_program(device, vertex_program);
+	vgpu_destroy_root_layout(device, root_layout);
+	vgpu_destroy_device(device);
+}
+
+int main(int argc, char** argv)
+{
+	build_frame();
+
+	uint32_t num_switches = 0;
+	for(uint32_t i = 0; i < NUM_DRAWS; ++i)
+		num_switches += (i == 0 || draws[i].pipeline != draws[i - 1].pipeline) ? 1 : 0;
+
+	printf("%u draws, %u pipeline switches per frame\n", NUM_DRAWS, num_switches);
+	printf("%-24s %13s %13s\n", "", "per switch", "per frame");
+	run("set everything", VGPU_CAPS_FLAG_PIPELINE_STATE_SHADOWING | VGPU_CAPS_FLAG_PIPELINE_TRANSITION_CACHE);
+	run("shadow state diff", VGPU_CAPS_FLAG_PIPELINE_TRANSITION_CACHE);
+	run("transition cache", 0);
+
+	return 0;
+}
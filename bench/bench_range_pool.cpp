@@ -0,0 +1,116 @@
+#include <stdio.h>
+#include <chrono>
+
+#include <vgpu.h>
+#include "vgpu_internal.h"
+#include "vgpu_range_pool.h"
+#include "vgpu_tlsf_pool.h"
+
+/******************************************************************************\
+ *
+ *  Randomized alloc/free trace, replayed identically on every pool
+ *
+\******************************************************************************/
+
+static const uint32_t NUM_IDS = 1000000; // same as the DX12 CBV/SRV/UAV heap
+static const uint32_t NUM_LIVE = 20000;
+static const uint32_t NUM_OPS = 200000;
+static const uint32_t MAX_RANGE = 32;
+
+struct trace_t
+{
+	uint32_t warmup_count[NUM_LIVE];
+	uint32_t victim[NUM_OPS];
+	uint32_t count[NUM_OPS];
+};
+
+struct live_range_t
+{
+	uint32_t offset;
+	uint32_t count;
+};
+
+static uint32_t xorshift32(uint32_t* state)
+{
+	uint32_t x = *state;
+	x ^= x << 13;
+	x ^= x >> 17;
+	x ^= x << 5;
+	*state = x;
+	return x;
+}
+
+static void generate_trace(trace_t* trace, uint32_t seed)
+{
+	uint32_t state = seed;
+	for(uint32_t i = 0; i < NUM_LIVE; ++i)
+		trace->warmup_count[i] = 1 + xorshift32(&state) % MAX_RANGE;
+	for(uint32_t i = 0; i < NUM_OPS; ++i)
+	{
+		trace->victim[i] = xorshift32(&state) % NUM_LIVE;
+		trace->count[i] = 1 + xorshift32(&state) % MAX_RANGE;
+	}
+}
+
+template<class POOL>
+static double run_trace(const char* name, POOL* pool, const trace_t* trace, live_range_t* live)
+{
+	for(uint32_t i = 0; i < NUM_LIVE; ++i)
+	{
+		live[i].count = trace->warmup_count[i];
+		live[i].offset = pool->alloc(live[i].count);
+	}
+
+	// Free every other range to start out fragmented
+	for(uint32_t i = 0; i < NUM_LIVE; i += 2)
+	{
+		pool->free(live[i].offset, live[i].count);
+		live[i].count = trace->warmup_count[(i + 1) % NUM_LIVE];
+		live[i].offset = pool->alloc(live[i].count);
+	}
+
+	auto start = std::chrono::high_resolution_clock::now();
+	for(uint32_t i = 0; i < NUM_OPS; ++i)
+	{
+		live_range_t* range = &live[trace->victim[i]];
+		pool->free(range->offset, range->count);
+		range->count = trace->count[i];
+		range->offset = pool->alloc(range->count);
+	}
+	auto end = std::chrono::high_resolution_clock::now();
+
+	for(uint32_t i = 0; i < NUM_LIVE; ++i)
+		pool->free(live[i].offset, live[i].count);
+
+	double ns = (double)std::chrono::duration_cast<std::chrono::nanoseconds>(end - start).count();
+	double ns_per_op = ns / (2.0 * NUM_OPS);
+	printf("%-24s %10.1f ns per alloc/free\n", name, ns_per_op);
+	return ns_per_op;
+}
+
+int main(int argc, char** argv)
+{
+	extern vgpu_allocator_t vgpu_allocator_default;
+	vgpu_allocator_t* allocator = &vgpu_allocator_default;
+
+	trace_t* trace = VGPU_ALLOC_TYPE(allocator, trace_t);
+	live_range_t* live = VGPU_ALLOC_ARRAY(allocator, NUM_LIVE, live_range_t);
+	generate_trace(trace, 0x1234567);
+
+	printf("%u ids, %u live ranges of 1-%u ids, %u free+alloc pairs\n", NUM_IDS, NUM_LIVE, MAX_RANGE, NUM_OPS);
+
+	{
+		vgpu_range_pool_t<uint32_t> pool(allocator, NUM_IDS);
+		run_trace("vgpu_range_pool_t", &pool, trace, live);
+	}
+
+	{
+		vgpu_tlsf_pool_t<uint32_t> pool(allocator, NUM_IDS);
+		run_trace("vgpu_tlsf_pool_t", &pool, trace, live);
+	}
+
+	VGPU_FREE(allocator, live);
+	VGPU_FREE(allocator, trace);
+
+	return 0;
+}
@@ -0,0 +1,229 @@
+#include <stdio.h>
+#include <string.h>
+
+#include <vgpu.h>
+#include "vgpu_internal.h"
+#include "vgpu_array.h"
+#include "vgpu_slab_pool.h"
+
+/******************************************************************************\
+ *
+ *  Runs a known sequence of allocations, reallocations and frees through a
+ *  tracking allocator and checks the per call site and per type numbers of
+ *  the JSON report against it, including allocations made inside templates
+ *
+\******************************************************************************/
+
+struct bench_item_t
+{
+	uint32_t a, b, c;
+};
+
+struct bench_object_t
+{
+	uint64_t a, b;
+};
+
+struct report_entry_t
+{
+	char type[128];
+	char file[256];
+	int line;
+	unsigned long long live_bytes;
+	unsigned long long peak_bytes;
+	unsigned long long live_count;
+	unsigned long long total_count;
+};
+
+static report_entry_t types[64];
+static report_entry_t sites[64];
+static uint32_t num_types;
+static uint32_t num_sites;
+static report_entry_t total;
+static int num_errors;
+
+// Reads the entry lines of the JSON report, one object per line
+static void log_func(const char* message)
+{
+	report_entry_t e;
+	memset(&e, 0, sizeof(e));
+	if(sscanf(message, "    { \"type\": \"%127[^\"]\", \"live_bytes\": %llu, \"peak_bytes\": %llu, \"live_count\": %llu, \"total_count\": %llu",
+		e.type, &e.live_bytes, &e.peak_bytes, &e.live_count, &e.total_count) == 5)
+	{
+		if(num_types < VGPU_ARRAY_LENGTH(types))
+			types[num_types++] = e;
+	}
+	else if(sscanf(message, "    { \"file\": \"%255[^\"]\", \"line\": %d, \"type\": \"%127[^\"]\", \"live_bytes\": %llu, \"peak_bytes\": %llu, \"live_count\": %llu, \"total_count\": %llu",
+		e.file, &e.line, e.type, &e.live_bytes, &e.peak_bytes, &e.live_count, &e.total_count) == 7)
+	{
+		if(num_sites < VGPU_ARRAY_LENGTH(sites))
+			sites[num_sites++] = e;
+	}
+	else if(sscanf(message, "  \"total\": { \"live_bytes\": %llu, \"peak_bytes\": %llu, \"live_count\": %llu, \"total_count\": %llu",
+		&total.live_bytes, &total.peak_bytes, &total.live_count, &total.total_count) == 4)
+	{
+		strcpy(total.type, "total");
+	}
+}
+
+static void report(vgpu_allocator_t* tracker)
+{
+	num_types = 0;
+	num_sites = 0;
+	memset(&total, 0, sizeof(total));
+	vgpu_dump_tracking_allocator(tracker, VGPU_ALLOCATION_REPORT_JSON, log_func);
+}
+
+static const report_entry_t* find_type(const char* name)
+{
+	for(uint32_t i = 0; i < num_types; ++i)
+	{
+		if(strcmp(types[i].type, name) == 0)
+			return &types[i];
+	}
+	return NULL;
+}
+
+static const report_entry_t* find_site(const char* file, int line)
+{
+	size_t file_length = strlen(file);
+	for(uint32_t i = 0; i < num_sites; ++i)
+	{
+		size_t length = strlen(sites[i].file);
+		if(sites[i].line == line && length >= file_length && strcmp(sites[i].file + length - file_length, file) == 0)
+			return &sites[i];
+	}
+	return NULL;
+}
+
+static void check(const char* what, const report_entry_t* e, unsigned long long live_bytes, unsigned long long peak_bytes, unsigned long long live_count, unsigned long long total_count)
+{
+	if(e == NULL)
+	{
+		printf("FAIL %s: missing from the report\n", what);
+		num_errors += 1;
+		return;
+	}
+
+	bool ok = e->live_bytes == live_bytes && e->peak_bytes == peak_bytes && e->live_count == live_count && e->total_count == total_count;
+	printf("%s %-40s %8llu %8llu %6llu %6llu", ok ? "ok  " : "FAIL", what, e->live_bytes, e->peak_bytes, e->live_count, e->total_count);
+	if(!ok)
+	{
+		printf("  expected %llu %llu %llu %llu", live_bytes, peak_bytes, live_count, total_count);
+		num_errors += 1;
+	}
+	printf("\n");
+}
+
+// Sites of a file in the order of their lines
+static uint32_t find_sites(const char* file, const report_entry_t** out, uint32_t max_sites)
+{
+	uint32_t n = 0;
+	size_t file_length = strlen(file);
+	for(uint32_t i = 0; i < num_sites && n < max_sites; ++i)
+	{
+		size_t length = strlen(sites[i].file);
+		if(length >= file_length && strcmp(sites[i].file + length - file_length, file) == 0)
+		{
+			uint32_t j = n++;
+			for(; j > 0 && out[j - 1]->line > sites[i].line; --j)
+				out[j] = out[j - 1];
+			out[j] = &sites[i];
+		}
+	}
+	return n;
+}
+
+int main(int argc, char** argv)
+{
+	vgpu_allocator_t* tracker = vgpu_create_tracking_allocator(NULL);
+	const size_t ITEM = sizeof(bench_item_t);
+
+	// Four items from one site, one of them freed again
+	bench_item_t* items[4];
+	const int items_line = __LINE__ + 2;
+	for(int i = 0; i < 4; ++i)
+		items[i] = VGPU_ALLOC_TYPE(tracker, bench_item_t);
+	VGPU_FREE(tracker, items[3]);
+
+	// An array that moves to a second site when it is reallocated
+	const int array_line = __LINE__ + 1;
+	uint64_t* values = VGPU_ALLOC_ARRAY(tracker, 16, uint64_t);
+	const int realloc_line = __LINE__ + 1;
+	values = VGPU_REALLOC_ARRAY(tracker, values, 64, uint64_t);
+
+	// A template allocation that has to be reported as bench_item_t, not T
+	{
+		vgpu_array_t<bench_item_t> array(tracker, 4);
+		for(uint32_t i = 0; i < 5; ++i)
+			array.push_back(bench_item_t());
+
+		report(tracker);
+
+		check("site items", find_site(__FILE__, items_line), 3 * ITEM, 4 * ITEM, 3, 4);
+		check("site array", find_site(__FILE__, array_line), 0, 16 * 8, 0, 1);
+		check("site realloc", find_site(__FILE__, realloc_line), 64 * 8, 64 * 8, 1, 1);
+		check("type uint64_t", find_type("uint64_t"), 64 * 8, (16 + 64) * 8, 1, 2);
+		check("type bench_item_t", find_type("bench_item_t"), 3 * ITEM + 8 * ITEM, 3 * ITEM + 12 * ITEM, 4, 6);
+		check("total", &total, 3 * ITEM + 64 * 8 + 8 * ITEM, 3 * ITEM + 64 * 8 + 12 * ITEM, 5, 8);
+
+		// Created with a capacity of 4 in vgpu_array_t::create, then grown to 8 in set_capacity
+		const report_entry_t* array_sites[2];
+		if(find_sites("vgpu_array.h", array_sites, 2) == 2)
+		{
+			check("site vgpu_array_t::create", array_sites[0], 0, 4 * ITEM, 0, 1);
+			check("site vgpu_array_t::set_capacity", array_sites[1], 8 * ITEM, 8 * ITEM, 1, 1);
+			for(uint32_t i = 0; i < 2; ++i)
+			{
+				if(strcmp(array_sites[i]->type, "bench_item_t") != 0)
+				{
+					printf("FAIL vgpu_array.h(%d) was reported as type %s\n", array_sites[i]->line, array_sites[i]->type);
+					num_errors += 1;
+				}
+			}
+		}
+		else
+		{
+			printf("FAIL expected two vgpu_array.h sites in the report\n");
+			num_errors += 1;
+		}
+
+		if(find_type("T"))
+		{
+			printf("FAIL a template allocation was reported as type T\n");
+			num_errors += 1;
+		}
+	}
+
+	// Everything freed leaves the peaks behind
+	VGPU_FREE(tracker, values);
+	for(int i = 0; i < 3; ++i)
+		VGPU_FREE(tracker, items[i]);
+
+	report(tracker);
+
+	check("type uint64_t freed", find_type("uint64_t"), 0, (16 + 64) * 8, 0, 2);
+	check("type bench_item_t freed", find_type("bench_item_t"), 0, 3 * ITEM + 12 * ITEM, 0, 6);
+	check("total freed", &total, 0, 3 * ITEM + 64 * 8 + 12 * ITEM, 0, 8);
+
+	// Slabs of a slab pool are reported under the pooled type
+	const size_t SLAB = VGPU_CACHE_LINE_SIZE + 4 * vgpu_slab_pool_t<bench_object_t>::SLOT_SIZE;
+	{
+		vgpu_slab_pool_t<bench_object_t> pool(tracker, 4);
+		for(uint32_t i = 0; i < 5; ++i)
+			pool.alloc();
+
+		report(tracker);
+
+		check("type bench_object_t", find_type("bench_object_t"), 2 * SLAB, 2 * SLAB, 2, 2);
+	}
+
+	report(tracker);
+
+	check("type bench_object_t freed", find_type("bench_object_t"), 0, 2 * SLAB, 0, 2);
+
+	vgpu_destroy_tracking_allocator(tracker);
+
+	printf("%d errors\n", num_errors);
+	return num_errors ? 1 : 0;
+}
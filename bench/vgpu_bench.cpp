@@ -0,0 +1,428 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <chrono>
+#include <thread>
+
+#include <vgpu.h>
+
+/******************************************************************************\
+ *
+ *  Per call cost of the command recording API, with 1 to 64 threads each
+ *  recording their own command list. Links against one backend library, see
+ *  bench/CMakeLists.txt. Prints a table, or JSON with --json.
+ *
+ *  The calls and vgpu_end_command_list are timed, ending the list flushes
+ *  work a backend deferred, like the merged draws of GL. Thread contexts are
+ *  prepared, command lists begun and the state a call needs is set before
+ *  the clock starts.
+ *
+\******************************************************************************/
+
+static const uint32_t NUM_FRAMES = 9; // the first one is warmup
+static const uint32_t MAX_THREADS = 64;
+static const uint32_t THREAD_COUNTS[] = { 1, 4, 16, 64 };
+static const size_t CONSTANTS_SIZE = 64;
+
+enum op_t
+{
+	OP_DRAW,
+	OP_SET_PIPELINE,
+	OP_SET_RESOURCE_TABLE,
+	OP_SET_BUFFER_DATA,
+	OP_LOCK_BUFFER,
+	NUM_OPS
+};
+
+static const char* op_names[NUM_OPS] = {
+	"vgpu_draw",
+	"vgpu_set_pipeline",
+	"vgpu_set_resource_table",
+	"vgpu_set_buffer_data",
+	"vgpu_lock_buffer",
+};
+
+static const char* device_names[] = { "null", "dx11", "dx12", "gl", "vk" };
+
+static const vgpu_error_check_mode_t NUM_ERROR_CHECK_MODES = (vgpu_error_check_mode_t)(VGPU_ERROR_CHECK_NONE + 1);
+static const char* error_check_mode_names[NUM_ERROR_CHECK_MODES] = { "full", "debug", "none" };
+
+// GL takes GLSL source, the null device takes anything
+static const char vertex_glsl[] =
+	"#version 440 core\n"
+	"void main() { gl_Position = vec4(0.0, 0.0, 0.0, 1.0); }\n";
+
+static const char fragment_glsl[] =
+	"#version 440 core\n"
+	"out vec4 color;\n"
+	"void main() { color = vec4(1.0); }\n";
+
+struct scene_t
+{
+	vgpu_device_t* device;
+	vgpu_device_type_t device_type;
+
+	// Vulkan needs SPIR-V to create pipelines, the ops that need one are skipped there
+	bool has_pipelines;
+	// GL has one immediate command list, recorded on the thread that owns the context
+	uint32_t max_threads;
+
+	vgpu_root_layout_t* root_layout;
+	vgpu_program_t* vertex_program;
+	vgpu_program_t* fragment_program;
+	vgpu_pipeline_t* pipelines[2];
+	vgpu_buffer_t* table_buffer;
+	vgpu_resource_table_t* resource_tables[2];
+};
+
+struct recorder_t
+{
+	vgpu_thread_context_t* thread_context;
+	vgpu_command_list_t* command_list;
+	vgpu_buffer_t* constants;
+
+	std::chrono::steady_clock::time_point start;
+	std::chrono::steady_clock::time_point end;
+};
+
+struct result_t
+{
+	bool skipped;
+	double ns_per_call;
+	double mcalls_per_s;
+};
+
+static int error_func(const char* file, unsigned int line, const char* cond, const char* fmt, ...)
+{
+	fprintf(stderr, "%s(%u): %s\n", file, line, cond);
+	return 0;
+}
+
+static vgpu_error_check_mode_t parse_error_check_mode(const char* name)
+{
+	for(int i = 0; i < NUM_ERROR_CHECK_MODES; ++i)
+	{
+		if(strcmp(name, error_check_mode_names[i]) == 0)
+			return (vgpu_error_check_mode_t)i;
+	}
+	return NUM_ERROR_CHECK_MODES;
+}
+
+static bool op_needs_pipeline(op_t op)
+{
+	return op == OP_DRAW || op == OP_SET_PIPELINE || op == OP_SET_RESOURCE_TABLE;
+}
+
+static vgpu_buffer_t* create_constant_buffer(vgpu_device_t* device, size_t num_bytes)
+{
+	vgpu_create_buffer_params_t params;
+	memset(&params, 0, sizeof(params));
+	params.num_bytes = num_bytes;
+	params.usage = VGPU_USAGE_DYNAMIC;
+	params.flags = VGPU_BUFFER_FLAG_CONSTANT_BUFFER;
+	params.name = "bench constants";
+	return vgpu_create_buffer(device, &params);
+}
+
+static vgpu_program_t* create_program(vgpu_device_t* device, vgpu_program_type_t type, const char* source)
+{
+	vgpu_create_program_params_t params;
+	memset(&params, 0, sizeof(params));
+	params.data = (const uint8_t*)source;
+	params.size = strlen(source);
+	params.program_type = type;
+	return vgpu_create_program(device, &params);
+}
+
+static void create_scene(scene_t* scene, vgpu_device_t* device)
+{
+	memset(scene, 0, sizeof(*scene));
+	scene->device = device;
+	scene->device_type = vgpu_get_device_type(device);
+	scene->has_pipelines = scene->device_type == VGPU_DEVICE_NULL || scene->device_type == VGPU_DEVICE_GL;
+	scene->max_threads = scene->device_type == VGPU_DEVICE_GL ? 1 : MAX_THREADS;
+
+	if(!scene->has_pipelines)
+		return;
+
+	vgpu_root_layout_slot_t slot;
+	memset(&slot, 0, sizeof(slot));
+	slot.type = VGPU_ROOT_SLOT_TYPE_TABLE;
+	slot.table.range_constant_buffers.count = 2;
+	scene->root_layout = vgpu_create_root_layout(device, &slot, 1);
+
+	scene->vertex_program = create_program(device, VGPU_VERTEX_PROGRAM, vertex_glsl);
+	scene->fragment_program = create_program(device, VGPU_FRAGMENT_PROGRAM, fragment_glsl);
+
+	for(int i = 0; i < 2; ++i)
+	{
+		vgpu_create_pipeline_params_t params;
+		memset(&params, 0, sizeof(params));
+		params.root_layout = scene->root_layout;
+		params.vertex_program = scene->vertex_program;
+		params.fragment_program = scene->fragment_program;
+		params.primitive_type = VGPU_PRIMITIVE_TRIANGLES;
+		params.state.cull = i == 0 ? VGPU_CULL_BACK : VGPU_CULL_NONE;
+		params.state.depth.enabled = i == 0;
+		params.state.depth.func = VGPU_COMPARE_LESS_EQUAL;
+		scene->pipelines[i] = vgpu_create_pipeline(device, &params);
+	}
+
+	scene->table_buffer = create_constant_buffer(device, 4 * CONSTANTS_SIZE);
+	for(int i = 0; i < 2; ++i)
+	{
+		vgpu_resource_table_entry_t entries[2];
+		memset(entries, 0, sizeof(entries));
+		for(int e = 0; e < 2; ++e)
+		{
+			entries[e].location = (uint8_t)e;
+			entries[e].type = VGPU_RESOURCE_BUFFER;
+			entries[e].resource = scene->table_buffer;
+			entries[e].offset = (size_t)(i * 2 + e) * CONSTANTS_SIZE;
+			entries[e].num_bytes = CONSTANTS_SIZE;
+			entries[e].treat_as_constant_buffer = true;
+		}
+		scene->resource_tables[i] = vgpu_create_resource_table(device, scene->root_layout, 0, entries, 2);
+	}
+}
+
+static void destroy_scene(scene_t* scene)
+{
+	if(!scene->has_pipelines)
+		return;
+
+	vgpu_device_t* device = scene->device;
+	for(int i = 0; i < 2; ++i)
+	{
+		vgpu_destroy_resource_table(device, scene->resource_tables[i]);
+		vgpu_destroy_pipeline(device, scene->pipelines[i]);
+	}
+	vgpu_destroy_buffer(device, scene->table_buffer);
+	vgpu_destroy_program(device, scene->vertex_program);
+	vgpu_destroy_program(device, scene->fragment_program);
+	vgpu_destroy_root_layout(device, scene->root_layout);
+}
+
+static void record(const scene_t* scene, recorder_t* recorder, op_t op, uint32_t num_calls)
+{
+	vgpu_command_list_t* command_list = recorder->command_list;
+	uint8_t constants[CONSTANTS_SIZE];
+	memset(constants, 0, sizeof(constants));
+
+	vgpu_prepare_thread_context(scene->device, recorder->thread_context);
+	vgpu_begin_command_list(recorder->thread_context, command_list, NULL);
+	if(op_needs_pipeline(op))
+	{
+		vgpu_set_pipeline(command_list, scene->pipelines[0]);
+		vgpu_set_resource_table(command_list, 0, scene->resource_tables[0]);
+	}
+
+	recorder->start = std::chrono::steady_clock::now();
+	switch(op)
+	{
+		case OP_DRAW:
+			for(uint32_t i = 0; i < num_calls; ++i)
+				vgpu_draw(command_list, 0, 1, 0, 3);
+			break;
+		case OP_SET_PIPELINE:
+			for(uint32_t i = 0; i < num_calls; ++i)
+				vgpu_set_pipeline(command_list, scene->pipelines[i & 1]);
+			break;
+		case OP_SET_RESOURCE_TABLE:
+			for(uint32_t i = 0; i < num_calls; ++i)
+				vgpu_set_resource_table(command_list, 0, scene->resource_tables[i & 1]);
+			break;
+		case OP_SET_BUFFER_DATA:
+			for(uint32_t i = 0; i < num_calls; ++i)
+			{
+				constants[0] = (uint8_t)i;
+				vgpu_set_buffer_data(command_list, recorder->constants, 0, constants, CONSTANTS_SIZE);
+			}
+			break;
+		case OP_LOCK_BUFFER:
+			for(uint32_t i = 0; i < num_calls; ++i)
+			{
+				vgpu_lock_buffer_params_t params;
+				memset(&params, 0, sizeof(params));
+				params.buffer = recorder->constants;
+				params.num_bytes = CONSTANTS_SIZE;
+				void* ptr = vgpu_lock_buffer(command_list, &params);
+				memcpy(ptr, constants, CONSTANTS_SIZE);
+				vgpu_unlock_buffer(command_list, &params);
+			}
+			break;
+		default:
+			break;
+	}
+	vgpu_end_command_list(command_list);
+	recorder->end = std::chrono::steady_clock::now();
+}
+
+static result_t run(const scene_t* scene, recorder_t* recorders, op_t op, uint32_t num_threads, uint32_t calls_per_frame)
+{
+	result_t result;
+	memset(&result, 0, sizeof(result));
+	if((op_needs_pipeline(op) && !scene->has_pipelines) || num_threads > scene->max_threads)
+	{
+		result.skipped = true;
+		return result;
+	}
+
+	vgpu_command_list_t* command_lists[MAX_THREADS];
+	for(uint32_t t = 0; t < num_threads; ++t)
+		command_lists[t] = recorders[t].command_list;
+
+	double thread_ns = 0.0;
+	double wall_ns = 0.0;
+	for(uint32_t f = 0; f < NUM_FRAMES; ++f)
+	{
+		std::thread threads[MAX_THREADS];
+		for(uint32_t t = 1; t < num_threads; ++t)
+			threads[t] = std::thread(record, scene, &recorders[t], op, calls_per_frame);
+		record(scene, &recorders[0], op, calls_per_frame);
+		for(uint32_t t = 1; t < num_threads; ++t)
+			threads[t].join();
+
+		vgpu_apply_command_lists(scene->device, num_threads, command_lists);
+		vgpu_present(scene->device);
+
+		if(f == 0)
+			continue;
+
+		std::chrono::steady_clock::time_point first_start = recorders[0].start;
+		std::chrono::steady_clock::time_point last_end = recorders[0].end;
+		for(uint32_t t = 0; t < num_threads; ++t)
+		{
+			thread_ns += (double)std::chrono::duration_cast<std::chrono::nanoseconds>(recorders[t].end - recorders[t].start).count();
+			if(recorders[t].start < first_start)
+				first_start = recorders[t].start;
+			if(recorders[t].end > last_end)
+				last_end = recorders[t].end;
+		}
+		wall_ns += (double)std::chrono::duration_cast<std::chrono::nanoseconds>(last_end - first_start).count();
+	}
+
+	double num_calls = (double)(NUM_FRAMES - 1) * num_threads * calls_per_frame;
+	result.ns_per_call = thread_ns / num_calls;
+	result.mcalls_per_s = num_calls / wall_ns * 1e3;
+	return result;
+}
+
+int main(int argc, char** argv)
+{
+	bool json = false;
+	uint32_t calls_per_frame = 2048;
+	vgpu_error_check_mode_t error_check_mode = VGPU_ERROR_CHECK_FULL;
+	for(int i = 1; i < argc; ++i)
+	{
+		if(strcmp(argv[i], "--json") == 0)
+			json = true;
+		else if(strcmp(argv[i], "--calls") == 0 && i + 1 < argc)
+			calls_per_frame = (uint32_t)atoi(argv[++i]);
+		else if(strcmp(argv[i], "--error-check") == 0 && i + 1 < argc && (error_check_mode = parse_error_check_mode(argv[i + 1])) != NUM_ERROR_CHECK_MODES)
+			++i;
+		else
+		{
+			fprintf(stderr, "usage: %s [--json] [--calls <calls per thread and frame>] [--error-check full|debug|none]\n", argv[0]);
+			return 1;
+		}
+	}
+
+	vgpu_create_device_params_t device_params;
+	memset(&device_params, 0, sizeof(device_params));
+	device_params.error_func = error_func;
+	device_params.error_check_mode = error_check_mode;
+	vgpu_device_t* device = vgpu_create_device(&device_params);
+
+	// The build can force a mode other than the one asked for
+	vgpu_caps_t caps;
+	vgpu_get_caps(device, &caps);
+	const char* error_check = error_check_mode_names[caps.error_check_mode];
+	const char* error_check_requested = error_check_mode_names[error_check_mode];
+
+	scene_t scene;
+	create_scene(&scene, device);
+
+	static recorder_t recorders[MAX_THREADS];
+	vgpu_create_thread_context_params_t thread_context_params;
+	memset(&thread_context_params, 0, sizeof(thread_context_params));
+	vgpu_create_command_list_params_t command_list_params;
+	memset(&command_list_params, 0, sizeof(command_list_params));
+	command_list_params.type = VGPU_COMMAND_LIST_GRAPHICS;
+	if(!vgpu_is_command_list_type_supported(device, VGPU_COMMAND_LIST_GRAPHICS))
+		command_list_params.type = VGPU_COMMAND_LIST_IMMEDIATE_GRAPHICS;
+	for(uint32_t t = 0; t < scene.max_threads; ++t)
+	{
+		recorders[t].thread_context = vgpu_create_thread_context(device, &thread_context_params);
+		recorders[t].command_list = vgpu_create_command_list(device, &command_list_params);
+		recorders[t].constants = create_constant_buffer(device, CONSTANTS_SIZE);
+	}
+
+	const uint32_t num_thread_counts = sizeof(THREAD_COUNTS) / sizeof(THREAD_COUNTS[0]);
+	result_t results[NUM_OPS][num_thread_counts];
+	for(int op = 0; op < NUM_OPS; ++op)
+		for(uint32_t i = 0; i < num_thread_counts; ++i)
+			results[op][i] = run(&scene, recorders, (op_t)op, THREAD_COUNTS[i], calls_per_frame);
+
+	const char* device_name = device_names[scene.device_type];
+	if(json)
+	{
+		printf("{\n");
+		printf("  \"device\": \"%s\",\n", device_name);
+		printf("  \"error_check\": \"%s\",\n", error_check);
+		printf("  \"error_check_requested\": \"%s\",\n", error_check_requested);
+		printf("  \"calls_per_thread_per_frame\": %u,\n", calls_per_frame);
+		printf("  \"frames\": %u,\n", NUM_FRAMES - 1);
+		printf("  \"hardware_threads\": %u,\n", std::thread::hardware_concurrency());
+		printf("  \"results\": [\n");
+		bool first = true;
+		for(int op = 0; op < NUM_OPS; ++op)
+		{
+			for(uint32_t i = 0; i < num_thread_counts; ++i)
+			{
+				const result_t& r = results[op][i];
+				if(r.skipped)
+					continue;
+				printf("%s    { \"call\": \"%s\", \"threads\": %u, \"ns_per_call\": %.2f, \"mcalls_per_s\": %.2f }", first ? "" : ",\n", op_names[op], THREAD_COUNTS[i], r.ns_per_call, r.mcalls_per_s);
+				first = false;
+			}
+		}
+		printf("\n  ]\n");
+		printf("}\n");
+	}
+	else
+	{
+		printf("%s device, %s error checks, %u calls per thread and frame, %u frames, %u hardware threads\n", device_name, error_check, calls_per_frame, NUM_FRAMES - 1, std::thread::hardware_concurrency());
+		if(caps.error_check_mode != error_check_mode)
+			printf("%s error checks were asked for, the build forces %s\n", error_check_requested, error_check);
+		printf("ns per call (Mcalls/s over all threads)\n");
+		printf("%-24s", "");
+		for(uint32_t i = 0; i < num_thread_counts; ++i)
+			printf(" %12u thread%s", THREAD_COUNTS[i], THREAD_COUNTS[i] == 1 ? " " : "s");
+		printf("\n");
+		for(int op = 0; op < NUM_OPS; ++op)
+		{
+			printf("%-24s", op_names[op]);
+			for(uint32_t i = 0; i < num_thread_counts; ++i)
+			{
+				const result_t& r = results[op][i];
+				if(r.skipped)
+					printf(" %20s", "-");
+				else
+					printf(" %7.1f (%9.2f)", r.ns_per_call, r.mcalls_per_s);
+			}
+			printf("\n");
+		}
+	}
+
+	for(uint32_t t = 0; t < scene.max_threads; ++t)
+	{
+		vgpu_destroy_buffer(device, recorders[t].constants);
+		vgpu_destroy_command_list(device, recorders[t].command_list);
+		vgpu_destroy_thread_context(device, recorders[t].thread_context);
+	}
+	destroy_scene(&scene);
+	vgpu_destroy_device(device);
+
+	return 0;
+}
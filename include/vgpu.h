@@ -1,6 +1,7 @@
 #ifndef VGPU_H
 #define VGPU_H
 
+#include <stddef.h>
 #include <stdint.h>
 
 #ifdef __cplusplus
@@ -45,8 +46,29 @@ typedef enum
 {
 	VGPU_CAPS_FLAG_BIND_CONSTANT_BUFFER_AT_OFFSET = 0x1,
 	VGPU_CAPS_FLAG_BIND_BUFFER_AT_OFFSET = 0x2,
+	// GL: vgpu_set_pipeline skips state that is already set
+	VGPU_CAPS_FLAG_PIPELINE_STATE_SHADOWING = 0x4,
+	// GL: vgpu_set_pipeline looks up the state to change from a cache of pipeline pairs
+	VGPU_CAPS_FLAG_PIPELINE_TRANSITION_CACHE = 0x8,
+	// vgpu_draw_indirect_count and vgpu_draw_indexed_indirect_count are supported
+	VGPU_CAPS_FLAG_DRAW_INDIRECT_COUNT = 0x10,
+	// GL: runs of non instanced draws with the same state are merged into multi draws
+	VGPU_CAPS_FLAG_DRAW_MERGING = 0x20,
+	// vgpu_create_pipeline returns before the driver has compiled the pipeline,
+	// poll vgpu_is_pipeline_ready to not stall on first use
+	VGPU_CAPS_FLAG_ASYNC_PIPELINE_COMPILE = 0x40,
 } vgpu_caps_flag_t;
 
+typedef enum
+{
+	// Check for errors after API calls, and report what debug output the driver has
+	VGPU_ERROR_CHECK_FULL = 0,
+	// Only report what the driver sends to its debug output, no round trips
+	VGPU_ERROR_CHECK_DEBUG_OUTPUT,
+	// No checks, on GL a KHR_no_error context when the driver has it
+	VGPU_ERROR_CHECK_NONE,
+} vgpu_error_check_mode_t;
+
 typedef enum
 {
 	VGPU_USAGE_DEFAULT = 0,
@@ -203,6 +225,12 @@ typedef enum
 	VGPU_ROOT_SLOT_TYPE_RESOURCE,
 } vgpu_root_slot_type_t;
 
+typedef enum
+{
+	VGPU_ALLOCATION_REPORT_TEXT = 0,
+	VGPU_ALLOCATION_REPORT_JSON,
+} vgpu_allocation_report_format_t;
+
 /******************************************************************************\
 *
 *  Internal types
@@ -220,6 +248,12 @@ typedef struct vgpu_program_s vgpu_program_t;
 typedef struct vgpu_pipeline_s vgpu_pipeline_t;
 typedef struct vgpu_render_pass_s vgpu_render_pass_t;
 
+// Generational handle, the zero handle is never valid
+typedef struct vgpu_buffer_handle_s
+{
+	uint32_t id;
+} vgpu_buffer_handle_t;
+
 /******************************************************************************\
 *
 *  Allocation interface
@@ -242,8 +276,38 @@ typedef struct vgpu_allocator_s
 typedef struct
 {
 	uint32_t flags;
+	// Mode the device runs with, which is not the one asked for when the
+	// build forces it. Devices that don't check errors report the one asked for.
+	vgpu_error_check_mode_t error_check_mode;
 } vgpu_caps_t;
 
+typedef struct
+{
+	// Time vgpu_present waited for the GPU to finish the frame that used the
+	// same slot of frame resources, in the last present and in all of them
+	uint64_t last_wait_us;
+	uint64_t total_wait_us;
+	// Presents that had to wait at all
+	uint64_t num_waits;
+	// Draws recorded in the last frame, and the draw calls that reached the
+	// driver after merging. GL only for now
+	uint64_t num_draws;
+	uint64_t num_driver_draws;
+} vgpu_frame_stats_t;
+
+typedef struct
+{
+	// Device memory allocations made with the driver, the dedicated ones hold
+	// a single resource. Vulkan only for now
+	uint64_t num_blocks;
+	uint64_t num_dedicated_blocks;
+	// Bytes allocated with the driver and bytes handed out to resources, the
+	// difference is lost to alignment and free space in the blocks
+	uint64_t allocated_bytes;
+	uint64_t used_bytes;
+	uint64_t num_allocations;
+} vgpu_memory_stats_t;
+
 typedef struct
 {
 	uint32_t num_vertices;
@@ -268,12 +332,26 @@ typedef struct vgpu_create_device_params_s
 {
 	vgpu_allocator_t* allocator;
 
+	// Native window to present to. The GL device on Linux takes an
+	// EGLNativeWindowType, or NULL to render to an offscreen back buffer.
 	void* window;
 
 	uint32_t force_disable_flags;
 
 	vgpu_log_func_t log_func;
 	vgpu_error_func_t error_func;
+
+	// Number of buffers that can be created through vgpu_create_buffer_handle,
+	// 0 disables buffer handles. At most 1 << 20.
+	uint32_t max_buffer_handles;
+
+	// Only used by the GL device for now. GL builds with VGPU_GL_NO_ERROR_CHECKS
+	// always run VGPU_ERROR_CHECK_NONE.
+	vgpu_error_check_mode_t error_check_mode;
+
+	// Existing directory to keep compiled pipelines in between runs, NULL
+	// disables the cache. Only used by the GL and Vulkan devices for now.
+	const char* pipeline_cache_path;
 } vgpu_create_device_params_t;
 
 typedef struct vgpu_create_thread_context_params_s
@@ -451,6 +529,7 @@ typedef struct vgpu_render_pass_target_param_s
 {
 	vgpu_texture_t* texture;
 	uint32_t clear_on_bind; // TODO: more fine grained begin/end operations
+	uint32_t discard_on_unbind; // contents aren't needed after the pass, only used by GL for now
 } vgpu_render_pass_target_param_t;
 
 typedef struct vgpu_create_render_pass_params_s
@@ -460,6 +539,23 @@ typedef struct vgpu_create_render_pass_params_s
 	vgpu_render_pass_target_param_t depth_stencil_target;
 } vgpu_create_render_pass_params_t;
 
+/******************************************************************************\
+*
+*  Allocation tracking
+*
+\******************************************************************************/
+
+// Wraps parent (the default allocator if NULL) in an allocator that counts
+// live bytes, peak bytes and allocations per call site and per type. Pass it
+// as vgpu_create_device_params_t::allocator, it has to outlive the device.
+vgpu_allocator_t* vgpu_create_tracking_allocator(vgpu_allocator_t* parent);
+
+void vgpu_destroy_tracking_allocator(vgpu_allocator_t* allocator);
+
+// Logs the statistics sorted by live bytes, one line per log_func call. Safe
+// to call while other threads allocate.
+void vgpu_dump_tracking_allocator(vgpu_allocator_t* allocator, vgpu_allocation_report_format_t format, vgpu_log_func_t log_func);
+
 /******************************************************************************\
 *
 *  Device operations
@@ -486,6 +582,14 @@ uint64_t vgpu_max_buffered_frames(vgpu_device_t* device);
 
 void vgpu_get_caps(vgpu_device_t* device, vgpu_caps_t* out_caps);
 
+void vgpu_get_frame_stats(vgpu_device_t* device, vgpu_frame_stats_t* out_stats);
+
+void vgpu_get_memory_stats(vgpu_device_t* device, vgpu_memory_stats_t* out_stats);
+
+// Writes the pipeline cache to pipeline_cache_path right away instead of
+// waiting for vgpu_destroy_device. Returns false if nothing was written
+bool vgpu_save_pipeline_cache(vgpu_device_t* device);
+
 /******************************************************************************\
 *
 *  Thread context handling
@@ -498,6 +602,12 @@ void vgpu_destroy_thread_context(vgpu_device_t* device, vgpu_thread_context_t* t
 
 void vgpu_prepare_thread_context(vgpu_device_t* device, vgpu_thread_context_t* thread_context);
 
+// Scratch memory for the frame being recorded on this thread context. Memory
+// stays valid until the context is prepared for the same frame slot again,
+// allocating is a pointer bump and freeing is not needed. Only use it from the
+// thread that owns the context.
+vgpu_allocator_t* vgpu_get_thread_frame_allocator(vgpu_thread_context_t* thread_context);
+
 /******************************************************************************\
 *
 *  Buffer handling
@@ -508,6 +618,20 @@ vgpu_buffer_t* vgpu_create_buffer(vgpu_device_t* device, const vgpu_create_buffe
 
 void vgpu_destroy_buffer(vgpu_device_t* device, vgpu_buffer_t* buffer);
 
+// Same as vgpu_create_buffer, but the buffer lives in a dense table owned by
+// the device and is referred to by a handle that detects use after destroy.
+// Returns the zero handle when the table is full. Only buffers have handles
+// for now, textures are created through the pointer API.
+vgpu_buffer_handle_t vgpu_create_buffer_handle(vgpu_device_t* device, const vgpu_create_buffer_params_t* params);
+
+void vgpu_destroy_buffer_handle(vgpu_device_t* device, vgpu_buffer_handle_t handle);
+
+bool vgpu_is_buffer_handle_valid(vgpu_device_t* device, vgpu_buffer_handle_t handle);
+
+// The buffer behind a handle, for functions that take a buffer pointer. NULL
+// if the handle is stale. The pointer stays valid until the handle is destroyed.
+vgpu_buffer_t* vgpu_get_buffer(vgpu_device_t* device, vgpu_buffer_handle_t handle);
+
 /******************************************************************************\
 *
 *  Resource table handling
@@ -518,6 +642,11 @@ vgpu_resource_table_t* vgpu_create_resource_table(vgpu_device_t* device, const v
 
 void vgpu_destroy_resource_table(vgpu_device_t* device, vgpu_resource_table_t* resource_table);
 
+// Moves resource tables towards the start of the descriptor heap so large
+// tables can still be allocated after long runtimes. Meant to be called once
+// per frame, stops after roughly time_budget_us microseconds.
+void vgpu_compact_resource_tables(vgpu_device_t* device, uint32_t time_budget_us);
+
 /******************************************************************************\
 *
 *  Root layout handling
@@ -558,6 +687,10 @@ vgpu_pipeline_t* vgpu_create_pipeline(vgpu_device_t* device, const vgpu_create_p
 
 void vgpu_destroy_pipeline(vgpu_device_t* device, vgpu_pipeline_t* pipeline);
 
+// False while the driver is still compiling the pipeline, setting it before
+// then waits for the compile. Always true without VGPU_CAPS_FLAG_ASYNC_PIPELINE_COMPILE
+bool vgpu_is_pipeline_ready(vgpu_device_t* device, vgpu_pipeline_t* pipeline);
+
 /******************************************************************************\
 *
 *  Render pass handling
@@ -590,6 +723,9 @@ void vgpu_begin_command_list(vgpu_thread_context_t* thread_context, vgpu_command
 
 void vgpu_end_command_list(vgpu_command_list_t* command_list);
 
+// On a DEFAULT buffer the data is copied in when the command list executes,
+// in order with the commands recorded around it. On Vulkan a copy inside of a
+// render pass ends the pass and resumes it without clearing.
 void* vgpu_lock_buffer(vgpu_command_list_t* command_list, vgpu_lock_buffer_params_t* params);
 
 void vgpu_unlock_buffer(vgpu_command_list_t* command_list, const vgpu_lock_buffer_params_t* params);
@@ -604,13 +740,25 @@ void vgpu_set_pipeline(vgpu_command_list_t* command_list, vgpu_pipeline_t* pipel
 
 void vgpu_set_index_buffer(vgpu_command_list_t* command_list, vgpu_data_type_t index_type, vgpu_buffer_t* index_buffer);
 
+void vgpu_set_buffer_handle(vgpu_command_list_t* command_list, uint32_t slot, vgpu_buffer_handle_t buffer, size_t offset, size_t num_bytes);
+
+void vgpu_set_index_buffer_handle(vgpu_command_list_t* command_list, vgpu_data_type_t index_type, vgpu_buffer_handle_t index_buffer);
+
 void vgpu_draw(vgpu_command_list_t* command_list, uint32_t first_instance, uint32_t num_instances, uint32_t first_vertex, uint32_t num_vertices);
 
 void vgpu_draw_indexed(vgpu_command_list_t* command_list, uint32_t first_instance, uint32_t num_instances, uint32_t first_index, uint32_t num_indices, uint32_t first_vertex);
 
-void vgpu_draw_indirect(vgpu_command_list_t* command_list, vgpu_buffer_t* buffer, uint32_t count);
+// count draws with tightly packed vgpu_draw_indirect_args_t starting at offset in buffer
+void vgpu_draw_indirect(vgpu_command_list_t* command_list, vgpu_buffer_t* buffer, uint64_t offset, uint32_t count);
+
+// count draws with tightly packed vgpu_draw_indexed_indirect_args_t starting at offset in buffer
+void vgpu_draw_indexed_indirect(vgpu_command_list_t* command_list, vgpu_buffer_t* buffer, uint64_t offset, uint32_t count);
+
+// Same as above, with the number of draws read from a uint32_t at count_offset in count_buffer, clamped to max_count.
+// Needs VGPU_CAPS_FLAG_DRAW_INDIRECT_COUNT
+void vgpu_draw_indirect_count(vgpu_command_list_t* command_list, vgpu_buffer_t* buffer, uint64_t offset, vgpu_buffer_t* count_buffer, uint64_t count_offset, uint32_t max_count);
 
-void vgpu_draw_indexed_indirect(vgpu_command_list_t* command_list, vgpu_buffer_t* buffer, uint32_t count);
+void vgpu_draw_indexed_indirect_count(vgpu_command_list_t* command_list, vgpu_buffer_t* buffer, uint64_t offset, vgpu_buffer_t* count_buffer, uint64_t count_offset, uint32_t max_count);
 
 void vgpu_blit(vgpu_command_list_t* command_list, vgpu_texture_t* texture);
 
@@ -1,16 +1,27 @@
 #include "vgpu_internal.h"
 
+#include <stdio.h>
+#include <string.h>
+
 #if defined(VGPU_WINDOWS)
 #	include <malloc.h>
+#	include <windows.h>
+#elif defined(VGPU_UNIX)
+#	include <stdlib.h>
+#	include <time.h>
 #endif
 
-void* vgpu_alloc_wrapper(vgpu_allocator_t* allocator, size_t count, size_t size, size_t align, const char* file, int line)
+thread_local const char* vgpu_alloc_type_name = NULL;
+
+void* vgpu_alloc_wrapper(vgpu_allocator_t* allocator, size_t count, size_t size, size_t align, const char* type_name, const char* file, int line)
 {
+	vgpu_alloc_type_name = type_name;
 	return allocator->alloc(allocator, count, size, align, file, line);
 }
 
-void* vgpu_realloc_wrapper(vgpu_allocator_t* allocator, void* memory, size_t count, size_t size, size_t align, const char* file, int line)
+void* vgpu_realloc_wrapper(vgpu_allocator_t* allocator, void* memory, size_t count, size_t size, size_t align, const char* type_name, const char* file, int line)
 {
+	vgpu_alloc_type_name = type_name;
 	return allocator->realloc(allocator, memory, count, size, align, file, line);
 }
 
@@ -19,6 +30,60 @@ void vgpu_free_wrapper(vgpu_allocator_t* allocator, void* memory, const char* fi
 	allocator->free(allocator, memory, file, line);
 }
 
+vgpu_type_name_t::vgpu_type_name_t(const char* signature)
+{
+	// GCC and clang: "... vgpu_type_name() [with T = name]" or "[T = name]"
+	// MSVC: "... vgpu_type_name<struct name>(void)"
+	const char* begin = strstr(signature, "T = ");
+	if(begin)
+		begin += 4;
+	else if((begin = strstr(signature, "vgpu_type_name<")) != NULL)
+		begin += 15;
+	else
+		begin = signature;
+
+	static const char* const prefixes[] = { "struct ", "class ", "enum ", "union " };
+	for(size_t i = 0; i < VGPU_ARRAY_LENGTH(prefixes); ++i)
+	{
+		if(strncmp(begin, prefixes[i], strlen(prefixes[i])) == 0)
+			begin += strlen(prefixes[i]);
+	}
+
+	// Stop at the end of the template argument, nested ones are kept
+	size_t n = 0;
+	int depth = 0;
+	for(const char* c = begin; *c && n + 1 < sizeof(name); ++c)
+	{
+		if(*c == '<')
+			++depth;
+		else if(*c == '>' && depth-- == 0)
+			break;
+		else if((*c == ']' || *c == ';') && depth == 0)
+			break;
+		name[n++] = *c;
+	}
+	name[n] = 0;
+}
+
+uint64_t vgpu_time_us()
+{
+#if defined(VGPU_WINDOWS)
+	static LARGE_INTEGER frequency;
+	if(frequency.QuadPart == 0)
+		QueryPerformanceFrequency(&frequency);
+
+	LARGE_INTEGER counter;
+	QueryPerformanceCounter(&counter);
+	return (uint64_t)(counter.QuadPart / frequency.QuadPart) * 1000000 + (uint64_t)(counter.QuadPart % frequency.QuadPart) * 1000000 / frequency.QuadPart;
+#elif defined(VGPU_UNIX)
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000 + (uint64_t)ts.tv_nsec / 1000;
+#else
+#	error Not implemented for this platform.
+#endif
+}
+
 void* vgpu_default_alloc(vgpu_allocator_t* allocator, size_t count, size_t size, size_t align, const char* file, int line)
 {
 	(void)allocator;
@@ -63,6 +128,66 @@ void vgpu_default_free(vgpu_allocator_t* allocator, void* memory, const char* fi
 #endif
 }
 
+uint64_t vgpu_hash(const void* data, size_t size, uint64_t seed)
+{
+	const uint8_t* bytes = (const uint8_t*)data;
+	uint64_t hash = seed;
+	for(size_t i = 0; i < size; ++i)
+	{
+		hash ^= bytes[i];
+		hash *= 0x100000001b3ull;
+	}
+	return hash;
+}
+
+void* vgpu_read_file(vgpu_allocator_t* allocator, const char* path, size_t* out_size)
+{
+	FILE* file = fopen(path, "rb");
+	if(file == NULL)
+		return NULL;
+
+	void* data = NULL;
+	long size = -1;
+	if(fseek(file, 0, SEEK_END) == 0)
+		size = ftell(file);
+	if(size > 0 && fseek(file, 0, SEEK_SET) == 0)
+	{
+		data = VGPU_ALLOC(allocator, (size_t)size, 16);
+		if(fread(data, 1, (size_t)size, file) != (size_t)size)
+		{
+			VGPU_FREE(allocator, data);
+			data = NULL;
+		}
+	}
+	fclose(file);
+
+	*out_size = data ? (size_t)size : 0;
+	return data;
+}
+
+bool vgpu_write_file(const char* path, const void* data, size_t size)
+{
+	char temp_path[1024];
+	if(snprintf(temp_path, sizeof(temp_path), "%s.tmp", path) >= (int)sizeof(temp_path))
+		return false;
+
+	FILE* file = fopen(temp_path, "wb");
+	if(file == NULL)
+		return false;
+	bool written = fwrite(data, 1, size, file) == size;
+	written = fclose(file) == 0 && written;
+
+#if defined(VGPU_WINDOWS)
+	if(written && MoveFileExA(temp_path, path, MOVEFILE_REPLACE_EXISTING))
+		return true;
+#else
+	if(written && rename(temp_path, path) == 0)
+		return true;
+#endif
+	remove(temp_path);
+	return false;
+}
+
 vgpu_allocator_t vgpu_allocator_default = {
 	vgpu_default_alloc,
 	vgpu_default_realloc,
@@ -4,6 +4,7 @@
 #ifdef __cplusplus
 
 #include <stdint.h>
+#include <string.h>
 #include "vgpu_internal.h"
 
 template<class T>
@@ -13,17 +14,20 @@ struct vgpu_array_t
 	size_t _capacity;
 	size_t _length;
 	vgpu_allocator_t* _alloc;
+	T* _inline; // storage of vgpu_small_array_t, never freed
 
-	vgpu_array_t() : _ptr(NULL), _capacity(0), _length(0), _alloc(NULL) { }
+	enum { MIN_GROW_CAPACITY = 8 };
 
-	vgpu_array_t(vgpu_allocator_t* alloc, size_t capacity = 0) : _ptr(NULL), _capacity(0), _length(0), _alloc(NULL)
+	vgpu_array_t() : _ptr(NULL), _capacity(0), _length(0), _alloc(NULL), _inline(NULL) { }
+
+	vgpu_array_t(vgpu_allocator_t* alloc, size_t capacity = 0) : _ptr(NULL), _capacity(0), _length(0), _alloc(NULL), _inline(NULL)
 	{
 		create(alloc, capacity);
 	}
 
 	~vgpu_array_t()
 	{
-		if(_alloc)
+		if(_alloc && _ptr != _inline)
 			VGPU_FREE(_alloc, _ptr);
 	}
 
@@ -34,7 +38,7 @@ struct vgpu_array_t
 		_capacity = capacity;
 		_length = 0;
 		if(capacity)
-			_ptr = (T*)VGPU_ALLOC_ARRAY(alloc, capacity, T);
+			_ptr = (T*)VGPU_ALLOC_ARRAY_T(alloc, capacity, T);
 	}
 
 	void set_capacity(size_t new_capacity)
@@ -42,7 +46,17 @@ struct vgpu_array_t
 		VGPU_HARD_ASSERT(_alloc != NULL, "array was not created before calling set_capacity");
 		VGPU_HARD_ASSERT(new_capacity >= _capacity, "array cannot shrink in size for now");
 
-		_ptr = VGPU_REALLOC_ARRAY(_alloc, _ptr, new_capacity, T);
+		if(_inline != NULL && _ptr == _inline)
+		{
+			// Moving out of the inline storage, which cannot be reallocated
+			T* ptr = VGPU_ALLOC_ARRAY_T(_alloc, new_capacity, T);
+			memcpy(ptr, _ptr, _length * sizeof(T));
+			_ptr = ptr;
+		}
+		else
+		{
+			_ptr = VGPU_REALLOC_ARRAY_T(_alloc, _ptr, new_capacity, T);
+		}
 		_capacity = new_capacity;
 	}
 
@@ -180,6 +194,25 @@ struct vgpu_array_t
 		_length += 1;
 	}
 
+	// Like append, but doubles the capacity when the array is full
+	void push_back(const T& val)
+	{
+		if(_length == _capacity)
+			grow(_capacity ? 0 : MIN_GROW_CAPACITY);
+		memcpy(_ptr + _length, &val, sizeof(T));
+		_length += 1;
+	}
+
+	// Adds a value initialized element and returns it, growing like push_back
+	T& emplace()
+	{
+		if(_length == _capacity)
+			grow(_capacity ? 0 : MIN_GROW_CAPACITY);
+		T* val = new (_ptr + _length) T();
+		_length += 1;
+		return *val;
+	}
+
 	void insert_at(size_t i, const T& val)
 	{
 		VGPU_HARD_ASSERT(_length < _capacity, "cannot add beyond capacity");
@@ -190,6 +223,36 @@ struct vgpu_array_t
 	}
 };
 
+// vgpu_array_t with room for N elements inside the object itself, so arrays
+// that rarely hold more than N elements never touch the allocator. Grows onto
+// the heap like a normal array when more are added. Not copyable, the array
+// points into itself.
+template<class T, size_t N>
+struct vgpu_small_array_t : vgpu_array_t<T>
+{
+	alignas(T) uint8_t _storage[N * sizeof(T)];
+
+	vgpu_small_array_t() : vgpu_array_t<T>() { }
+
+	vgpu_small_array_t(vgpu_allocator_t* alloc) : vgpu_array_t<T>()
+	{
+		create(alloc);
+	}
+
+	void create(vgpu_allocator_t* alloc)
+	{
+		this->_alloc = alloc;
+		this->_inline = (T*)_storage;
+		this->_ptr = this->_inline;
+		this->_capacity = N;
+		this->_length = 0;
+	}
+
+private:
+	vgpu_small_array_t(const vgpu_small_array_t&);
+	vgpu_small_array_t& operator=(const vgpu_small_array_t&);
+};
+
 #endif
 
 #endif // VGPU_ARRAY_H
@@ -0,0 +1,148 @@
+#ifndef VGPU_ATOMIC_ID_POOL_H
+#define VGPU_ATOMIC_ID_POOL_H
+
+#include <stdint.h>
+#include "vgpu_internal.h"
+
+#ifdef __cplusplus
+
+#include <atomic>
+
+// Same interface as vgpu_id_pool_t, but alloc_handle and free_handle can be
+// called from any number of threads at once.
+//
+// The free ids form a Treiber stack linked through _next. The head packs the
+// top index with a tag that is bumped on every push and pop, so a thread that
+// was preempted between reading the head and swapping it cannot succeed after
+// the same index was popped and pushed again in the meantime (ABA).
+template<class TH = uint16_t>
+struct vgpu_atomic_id_pool_t
+{
+	static const uint32_t INVALID_INDEX = 0xFFFFFFFF;
+
+	vgpu_allocator_t*          _alloc;
+	size_t                     _capacity;
+	std::atomic<size_t>        _num_free;
+	std::atomic<uint64_t>      _head;
+	std::atomic<uint32_t>*     _next;
+
+	vgpu_atomic_id_pool_t() : _alloc(NULL), _capacity(0), _num_free(0), _head(pack(0, INVALID_INDEX)), _next(NULL) {}
+
+	vgpu_atomic_id_pool_t(vgpu_allocator_t* alloc, size_t capacity) : _alloc(NULL), _capacity(0), _num_free(0), _head(pack(0, INVALID_INDEX)), _next(NULL)
+	{
+		create(alloc, capacity);
+	}
+
+	~vgpu_atomic_id_pool_t()
+	{
+		destroy();
+	}
+
+	// Not thread safe, call before the pool is shared
+	void create(vgpu_allocator_t* alloc, size_t capacity)
+	{
+		VGPU_HARD_ASSERT(capacity < INVALID_INDEX, "capacity too large");
+
+		_alloc = alloc;
+		_capacity = capacity;
+		_next = VGPU_ALLOC_ARRAY(alloc, capacity, std::atomic<uint32_t>);
+
+		// Hand out ids in ascending order like vgpu_id_pool_t
+		for(size_t i = 0; i < capacity; ++i)
+			_next[i].store(i + 1 < capacity ? (uint32_t)(i + 1) : INVALID_INDEX, std::memory_order_relaxed);
+
+		_num_free.store(capacity, std::memory_order_relaxed);
+		_head.store(pack(0, capacity ? 0 : INVALID_INDEX), std::memory_order_release);
+	}
+
+	// Not thread safe, no other thread may use the pool anymore
+	void destroy()
+	{
+		if(_alloc)
+			VGPU_FREE(_alloc, _next);
+
+		_alloc = NULL;
+		_capacity = 0;
+		_next = NULL;
+		_num_free.store(0, std::memory_order_relaxed);
+		_head.store(pack(0, INVALID_INDEX), std::memory_order_relaxed);
+	}
+
+	size_t capacity() const
+	{
+		return _capacity;
+	}
+
+	// Only a snapshot while other threads are allocating
+	size_t num_free() const
+	{
+		return _num_free.load(std::memory_order_relaxed);
+	}
+
+	size_t num_used() const
+	{
+		return _capacity - num_free();
+	}
+
+	TH alloc_handle()
+	{
+		uint32_t index = try_alloc_index();
+		if(index == INVALID_INDEX)
+		{
+			VGPU_BREAKPOINT();
+			return (TH)-1;
+		}
+		return static_cast<TH>(index);
+	}
+
+	// INVALID_INDEX when the pool is empty. Checking num_free() first is racy,
+	// callers that can run out use this instead of alloc_handle.
+	uint32_t try_alloc_index()
+	{
+		uint64_t head = _head.load(std::memory_order_acquire);
+		for(;;)
+		{
+			uint32_t index = (uint32_t)head;
+			if(index == INVALID_INDEX)
+				return INVALID_INDEX;
+
+			// _next[index] may already be stale here, the tag makes the swap fail in that case
+			uint32_t next = _next[index].load(std::memory_order_relaxed);
+			if(_head.compare_exchange_weak(head, pack(tag(head) + 1, next), std::memory_order_acquire, std::memory_order_acquire))
+			{
+				_num_free.fetch_sub(1, std::memory_order_relaxed);
+				return index;
+			}
+		}
+	}
+
+	void free_handle(TH handle)
+	{
+		uint32_t index = (uint32_t)handle;
+		VGPU_HARD_ASSERT(index < _capacity, "handle outside of pool");
+
+		uint64_t head = _head.load(std::memory_order_relaxed);
+		for(;;)
+		{
+			_next[index].store((uint32_t)head, std::memory_order_relaxed);
+			if(_head.compare_exchange_weak(head, pack(tag(head) + 1, index), std::memory_order_release, std::memory_order_relaxed))
+				break;
+		}
+
+		_num_free.fetch_add(1, std::memory_order_relaxed);
+	}
+
+	static uint64_t pack(uint32_t tag, uint32_t index)
+	{
+		return ((uint64_t)tag << 32) | index;
+	}
+
+	static uint32_t tag(uint64_t head)
+	{
+		return (uint32_t)(head >> 32);
+	}
+};
+
+#endif
+
+#endif //#ifndef VGPU_ATOMIC_ID_POOL_H
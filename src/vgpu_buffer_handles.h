@@ -0,0 +1,86 @@
+#ifndef VGPU_BUFFER_HANDLES_H
+#define VGPU_BUFFER_HANDLES_H
+
+#ifdef __cplusplus
+
+#include <vgpu.h>
+#include "vgpu_internal.h"
+#include "vgpu_handle_table.h"
+
+// The buffer handle entry points, shared by all backends. Lookup and
+// validation of handles is the same everywhere, only creating and releasing
+// the API object differs. A backend includes this once, after the definition
+// of its device and command list, and provides:
+//
+//   device->buffer_handles                          vgpu_handle_table_t<vgpu_buffer_t, vgpu_create_buffer_params_t>
+//   command_list->device                            the device the list records for
+//   init_buffer(device, buffer, params)             creates the API object in place
+//   release_buffer(device, buffer)                  releases it again
+//
+// Textures are out of scope for now and are only created through the
+// pointer API.
+
+vgpu_buffer_handle_t vgpu_create_buffer_handle(vgpu_device_t* device, const vgpu_create_buffer_params_t* params)
+{
+	vgpu_buffer_handle_t handle;
+	handle.id = device->buffer_handles.alloc();
+	VGPU_ASSERT(device, handle.id != 0, "Buffer handle table is full or max_buffer_handles is 0");
+	if(handle.id == 0)
+		return handle;
+
+	init_buffer(device, device->buffer_handles.hot(handle.id), params);
+	vgpu_create_buffer_params_t* info = device->buffer_handles.cold(handle.id);
+	*info = *params;
+	info->name = nullptr;
+
+	return handle;
+}
+
+void vgpu_destroy_buffer_handle(vgpu_device_t* device, vgpu_buffer_handle_t handle)
+{
+	vgpu_buffer_t* buffer = device->buffer_handles.lookup(handle.id);
+	VGPU_ASSERT(device, buffer != nullptr, "Stale buffer handle");
+	if(buffer == nullptr)
+		return;
+
+	release_buffer(device, buffer);
+	device->buffer_handles.free(handle.id);
+}
+
+bool vgpu_is_buffer_handle_valid(vgpu_device_t* device, vgpu_buffer_handle_t handle)
+{
+	return device->buffer_handles.is_valid(handle.id);
+}
+
+vgpu_buffer_t* vgpu_get_buffer(vgpu_device_t* device, vgpu_buffer_handle_t handle)
+{
+	return device->buffer_handles.lookup(handle.id);
+}
+
+void vgpu_set_buffer_handle(vgpu_command_list_t* command_list, uint32_t slot, vgpu_buffer_handle_t buffer, size_t offset, size_t num_bytes)
+{
+	vgpu_device_t* device = command_list->device;
+	vgpu_buffer_t* hot = device->buffer_handles.lookup(buffer.id);
+	VGPU_ASSERT(device, hot != nullptr, "Stale buffer handle");
+	if(hot == nullptr)
+		return;
+
+	VGPU_ASSERT(device, offset + num_bytes <= device->buffer_handles.cold(buffer.id)->num_bytes, "Range outside of buffer");
+	vgpu_set_buffer(command_list, slot, hot, offset, num_bytes);
+}
+
+void vgpu_set_index_buffer_handle(vgpu_command_list_t* command_list, vgpu_data_type_t index_type, vgpu_buffer_handle_t index_buffer)
+{
+	vgpu_device_t* device = command_list->device;
+	vgpu_buffer_t* hot = device->buffer_handles.lookup(index_buffer.id);
+	VGPU_ASSERT(device, hot != nullptr, "Stale buffer handle");
+	if(hot == nullptr)
+		return;
+
+	VGPU_ASSERT(device, device->buffer_handles.cold(index_buffer.id)->flags & VGPU_BUFFER_FLAG_INDEX_BUFFER, "Not an index buffer");
+	vgpu_set_index_buffer(command_list, index_type, hot);
+}
+
+#endif
+
+#endif // VGPU_BUFFER_HANDLES_H
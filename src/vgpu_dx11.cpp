@@ -1,5 +1,7 @@
 #include <vgpu.h>
 #include "vgpu_internal.h"
+#include "vgpu_linear_allocator.h"
+#include "vgpu_handle_table.h"
 #include <windows.h>
 #include <d3d11_1.h>
 
@@ -173,6 +175,8 @@ struct vgpu_command_list_s
 
 struct vgpu_thread_context_s
 {
+	vgpu_linear_allocator_t frame_allocator[VGPU_MULTI_BUFFERING];
+	uint32_t frame_id;
 };
 
 struct vgpu_device_s
@@ -196,6 +200,8 @@ struct vgpu_device_s
 	vgpu_command_list_t* immediate_command_list;
 
 	vgpu_caps_t caps;
+
+	vgpu_handle_table_t<vgpu_buffer_t, vgpu_create_buffer_params_t> buffer_handles;
 };
 
 /******************************************************************************\
@@ -220,6 +226,7 @@ vgpu_device_t* vgpu_create_device(const vgpu_create_device_params_t* params)
 	device->frame_no = 0;
 	device->immediate_command_list = nullptr;
 	ZeroMemory(&device->caps, sizeof(device->caps));
+	device->caps.error_check_mode = params->error_check_mode;
 
     DXGI_SWAP_CHAIN_DESC scd;
 
@@ -273,6 +280,8 @@ vgpu_device_t* vgpu_create_device(const vgpu_create_device_params_t* params)
     vp.TopLeftY = 0;
     device->d3dc->RSSetViewports(1, &vp);
 
+	device->buffer_handles.create(allocator, params->max_buffer_handles);
+
 	return device;
 }
 
@@ -283,6 +292,8 @@ void vgpu_destroy_device(vgpu_device_t* device)
 	SAFE_RELEASE(device->d3dc);
 	SAFE_RELEASE(device->d3dd);
 
+	device->buffer_handles.destroy();
+
 	VGPU_FREE(device->allocator, device);
 }
 
@@ -326,6 +337,24 @@ void vgpu_get_caps(vgpu_device_t* device, vgpu_caps_t* out_caps)
 	memcpy(out_caps, &device->caps, sizeof(vgpu_caps_t));
 }
 
+void vgpu_get_frame_stats(vgpu_device_t* device, vgpu_frame_stats_t* out_stats)
+{
+	// D3D11 throttles inside Present, there is no wait of our own to measure
+	memset(out_stats, 0, sizeof(vgpu_frame_stats_t));
+}
+
+bool vgpu_save_pipeline_cache(vgpu_device_t* device)
+{
+	// No pipeline cache
+	return false;
+}
+
+void vgpu_get_memory_stats(vgpu_device_t* device, vgpu_memory_stats_t* out_stats)
+{
+	// The driver places D3D11 resources, there is nothing to report
+	memset(out_stats, 0, sizeof(vgpu_memory_stats_t));
+}
+
 /******************************************************************************\
 *
 *  Thread context handling
@@ -335,16 +364,28 @@ void vgpu_get_caps(vgpu_device_t* device, vgpu_caps_t* out_caps)
 vgpu_thread_context_t* vgpu_create_thread_context(vgpu_device_t* device, const vgpu_create_thread_context_params_t* params)
 {
 	vgpu_thread_context_t* thread_context = VGPU_ALLOC_TYPE(device->allocator, vgpu_thread_context_t);
+	for(int i = 0; i < VGPU_MULTI_BUFFERING; ++i)
+		vgpu_linear_allocator_create(&thread_context->frame_allocator[i], device->allocator, VGPU_FRAME_ALLOCATOR_CHUNK_SIZE);
+	thread_context->frame_id = 0;
 	return thread_context;
 }
 
 void vgpu_destroy_thread_context(vgpu_device_t* device, vgpu_thread_context_t* thread_context)
 {
+	for(int i = 0; i < VGPU_MULTI_BUFFERING; ++i)
+		vgpu_linear_allocator_destroy(&thread_context->frame_allocator[i]);
 	VGPU_FREE(device->allocator, thread_context);
 }
 
 void vgpu_prepare_thread_context(vgpu_device_t* device, vgpu_thread_context_t* thread_context)
 {
+	thread_context->frame_id = device->frame_no % VGPU_MULTI_BUFFERING;
+	vgpu_linear_allocator_reset(&thread_context->frame_allocator[thread_context->frame_id]);
+}
+
+vgpu_allocator_t* vgpu_get_thread_frame_allocator(vgpu_thread_context_t* thread_context)
+{
+	return &thread_context->frame_allocator[thread_context->frame_id].base;
 }
 
 /******************************************************************************\
@@ -353,9 +394,8 @@ void vgpu_prepare_thread_context(vgpu_device_t* device, vgpu_thread_context_t* t
  *
 \******************************************************************************/
 
-vgpu_buffer_t* vgpu_create_buffer(vgpu_device_t* device, const vgpu_create_buffer_params_t* params)
+static void init_buffer(vgpu_device_t* device, vgpu_buffer_t* buffer, const vgpu_create_buffer_params_t* params)
 {
-	vgpu_buffer_t* buffer = VGPU_ALLOC_TYPE(device->allocator, vgpu_buffer_t);
 	buffer->usage = translate_usage[params->usage];
 	buffer->flags = params->flags;
 
@@ -403,17 +443,30 @@ vgpu_buffer_t* vgpu_create_buffer(vgpu_device_t* device, const vgpu_create_buffe
 		hr = device->d3dd->CreateShaderResourceView(buffer->buffer, &view_desc, &buffer->view);
 		VGPU_ASSERT(device, SUCCEEDED(hr), "Failed to create SRV for buffer");
 	}
+}
 
+vgpu_buffer_t* vgpu_create_buffer(vgpu_device_t* device, const vgpu_create_buffer_params_t* params)
+{
+	vgpu_buffer_t* buffer = VGPU_ALLOC_TYPE(device->allocator, vgpu_buffer_t);
+	init_buffer(device, buffer, params);
 	return buffer;
 }
 
-void vgpu_destroy_buffer(vgpu_device_t* device, vgpu_buffer_t* buffer)
+static void release_buffer(vgpu_device_t* device, vgpu_buffer_t* buffer)
 {
 	SAFE_RELEASE(buffer->view);
 	SAFE_RELEASE(buffer->buffer);
+}
+
+void vgpu_destroy_buffer(vgpu_device_t* device, vgpu_buffer_t* buffer)
+{
+	release_buffer(device, buffer);
 	VGPU_FREE(device->allocator, buffer);
 }
 
+// Buffer handle entry points on top of init_buffer and release_buffer
+#include "vgpu_buffer_handles.h"
+
 /******************************************************************************\
  *
  *  Resource table handling
@@ -481,6 +534,11 @@ void vgpu_destroy_resource_table(vgpu_device_t* device, vgpu_resource_table_t* r
 	VGPU_FREE(device->allocator, resource_table);
 }
 
+void vgpu_compact_resource_tables(vgpu_device_t* device, uint32_t time_budget_us)
+{
+	// Nothing to compact, resource tables are not backed by a shared heap
+}
+
 /******************************************************************************\
 *
 *  Root layout handling
@@ -669,6 +727,11 @@ void vgpu_destroy_pipeline(vgpu_device_t* device, vgpu_pipeline_t* pipeline)
 	VGPU_FREE(device->allocator, pipeline);
 }
 
+bool vgpu_is_pipeline_ready(vgpu_device_t* device, vgpu_pipeline_t* pipeline)
+{
+	return true;
+}
+
 /******************************************************************************\
 *
 *  Render setup handling
@@ -990,6 +1053,16 @@ void vgpu_draw_indexed_indirect(vgpu_command_list_t* command_list, vgpu_buffer_t
 	VGPU_BREAKPOINT();
 }
 
+void vgpu_draw_indirect_count(vgpu_command_list_t* command_list, vgpu_buffer_t* buffer, uint64_t offset, vgpu_buffer_t* count_buffer, uint64_t count_offset, uint32_t max_count)
+{
+	VGPU_BREAKPOINT();
+}
+
+void vgpu_draw_indexed_indirect_count(vgpu_command_list_t* command_list, vgpu_buffer_t* buffer, uint64_t offset, vgpu_buffer_t* count_buffer, uint64_t count_offset, uint32_t max_count)
+{
+	VGPU_BREAKPOINT();
+}
+
 void vgpu_clear_render_pass(vgpu_command_list_t* command_list, vgpu_render_pass_t* render_pass)
 {
 	for (uint32_t i = 0; i < render_pass->num_rtv; ++i)
@@ -1,7 +1,9 @@
 #include <vgpu.h>
 #include "vgpu_internal.h" 
-#include "vgpu_id_pool.h"
-#include "vgpu_range_pool.h"
+#include "vgpu_atomic_id_pool.h"
+#include "vgpu_tlsf_pool.h"
+#include "vgpu_linear_allocator.h"
+#include "vgpu_handle_table.h"
 
 #include <windows.h>
 #include <d3d12.h>
@@ -128,22 +130,11 @@ struct vgpu_texture_s : vgpu_resource_t
 	D3D12_CLEAR_VALUE clear_value;
 };
 
-struct vgpu_resource_table_s
-{
-	// Keeping track of the allocation
-	uint32_t cbv_srv_uav_offset;
-	uint32_t num_cbv_srv_uav;
-
-	// The actual data to set
-	uint32_t cbv_srv_uav_index;
-	D3D12_GPU_DESCRIPTOR_HANDLE cbv_srv_uav;
-};
-
 struct vgpu_root_layout_s
 {
 	ID3D12RootSignature* root_signature;
 
-	struct
+	struct slot_t
 	{
 		vgpu_root_slot_type_t type;
 
@@ -161,6 +152,22 @@ struct vgpu_root_layout_s
 		} srv, cbv;
 	} slots[4];
 };
+
+struct vgpu_resource_table_s
+{
+	// Keeping track of the allocation
+	uint32_t cbv_srv_uav_offset;
+	uint32_t num_cbv_srv_uav;
+
+	// The actual data to set
+	uint32_t cbv_srv_uav_index;
+	D3D12_GPU_DESCRIPTOR_HANDLE cbv_srv_uav;
+
+	// Kept to recreate the views when the table is relocated
+	vgpu_root_layout_t::slot_t slot;
+	vgpu_resource_table_entry_t* entries;
+	size_t num_entries;
+};
 struct vgpu_program_s
 {
 	uint8_t* data;
@@ -211,10 +218,12 @@ struct vgpu_thread_context_s
 		ID3D12Resource* upload_buffer;
 		size_t upload_buffer_size;
 		size_t upload_offset;
-		vgpu_array_t<IUnknown*> delay_delete_queue;
-		vgpu_array_t<ID3D12GraphicsCommandList*> free;
-		vgpu_array_t<ID3D12GraphicsCommandList*> pending;
+		vgpu_small_array_t<IUnknown*, 4> delay_delete_queue;
+		vgpu_small_array_t<ID3D12GraphicsCommandList*, 8> free;
+		vgpu_small_array_t<ID3D12GraphicsCommandList*, 8> pending;
+		vgpu_linear_allocator_t frame_allocator;
 	} frame[VGPU_MULTI_BUFFERING];
+	uint32_t frame_id;
 };
 
 struct vgpu_device_s
@@ -234,16 +243,18 @@ struct vgpu_device_s
 	IDXGIFactory4* dxgif;
 	IDXGISwapChain3* swapchain;
 
-	vgpu_range_pool_t<uint32_t> rtv_pool;
+	// Render passes may be created from several threads
+	vgpu_tlsf_pool_t<uint32_t> rtv_pool;
+	SRWLOCK rtv_pool_lock;
 	ID3D12DescriptorHeap* rtv_heap;
 
-	vgpu_id_pool_t<uint32_t> dsv_pool;
+	vgpu_atomic_id_pool_t<uint32_t> dsv_pool;
 	ID3D12DescriptorHeap* dsv_heap;
 	
-	vgpu_range_pool_t<uint32_t> cbv_srv_uav_pool;
+	vgpu_tlsf_pool_t<uint32_t> cbv_srv_uav_pool;
 	ID3D12DescriptorHeap* cbv_srv_uav_heap;
 
-	vgpu_range_pool_t<uint32_t> sampler_pool;
+	vgpu_tlsf_pool_t<uint32_t> sampler_pool;
 	ID3D12DescriptorHeap* sampler_heap;
 
 	uint32_t rtv_size;
@@ -253,12 +264,20 @@ struct vgpu_device_s
 
 	ID3D12Fence* frame_fence;
 	HANDLE frame_event;
+	vgpu_frame_stats_t frame_stats;
 	uint64_t frame_no;
+	struct range_t
+	{
+		uint32_t offset;
+		uint32_t count;
+	};
+
 	struct frame_data_t
 	{
 		uint64_t fence_value;
 		ID3D12Resource* backbuffer_resource;
 		vgpu_array_t<IUnknown*> delay_delete_queue;
+		vgpu_array_t<range_t> delay_free_cbv_srv_uav;
 	} frame[VGPU_MULTI_BUFFERING];
 
 	vgpu_texture_t backbuffer;
@@ -268,6 +287,8 @@ struct vgpu_device_s
 
 	ID3D12RootSignature* fullscreen_root_signature;
 	ID3D12PipelineState* fullscreen_pipeline_state;
+
+	vgpu_handle_table_t<vgpu_buffer_t, vgpu_create_buffer_params_t> buffer_handles;
 };
 
 static vgpu_device_t::frame_data_t& get_frame(vgpu_device_t* device, uint64_t frame)
@@ -283,11 +304,7 @@ static vgpu_device_t::frame_data_t& curr_frame(vgpu_device_t* device)
 static void push_delay_delete(vgpu_device_t* device, IUnknown* res)
 {
 	auto& frame = curr_frame(device);
-
-	if(frame.delay_delete_queue.full())
-		frame.delay_delete_queue.grow();
-
-	frame.delay_delete_queue.append(res);
+	frame.delay_delete_queue.push_back(res);
 }
 
 static ID3D12Resource* create_upload_buffer(vgpu_device_t* device, size_t size)
@@ -309,6 +326,8 @@ static ID3D12Resource* create_upload_buffer(vgpu_device_t* device, size_t size)
 	return resource;
 }
 
+static void relocate_resource_table(void* owner, uint32_t old_offset, uint32_t new_offset, uint32_t count, void* user_data);
+
 /******************************************************************************\
  *
  *  Device operations
@@ -329,7 +348,9 @@ vgpu_device_t* vgpu_create_device(const vgpu_create_device_params_t* params)
 
 	device->width = 1280;
 	device->height = 720;
-	device->caps.flags = (~params->force_disable_flags) & (VGPU_CAPS_FLAG_BIND_CONSTANT_BUFFER_AT_OFFSET | VGPU_CAPS_FLAG_BIND_BUFFER_AT_OFFSET);
+	device->caps.flags = (~params->force_disable_flags) & (VGPU_CAPS_FLAG_BIND_CONSTANT_BUFFER_AT_OFFSET | VGPU_CAPS_FLAG_BIND_BUFFER_AT_OFFSET |
+		VGPU_CAPS_FLAG_DRAW_INDIRECT_COUNT);
+	device->caps.error_check_mode = params->error_check_mode;
 
 	HRESULT hr = D3D12CreateDevice(
 		nullptr,
@@ -377,6 +398,7 @@ vgpu_device_t* vgpu_create_device(const vgpu_create_device_params_t* params)
 		IID_PPV_ARGS(&device->rtv_heap));
 	VGPU_ASSERT(device, SUCCEEDED(hr), "failed to create descriptor heap (RTV)");
 	device->rtv_pool.create(allocator, rtv_heap_desc.NumDescriptors);
+	InitializeSRWLock(&device->rtv_pool_lock);
 
 	D3D12_DESCRIPTOR_HEAP_DESC dsv_heap_desc = {};
 	dsv_heap_desc.NumDescriptors = 32;
@@ -397,6 +419,7 @@ vgpu_device_t* vgpu_create_device(const vgpu_create_device_params_t* params)
 		IID_PPV_ARGS(&device->cbv_srv_uav_heap));
 	VGPU_ASSERT(device, SUCCEEDED(hr), "failed to create descriptor heap (CBV/SRV/UAV)");
 	device->cbv_srv_uav_pool.create(allocator, cbv_srv_uav_heap_desc.NumDescriptors);
+	device->cbv_srv_uav_pool.set_relocate_func(relocate_resource_table, device);
 
 	D3D12_DESCRIPTOR_HEAP_DESC sampler_heap_desc = {};
 	sampler_heap_desc.NumDescriptors = 2048;
@@ -420,6 +443,7 @@ vgpu_device_t* vgpu_create_device(const vgpu_create_device_params_t* params)
 
 		frame.fence_value = 0;
 		frame.delay_delete_queue.create(allocator, 128);
+		frame.delay_free_cbv_srv_uav.create(allocator, 128);
 
 		hr = device->swapchain->GetBuffer(
 			i,
@@ -441,7 +465,7 @@ vgpu_device_t* vgpu_create_device(const vgpu_create_device_params_t* params)
 	D3D12_INDIRECT_ARGUMENT_DESC draw_indirect_args[1];
 	draw_indirect_args[0].Type = D3D12_INDIRECT_ARGUMENT_TYPE_DRAW;
 	D3D12_COMMAND_SIGNATURE_DESC draw_indirect_desc = {
-		sizeof(draw_indirect_args[0]),
+		sizeof(vgpu_draw_indirect_args_t),
 		VGPU_ARRAY_LENGTH(draw_indirect_args),
 		draw_indirect_args,
 		0, // node mask
@@ -453,9 +477,9 @@ vgpu_device_t* vgpu_create_device(const vgpu_create_device_params_t* params)
 	VGPU_ASSERT(device, SUCCEEDED(hr), "failed to create draw indirect command signature");
 
 	D3D12_INDIRECT_ARGUMENT_DESC draw_indirect_indexed_args[1];
-	draw_indirect_indexed_args[0].Type = D3D12_INDIRECT_ARGUMENT_TYPE_DRAW;
+	draw_indirect_indexed_args[0].Type = D3D12_INDIRECT_ARGUMENT_TYPE_DRAW_INDEXED;
 	D3D12_COMMAND_SIGNATURE_DESC draw_indirect_indexed_desc = {
-		sizeof(draw_indirect_indexed_args[0]),
+		sizeof(vgpu_draw_indexed_indirect_args_t),
 		VGPU_ARRAY_LENGTH(draw_indirect_indexed_args),
 		draw_indirect_indexed_args,
 		0, // node mask
@@ -466,6 +490,8 @@ vgpu_device_t* vgpu_create_device(const vgpu_create_device_params_t* params)
 		IID_PPV_ARGS(&device->draw_indexed_indirect_signature));
 	VGPU_ASSERT(device, SUCCEEDED(hr), "failed to create draw indexed indirect command signature");
 
+	device->buffer_handles.create(allocator, params->max_buffer_handles);
+
 	return device;
 }
 
@@ -501,6 +527,8 @@ void vgpu_destroy_device(vgpu_device_t* device)
 	SAFE_RELEASE(device->graphics_command_queue);
 	SAFE_RELEASE(device->d3dd);
 
+	device->buffer_handles.destroy();
+
 	VGPU_FREE(device->allocator, device);
 }
 
@@ -521,7 +549,7 @@ void vgpu_apply_command_lists(vgpu_device_t* device, uint32_t num_command_lists,
 	for (uint32_t i = 0; i < num_command_lists; ++i)
 	{
 		d3d_command_lists[i] = command_lists[i]->d3dcl;
-		command_lists[i]->thread_context->frame[id].pending.append(command_lists[i]->d3dcl);
+		command_lists[i]->thread_context->frame[id].pending.push_back(command_lists[i]->d3dcl);
 		command_lists[i]->d3dcl = nullptr;
 		command_lists[i]->thread_context = nullptr;
 	}
@@ -547,15 +575,24 @@ void vgpu_present(vgpu_device_t* device)
 	auto& next_frame = curr_frame(device); // this is now the new frame
 
 										   // Wait until a new slot of frame resources is ready
+	device->frame_stats.last_wait_us = 0;
 	if (last_completed_fence < next_frame.fence_value)
 	{
+		uint64_t wait_start = vgpu_time_us();
 		device->frame_fence->SetEventOnCompletion(next_frame.fence_value, device->frame_event);
 		WaitForSingleObject(device->frame_event, INFINITE);
+		device->frame_stats.last_wait_us = vgpu_time_us() - wait_start;
+		device->frame_stats.total_wait_us += device->frame_stats.last_wait_us;
+		device->frame_stats.num_waits++;
 	}
 
 	for (size_t i = 0; i < next_frame.delay_delete_queue.length(); ++i)
 		next_frame.delay_delete_queue[i]->Release();
 	next_frame.delay_delete_queue.set_length(0);
+
+	for (size_t i = 0; i < next_frame.delay_free_cbv_srv_uav.length(); ++i)
+		device->cbv_srv_uav_pool.free(next_frame.delay_free_cbv_srv_uav[i].offset, next_frame.delay_free_cbv_srv_uav[i].count);
+	next_frame.delay_free_cbv_srv_uav.set_length(0);
 }
 
 vgpu_texture_t* vgpu_get_back_buffer(vgpu_device_t* device)
@@ -583,6 +620,23 @@ void vgpu_get_caps(vgpu_device_t* device, vgpu_caps_t* out_caps)
 	memcpy(out_caps, &device->caps, sizeof(vgpu_caps_t));
 }
 
+void vgpu_get_frame_stats(vgpu_device_t* device, vgpu_frame_stats_t* out_stats)
+{
+	memcpy(out_stats, &device->frame_stats, sizeof(vgpu_frame_stats_t));
+}
+
+bool vgpu_save_pipeline_cache(vgpu_device_t* device)
+{
+	// No pipeline cache
+	return false;
+}
+
+void vgpu_get_memory_stats(vgpu_device_t* device, vgpu_memory_stats_t* out_stats)
+{
+	// Resources are committed, each one gets an implicit heap we don't see
+	memset(out_stats, 0, sizeof(vgpu_memory_stats_t));
+}
+
 /******************************************************************************\
 *
 *  Thread context handling
@@ -602,10 +656,12 @@ vgpu_thread_context_t* vgpu_create_thread_context(vgpu_device_t* device, const v
 		thread_context->frame[i].upload_buffer_size = 64 * 1024 * 1024;
 		thread_context->frame[i].upload_buffer = create_upload_buffer(device, thread_context->frame[i].upload_buffer_size);
 		thread_context->frame[i].upload_offset = 0;
-		thread_context->frame[i].delay_delete_queue.create(device->allocator, 4);
-		thread_context->frame[i].free.create(device->allocator, 8);
-		thread_context->frame[i].pending.create(device->allocator, 8);
+		thread_context->frame[i].delay_delete_queue.create(device->allocator);
+		thread_context->frame[i].free.create(device->allocator);
+		thread_context->frame[i].pending.create(device->allocator);
+		vgpu_linear_allocator_create(&thread_context->frame[i].frame_allocator, device->allocator, VGPU_FRAME_ALLOCATOR_CHUNK_SIZE);
 	}
+	thread_context->frame_id = 0;
 	return thread_context;
 }
 
@@ -615,6 +671,7 @@ void vgpu_destroy_thread_context(vgpu_device_t* device, vgpu_thread_context_t* t
 	{
 		SAFE_RELEASE(thread_context->frame[i].command_allocator_graphics);
 		SAFE_RELEASE(thread_context->frame[i].upload_buffer);
+		vgpu_linear_allocator_destroy(&thread_context->frame[i].frame_allocator);
 	}
 	VGPU_DELETE(device->allocator, vgpu_thread_context_t, thread_context);
 }
@@ -622,7 +679,9 @@ void vgpu_destroy_thread_context(vgpu_device_t* device, vgpu_thread_context_t* t
 void vgpu_prepare_thread_context(vgpu_device_t* device, vgpu_thread_context_t* thread_context)
 {
 	uint32_t id = device->frame_no % VGPU_MULTI_BUFFERING;
+	thread_context->frame_id = id;
 	thread_context->frame[id].upload_offset = 0;
+	vgpu_linear_allocator_reset(&thread_context->frame[id].frame_allocator);
 	thread_context->frame[id].command_allocator_graphics->Reset();
 
 	// TODO: make sure frame fence has passed
@@ -630,20 +689,23 @@ void vgpu_prepare_thread_context(vgpu_device_t* device, vgpu_thread_context_t* t
 	{
 		ID3D12GraphicsCommandList* cl = thread_context->frame[id].pending.back();
 		thread_context->frame[id].pending.remove_back();
-		thread_context->frame[id].free.append(cl);
+		thread_context->frame[id].free.push_back(cl);
 	}
 }
 
+vgpu_allocator_t* vgpu_get_thread_frame_allocator(vgpu_thread_context_t* thread_context)
+{
+	return &thread_context->frame[thread_context->frame_id].frame_allocator.base;
+}
+
 /******************************************************************************\
  *
  *  Buffer handling
  *
 \******************************************************************************/
 
-vgpu_buffer_t* vgpu_create_buffer(vgpu_device_t* device, const vgpu_create_buffer_params_t* params)
+static void init_buffer(vgpu_device_t* device, vgpu_buffer_t* buffer, const vgpu_create_buffer_params_t* params)
 {
-	vgpu_buffer_t* buffer = VGPU_ALLOC_TYPE(device->allocator, vgpu_buffer_t);
-
 	bool is_dynamic = params->usage == VGPU_USAGE_DYNAMIC;
 	D3D12_HEAP_TYPE heap_type = is_dynamic ? D3D12_HEAP_TYPE_UPLOAD : D3D12_HEAP_TYPE_DEFAULT;
 	D3D12_HEAP_PROPERTIES heap_prop = CD3DX12_HEAP_PROPERTIES(heap_type);
@@ -667,41 +729,50 @@ vgpu_buffer_t* vgpu_create_buffer(vgpu_device_t* device, const vgpu_create_buffe
 	buffer->num_bytes = params->num_bytes;
 	buffer->stride = params->structure_stride;
 	buffer->heap_type = heap_type;
+}
 
+vgpu_buffer_t* vgpu_create_buffer(vgpu_device_t* device, const vgpu_create_buffer_params_t* params)
+{
+	vgpu_buffer_t* buffer = VGPU_ALLOC_TYPE(device->allocator, vgpu_buffer_t);
+	init_buffer(device, buffer, params);
 	return buffer;
 }
 
-void vgpu_destroy_buffer(vgpu_device_t* device, vgpu_buffer_t* buffer)
+static void release_buffer(vgpu_device_t* device, vgpu_buffer_t* buffer)
 {
 	SAFE_RELEASE(buffer->resource);
+}
 
+void vgpu_destroy_buffer(vgpu_device_t* device, vgpu_buffer_t* buffer)
+{
+	release_buffer(device, buffer);
 	VGPU_FREE(device->allocator, buffer);
 }
 
+// Buffer handle entry points on top of init_buffer and release_buffer
+#include "vgpu_buffer_handles.h"
+
 /******************************************************************************\
  *
  *  Resource table handling
  *
 \******************************************************************************/
 
-vgpu_resource_table_t* vgpu_create_resource_table(vgpu_device_t* device, const vgpu_root_layout_t* root_layout, uint32_t root_slot, const vgpu_resource_table_entry_t* entries, size_t num_entries)
+static void write_resource_table(vgpu_device_t* device, vgpu_resource_table_t* resource_table)
 {
-	vgpu_resource_table_t* resource_table = VGPU_ALLOC_TYPE(device->allocator, vgpu_resource_table_t);
-	ZeroMemory(resource_table, sizeof(*resource_table));
+	const vgpu_root_layout_t::slot_t& slot = resource_table->slot;
+	const vgpu_resource_table_entry_t* entries = resource_table->entries;
 
-	D3D12_CPU_DESCRIPTOR_HANDLE cbv_srv_uav;
-	resource_table->num_cbv_srv_uav = root_layout->slots[root_slot].num_cbv_srv_uav;
-	resource_table->cbv_srv_uav_index = root_layout->slots[root_slot].cbv_srv_uav_index;
+	D3D12_CPU_DESCRIPTOR_HANDLE cbv_srv_uav = {};
 	if(resource_table->num_cbv_srv_uav)
 	{
-		resource_table->cbv_srv_uav_offset = device->cbv_srv_uav_pool.alloc(resource_table->num_cbv_srv_uav);
 		resource_table->cbv_srv_uav = device->cbv_srv_uav_heap->GetGPUDescriptorHandleForHeapStart();
 		cbv_srv_uav = device->cbv_srv_uav_heap->GetCPUDescriptorHandleForHeapStart();
 		resource_table->cbv_srv_uav.ptr += resource_table->cbv_srv_uav_offset * device->cbv_srv_uav_size;
 		cbv_srv_uav.ptr += resource_table->cbv_srv_uav_offset * device->cbv_srv_uav_size;
 	}
 
-	for(size_t i = 0; i < num_entries; ++i)
+	for(size_t i = 0; i < resource_table->num_entries; ++i)
 	{
 		switch(entries[i].type)
 		{
@@ -711,9 +782,9 @@ vgpu_resource_table_t* vgpu_create_resource_table(vgpu_device_t* device, const v
 
 				if(entries[i].treat_as_constant_buffer)
 				{
-					VGPU_ASSERT(device, entries[i].location >= root_layout->slots[root_slot].cbv.start, "resource table location %d out of bounds", i);
-					VGPU_ASSERT(device, entries[i].location < (root_layout->slots[root_slot].cbv.start + root_layout->slots[root_slot].cbv.count), "resource table location %d out of bounds", i);
-					uint32_t offset = entries[i].location + root_layout->slots[root_slot].cbv.offset - root_layout->slots[root_slot].cbv.start;
+					VGPU_ASSERT(device, entries[i].location >= slot.cbv.start, "resource table location %d out of bounds", i);
+					VGPU_ASSERT(device, entries[i].location < (slot.cbv.start + slot.cbv.count), "resource table location %d out of bounds", i);
+					uint32_t offset = entries[i].location + slot.cbv.offset - slot.cbv.start;
 					D3D12_CPU_DESCRIPTOR_HANDLE descriptor_handle = cbv_srv_uav;
 					descriptor_handle.ptr += offset * device->cbv_srv_uav_size;
 
@@ -724,9 +795,9 @@ vgpu_resource_table_t* vgpu_create_resource_table(vgpu_device_t* device, const v
 				}
 				else
 				{
-					VGPU_ASSERT(device, entries[i].location >= root_layout->slots[root_slot].srv.start, "resource table location %d out of bounds", i);
-					VGPU_ASSERT(device, entries[i].location < (root_layout->slots[root_slot].srv.start + root_layout->slots[root_slot].srv.count), "resource table location %d out of bounds", i);
-					uint32_t offset = entries[i].location + root_layout->slots[root_slot].srv.offset - root_layout->slots[root_slot].srv.start;
+					VGPU_ASSERT(device, entries[i].location >= slot.srv.start, "resource table location %d out of bounds", i);
+					VGPU_ASSERT(device, entries[i].location < (slot.srv.start + slot.srv.count), "resource table location %d out of bounds", i);
+					uint32_t offset = entries[i].location + slot.srv.offset - slot.srv.start;
 					D3D12_CPU_DESCRIPTOR_HANDLE descriptor_handle = cbv_srv_uav;
 					descriptor_handle.ptr += offset * device->cbv_srv_uav_size;
 
@@ -750,6 +821,43 @@ vgpu_resource_table_t* vgpu_create_resource_table(vgpu_device_t* device, const v
 				VGPU_BREAKPOINT();
 		}
 	}
+}
+
+// Called by the cbv/srv/uav pool when compaction moved a table. The views are
+// written again at the new offset since the shader visible heap cannot be
+// used as a copy source, and the old range is kept alive until the GPU is done
+// with the frames that might still reference it.
+static void relocate_resource_table(void* owner, uint32_t old_offset, uint32_t new_offset, uint32_t count, void* user_data)
+{
+	vgpu_device_t* device = (vgpu_device_t*)user_data;
+	vgpu_resource_table_t* resource_table = (vgpu_resource_table_t*)owner;
+
+	resource_table->cbv_srv_uav_offset = new_offset;
+	write_resource_table(device, resource_table);
+
+	vgpu_device_t::range_t range = { old_offset, count };
+	curr_frame(device).delay_free_cbv_srv_uav.push_back(range);
+}
+
+vgpu_resource_table_t* vgpu_create_resource_table(vgpu_device_t* device, const vgpu_root_layout_t* root_layout, uint32_t root_slot, const vgpu_resource_table_entry_t* entries, size_t num_entries)
+{
+	vgpu_resource_table_t* resource_table = VGPU_ALLOC_TYPE(device->allocator, vgpu_resource_table_t);
+	ZeroMemory(resource_table, sizeof(*resource_table));
+
+	resource_table->slot = root_layout->slots[root_slot];
+	resource_table->num_cbv_srv_uav = root_layout->slots[root_slot].num_cbv_srv_uav;
+	resource_table->cbv_srv_uav_index = root_layout->slots[root_slot].cbv_srv_uav_index;
+	if(resource_table->num_cbv_srv_uav)
+		resource_table->cbv_srv_uav_offset = device->cbv_srv_uav_pool.alloc(resource_table->num_cbv_srv_uav, resource_table);
+
+	if(num_entries)
+	{
+		resource_table->entries = VGPU_ALLOC_ARRAY(device->allocator, num_entries, vgpu_resource_table_entry_t);
+		memcpy(resource_table->entries, entries, num_entries * sizeof(vgpu_resource_table_entry_t));
+	}
+	resource_table->num_entries = num_entries;
+
+	write_resource_table(device, resource_table);
 
 	return resource_table;
 }
@@ -758,10 +866,24 @@ void vgpu_destroy_resource_table(vgpu_device_t* device, vgpu_resource_table_t* r
 {
 	if(resource_table->num_cbv_srv_uav)
 		device->cbv_srv_uav_pool.free(resource_table->cbv_srv_uav_offset, resource_table->num_cbv_srv_uav);
-	
+
+	if(resource_table->entries)
+		VGPU_FREE(device->allocator, resource_table->entries);
 	VGPU_FREE(device->allocator, resource_table);
 }
 
+void vgpu_compact_resource_tables(vgpu_device_t* device, uint32_t time_budget_us)
+{
+	// A step visits at most COMPACT_STEP_NODES nodes, so the budget is
+	// overshot by one short step at most
+	uint64_t start = vgpu_time_us();
+	while(vgpu_time_us() - start < time_budget_us)
+	{
+		if(!device->cbv_srv_uav_pool.compact_step())
+			break;
+	}
+}
+
 /******************************************************************************\
 *
 *  Root layout handling
@@ -1050,6 +1172,11 @@ void vgpu_destroy_pipeline(vgpu_device_t* device, vgpu_pipeline_t* pipeline)
 	VGPU_FREE(device->allocator, pipeline);
 }
 
+bool vgpu_is_pipeline_ready(vgpu_device_t* device, vgpu_pipeline_t* pipeline)
+{
+	return true;
+}
+
 /******************************************************************************\
 *
 *  Render setup handling
@@ -1074,7 +1201,9 @@ vgpu_render_pass_t* vgpu_create_render_pass(vgpu_device_t* device, const vgpu_cr
 		uint32_t end_count = render_pass->has_framebuffer ? VGPU_MULTI_BUFFERING : 1;
 		for (uint32_t f = 0; f < end_count; ++f)
 		{
+			AcquireSRWLockExclusive(&device->rtv_pool_lock);
 			render_pass->rtv_offset[f] = device->rtv_pool.alloc(params->num_color_targets);
+			ReleaseSRWLockExclusive(&device->rtv_pool_lock);
 			render_pass->rtv[f] = device->rtv_heap->GetCPUDescriptorHandleForHeapStart();
 			render_pass->rtv[f].ptr += render_pass->rtv_offset[f] * device->rtv_size;
 			for (size_t i = 0; i < params->num_color_targets; ++i)
@@ -1118,10 +1247,12 @@ vgpu_render_pass_t* vgpu_create_render_pass(vgpu_device_t* device, const vgpu_cr
 void vgpu_destroy_render_pass(vgpu_device_t* device, vgpu_render_pass_t* render_pass)
 {
 	uint32_t end_count = render_pass->has_framebuffer ? VGPU_MULTI_BUFFERING : 1;
-	for (uint32_t f = 0; f < end_count; ++f)
+	AcquireSRWLockExclusive(&device->rtv_pool_lock);
+	for (uint32_t f = 0; f < end_count && render_pass->num_rtv; ++f)
 	{
 		device->rtv_pool.free(render_pass->rtv_offset[f], render_pass->num_rtv);
 	}
+	ReleaseSRWLockExclusive(&device->rtv_pool_lock);
 	if(render_pass->dsv_offset != -1)
 		device->dsv_pool.free_handle(render_pass->dsv_offset);
 	VGPU_FREE(device->allocator, render_pass);
@@ -1363,7 +1494,6 @@ void vgpu_draw_indexed_indirect(vgpu_command_list_t* command_list, vgpu_buffer_t
 	VGPU_ASSERT(command_list->device, command_list->curr_pipeline != nullptr, "A valid pipeline was not set when drawing");
 	VGPU_ASSERT(command_list->device, command_list->curr_root_layout != nullptr, "A valid root layout was not set when drawing");
 
-	command_list->curr_root_layout = nullptr;
 	command_list->d3dcl->ExecuteIndirect(
 		command_list->device->draw_indexed_indirect_signature,
 		count,
@@ -1373,6 +1503,34 @@ void vgpu_draw_indexed_indirect(vgpu_command_list_t* command_list, vgpu_buffer_t
 		0);
 }
 
+void vgpu_draw_indirect_count(vgpu_command_list_t* command_list, vgpu_buffer_t* buffer, uint64_t offset, vgpu_buffer_t* count_buffer, uint64_t count_offset, uint32_t max_count)
+{
+	VGPU_ASSERT(command_list->device, command_list->curr_pipeline != nullptr, "A valid pipeline was not set when drawing");
+	VGPU_ASSERT(command_list->device, command_list->curr_root_layout != nullptr, "A valid root layout was not set when drawing");
+
+	command_list->d3dcl->ExecuteIndirect(
+		command_list->device->draw_indirect_signature,
+		max_count,
+		buffer->resource,
+		offset,
+		count_buffer->resource,
+		count_offset);
+}
+
+void vgpu_draw_indexed_indirect_count(vgpu_command_list_t* command_list, vgpu_buffer_t* buffer, uint64_t offset, vgpu_buffer_t* count_buffer, uint64_t count_offset, uint32_t max_count)
+{
+	VGPU_ASSERT(command_list->device, command_list->curr_pipeline != nullptr, "A valid pipeline was not set when drawing");
+	VGPU_ASSERT(command_list->device, command_list->curr_root_layout != nullptr, "A valid root layout was not set when drawing");
+
+	command_list->d3dcl->ExecuteIndirect(
+		command_list->device->draw_indexed_indirect_signature,
+		max_count,
+		buffer->resource,
+		offset,
+		count_buffer->resource,
+		count_offset);
+}
+
 void vgpu_clear_render_pass(vgpu_command_list_t* command_list, vgpu_render_pass_t* render_pass)
 {
 	uint64_t id = vgpu_get_frame_id(command_list->device);
@@ -1,7 +1,12 @@
 #include <stdio.h>
+#include <string.h>
 
 #include "vgpu_gl.h"
 
+#if defined(VGPU_WINDOWS)
+#	include <intrin.h>
+#endif
+
 /******************************************************************************\
  *
  *  Translation utils
@@ -37,7 +42,7 @@ static const GLenum translate_fill_mode[] = {
 };
 
 static const GLenum translate_cull_mode[] = {
-	0,
+	GL_BACK, // culling is disabled, only keeps glCullFace valid
 	GL_FRONT,
 	GL_BACK,
 };
@@ -108,10 +113,26 @@ static const GLenum translate_stencil_op[] = {
 	GL_DECR_WRAP,
 };
 
+#if !defined(VGPU_GL_NO_ERROR_CHECKS)
+static const char* vgpu_gl_error_string(GLenum error)
+{
+	switch(error)
+	{
+		case GL_INVALID_ENUM: return "GL_INVALID_ENUM";
+		case GL_INVALID_VALUE: return "GL_INVALID_VALUE";
+		case GL_INVALID_OPERATION: return "GL_INVALID_OPERATION";
+		case GL_STACK_OVERFLOW: return "GL_STACK_OVERFLOW";
+		case GL_STACK_UNDERFLOW: return "GL_STACK_UNDERFLOW";
+		case GL_OUT_OF_MEMORY: return "GL_OUT_OF_MEMORY";
+		case GL_INVALID_FRAMEBUFFER_OPERATION: return "GL_INVALID_FRAMEBUFFER_OPERATION";
+		default: return "unknown GL error";
+	}
+}
+
 static int vgpu_gl_check_errors(vgpu_glc_t* glc)
 {
 	int wasHit = 0;
-	const unsigned char *str;
+	const char *str;
 
 	while(1)
 	{
@@ -120,7 +141,7 @@ static int vgpu_gl_check_errors(vgpu_glc_t* glc)
 		if(e == GL_NO_ERROR)
 			break;
 
-		str = gluErrorString(e);
+		str = vgpu_gl_error_string(e);
 #if defined(VGPU_WINDOWS)
 		OutputDebugStringA((LPCSTR)str);
 		OutputDebugStringA("\n");
@@ -133,7 +154,10 @@ static int vgpu_gl_check_errors(vgpu_glc_t* glc)
 	return wasHit;
 }
 
-#define GLERR_CHECK(glc) vgpu_gl_check_errors(glc)
+#define GLERR_CHECK(glc) ((glc)->check_errors ? (void)vgpu_gl_check_errors(glc) : (void)0)
+#else
+#define GLERR_CHECK(glc) ((void)0)
+#endif
 
 static void APIENTRY vgpu_gl_debug_callback(GLenum source, GLenum type, GLuint id, GLenum severity, GLsizei length, const GLchar* message, const void* userParam)
 {
@@ -142,12 +166,462 @@ static void APIENTRY vgpu_gl_debug_callback(GLenum source, GLenum type, GLuint i
 		device->log_func(message);
 }
 
+/******************************************************************************\
+ *
+ *  Staging ring
+ *
+\******************************************************************************/
+
+#define VGPU_GL_STAGING_ALIGNMENT 16
+
+struct vgpu_gl_lock_data_t
+{
+	GLuint staging_gl_id;
+	bool temporary; // a buffer of its own for locks larger than a slot
+	size_t staging_offset;
+};
+
+static void wait_for_fence(vgpu_glc_t* glc, GLsync fence)
+{
+	GLbitfield flags = GL_SYNC_FLUSH_COMMANDS_BIT;
+	while(glc->glClientWaitSync(fence, flags, 1000000000) == GL_TIMEOUT_EXPIRED)
+		flags = 0;
+	glc->glDeleteSync(fence);
+}
+
+static void create_staging_ring(vgpu_device_t* device)
+{
+	vgpu_glc_t* glc = &device->glc;
+	vgpu_gl_staging_ring_t* ring = &device->staging;
+	memset(ring, 0, sizeof(*ring));
+
+	GLbitfield flags = GL_MAP_WRITE_BIT | GL_MAP_PERSISTENT_BIT | GL_MAP_COHERENT_BIT;
+	glc->glCreateBuffers(1, &ring->gl_id);
+	glc->glNamedBufferStorage(ring->gl_id, VGPU_GL_STAGING_FRAME_SIZE * VGPU_MULTI_BUFFERING, nullptr, flags);
+	ring->ptr = (uint8_t*)glc->glMapNamedBufferRange(ring->gl_id, 0, VGPU_GL_STAGING_FRAME_SIZE * VGPU_MULTI_BUFFERING, flags);
+	GLERR_CHECK(glc);
+}
+
+static void destroy_staging_ring(vgpu_device_t* device)
+{
+	vgpu_glc_t* glc = &device->glc;
+	vgpu_gl_staging_ring_t* ring = &device->staging;
+
+	glc->glUnmapNamedBuffer(ring->gl_id);
+	glc->glDeleteBuffers(1, &ring->gl_id);
+	GLERR_CHECK(glc);
+}
+
+// Only once the frame fence of the slot has been waited on
+static void advance_staging_ring(vgpu_device_t* device)
+{
+	vgpu_gl_staging_ring_t* ring = &device->staging;
+	ring->frame_id = (uint32_t)(device->frame_no % VGPU_MULTI_BUFFERING);
+	ring->offset = 0;
+}
+
+static void* alloc_staging(vgpu_device_t* device, size_t num_bytes, vgpu_gl_lock_data_t* lock_data)
+{
+	vgpu_glc_t* glc = &device->glc;
+	vgpu_gl_staging_ring_t* ring = &device->staging;
+
+	if(num_bytes > VGPU_GL_STAGING_FRAME_SIZE)
+	{
+		lock_data->temporary = true;
+		lock_data->staging_offset = 0;
+		glc->glCreateBuffers(1, &lock_data->staging_gl_id);
+		glc->glNamedBufferStorage(lock_data->staging_gl_id, num_bytes, nullptr, GL_MAP_WRITE_BIT);
+		return glc->glMapNamedBufferRange(lock_data->staging_gl_id, 0, num_bytes, GL_MAP_WRITE_BIT | GL_MAP_INVALIDATE_BUFFER_BIT);
+	}
+
+	size_t offset = VGPU_ALIGN_UP(ring->offset, VGPU_GL_STAGING_ALIGNMENT);
+	if(offset + num_bytes > VGPU_GL_STAGING_FRAME_SIZE)
+	{
+		// The frame has filled its slot, wait for the copies issued so far and start over
+		wait_for_fence(glc, glc->glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0));
+		offset = 0;
+	}
+	ring->offset = offset + num_bytes;
+
+	lock_data->staging_gl_id = ring->gl_id;
+	lock_data->temporary = false;
+	lock_data->staging_offset = (size_t)ring->frame_id * VGPU_GL_STAGING_FRAME_SIZE + offset;
+	return ring->ptr + lock_data->staging_offset;
+}
+
+/******************************************************************************\
+ *
+ *  Draw merging
+ *
+\******************************************************************************/
+
+// Sends the pending draws, anything that changes state they depend on or
+// writes a resource they read flushes first
+static void flush_draws(vgpu_command_list_t* command_list)
+{
+	vgpu_gl_draw_batch_t* batch = &command_list->batch;
+	if(batch->num_draws == 0)
+		return;
+
+	vgpu_glc_t* glc = command_list->glc;
+	GLenum prim_type = command_list->curr_pipeline->prim_type;
+	if(batch->indexed)
+	{
+		if(batch->num_draws == 1)
+			glc->glDrawElementsBaseVertex(prim_type, batch->counts[0], command_list->curr_index_type, batch->offsets[0], batch->firsts[0]);
+		else
+			glc->glMultiDrawElementsBaseVertex(prim_type, batch->counts, command_list->curr_index_type, batch->offsets, batch->num_draws, batch->firsts);
+	}
+	else
+	{
+		if(batch->num_draws == 1)
+			glc->glDrawArrays(prim_type, batch->firsts[0], batch->counts[0]);
+		else
+			glc->glMultiDrawArrays(prim_type, batch->firsts, batch->counts, batch->num_draws);
+	}
+	GLERR_CHECK(glc);
+
+	command_list->device->num_driver_draws++;
+	batch->num_draws = 0;
+}
+
+static void flush_immediate_draws(vgpu_device_t* device)
+{
+	if(device->immediate_command_list)
+		flush_draws(device->immediate_command_list);
+}
+
+static void queue_draw(vgpu_command_list_t* command_list, bool indexed, GLsizei count, GLint first, const void* offset)
+{
+	vgpu_gl_draw_batch_t* batch = &command_list->batch;
+	if(batch->num_draws == VGPU_GL_MAX_MERGED_DRAWS || (batch->num_draws > 0 && batch->indexed != indexed))
+		flush_draws(command_list);
+
+	batch->indexed = indexed;
+	batch->counts[batch->num_draws] = count;
+	batch->firsts[batch->num_draws] = first;
+	batch->offsets[batch->num_draws] = offset;
+	batch->num_draws++;
+}
+
+/******************************************************************************\
+ *
+ *  Pipeline cache
+ *
+\******************************************************************************/
+
+// Cache files are a header followed by the glGetProgramBinary blob
+struct vgpu_gl_program_binary_header_t
+{
+	uint32_t magic;
+	uint32_t binary_size;
+	uint64_t key;
+	GLenum binary_format;
+};
+
+static const uint32_t VGPU_GL_PROGRAM_BINARY_MAGIC = 0x42504756; // VGPB
+
+static void init_pipeline_cache(vgpu_device_t* device, const char* path)
+{
+	vgpu_glc_t* glc = &device->glc;
+	device->pipeline_cache_path = nullptr;
+	device->driver_hash = VGPU_HASH_SEED;
+	if(path == nullptr)
+		return;
+
+	// Drivers without binary formats only ever reject the binaries
+	GLint num_formats = 0;
+	glc->glGetIntegerv(GL_NUM_PROGRAM_BINARY_FORMATS, &num_formats);
+	if(num_formats == 0)
+		return;
+
+	const GLenum driver_strings[] = { GL_VENDOR, GL_RENDERER, GL_VERSION };
+	for(size_t i = 0; i < VGPU_ARRAY_LENGTH(driver_strings); ++i)
+	{
+		const char* str = (const char*)glc->glGetString(driver_strings[i]);
+		if(str)
+			device->driver_hash = vgpu_hash(str, strlen(str) + 1, device->driver_hash);
+	}
+
+	size_t len = strlen(path) + 1;
+	device->pipeline_cache_path = (char*)VGPU_ALLOC(device->allocator, len, 1);
+	memcpy(device->pipeline_cache_path, path, len);
+}
+
+static uint64_t pipeline_cache_key(vgpu_device_t* device, const vgpu_create_pipeline_params_t* params)
+{
+	uint64_t program_hashes[2] = { params->vertex_program->hash, params->fragment_program ? params->fragment_program->hash : 0 };
+	return vgpu_hash(program_hashes, sizeof(program_hashes), device->driver_hash);
+}
+
+static bool pipeline_cache_file(vgpu_device_t* device, uint64_t key, char* path, size_t path_size)
+{
+	int len = snprintf(path, path_size, "%s/gl_%016llx.bin", device->pipeline_cache_path, (unsigned long long)key);
+	return len > 0 && (size_t)len < path_size;
+}
+
+// Links gl_id from a cached binary, false if there is none or the driver rejects it
+static bool load_program_binary(vgpu_device_t* device, GLuint gl_id, uint64_t key)
+{
+	vgpu_glc_t* glc = &device->glc;
+
+	char path[1024];
+	if(!pipeline_cache_file(device, key, path, sizeof(path)))
+		return false;
+
+	size_t size = 0;
+	uint8_t* data = (uint8_t*)vgpu_read_file(device->allocator, path, &size);
+	if(data == nullptr)
+		return false;
+
+	GLint linked = GL_FALSE;
+	vgpu_gl_program_binary_header_t header;
+	if(size >= sizeof(header))
+	{
+		memcpy(&header, data, sizeof(header));
+		if(header.magic == VGPU_GL_PROGRAM_BINARY_MAGIC && header.key == key && header.binary_size == size - sizeof(header))
+		{
+			glc->glProgramBinary(gl_id, header.binary_format, data + sizeof(header), header.binary_size);
+			// A rejected binary is a failed link and may raise GL_INVALID_ENUM, neither is an error here
+			while(glc->glGetError() != GL_NO_ERROR) {}
+			glc->glGetProgramiv(gl_id, GL_LINK_STATUS, &linked);
+		}
+	}
+	VGPU_FREE(device->allocator, data);
+
+	return linked == GL_TRUE;
+}
+
+static void store_program_binary(vgpu_device_t* device, GLuint gl_id, uint64_t key)
+{
+	vgpu_glc_t* glc = &device->glc;
+
+	GLint binary_size = 0;
+	glc->glGetProgramiv(gl_id, GL_PROGRAM_BINARY_LENGTH, &binary_size);
+	if(binary_size <= 0)
+		return;
+
+	vgpu_gl_program_binary_header_t header;
+	header.magic = VGPU_GL_PROGRAM_BINARY_MAGIC;
+	header.key = key;
+
+	uint8_t* data = (uint8_t*)VGPU_ALLOC(device->allocator, sizeof(header) + binary_size, 16);
+	GLsizei length = 0;
+	glc->glGetProgramBinary(gl_id, binary_size, &length, &header.binary_format, data + sizeof(header));
+	GLERR_CHECK(glc);
+	header.binary_size = (uint32_t)length;
+	memcpy(data, &header, sizeof(header));
+
+	char path[1024];
+	if(length > 0 && pipeline_cache_file(device, key, path, sizeof(path)))
+		vgpu_write_file(path, data, sizeof(header) + length);
+	VGPU_FREE(device->allocator, data);
+}
+
+/******************************************************************************\
+ *
+ *  Framebuffer cache
+ *
+\******************************************************************************/
+
+static bool match_framebuffer(const vgpu_gl_framebuffer_t* framebuffer, const vgpu_render_pass_t* render_pass)
+{
+	if(framebuffer->num_color_targets != render_pass->num_color_targets)
+		return false;
+	for(size_t i = 0; i < render_pass->num_color_targets; ++i)
+	{
+		if(framebuffer->color_targets[i] != render_pass->color_targets[i]->gl_id)
+			return false;
+	}
+	GLuint depth_stencil = render_pass->depth_stencil_target ? render_pass->depth_stencil_target->gl_id : 0;
+	return framebuffer->depth_stencil_target == depth_stencil;
+}
+
+static void delete_framebuffer(vgpu_device_t* device, uint32_t index)
+{
+	vgpu_glc_t* glc = &device->glc;
+	GLuint gl_id = device->framebuffers[index].gl_id;
+
+	// Deleting the bound FBO binds the default framebuffer
+	glc->glDeleteFramebuffers(1, &gl_id);
+	if(device->bound_framebuffer == gl_id)
+		device->bound_framebuffer = 0;
+	vgpu_command_list_t* command_list = device->immediate_command_list;
+	if(command_list && command_list->curr_framebuffer == gl_id)
+		command_list->curr_render_pass = nullptr;
+
+	device->framebuffers[index] = device->framebuffers[--device->num_framebuffers];
+}
+
+// FBO with the attachments of the render pass, 0 for the back buffer
+static GLuint get_framebuffer(vgpu_device_t* device, const vgpu_render_pass_t* render_pass)
+{
+	vgpu_glc_t* glc = &device->glc;
+	if(render_pass->is_back_buffer)
+		return 0;
+
+	for(uint32_t i = 0; i < device->num_framebuffers; ++i)
+	{
+		if(match_framebuffer(&device->framebuffers[i], render_pass))
+		{
+			device->framebuffers[i].last_used_frame = device->frame_no;
+			return device->framebuffers[i].gl_id;
+		}
+	}
+
+	if(device->num_framebuffers == VGPU_GL_MAX_FRAMEBUFFERS)
+	{
+		uint32_t oldest = 0;
+		for(uint32_t i = 1; i < device->num_framebuffers; ++i)
+		{
+			if(device->framebuffers[i].last_used_frame < device->framebuffers[oldest].last_used_frame)
+				oldest = i;
+		}
+		delete_framebuffer(device, oldest);
+	}
+
+	vgpu_gl_framebuffer_t* framebuffer = &device->framebuffers[device->num_framebuffers++];
+	framebuffer->num_color_targets = (uint32_t)render_pass->num_color_targets;
+	framebuffer->depth_stencil_target = render_pass->depth_stencil_target ? render_pass->depth_stencil_target->gl_id : 0;
+	framebuffer->last_used_frame = device->frame_no;
+	glc->glCreateFramebuffers(1, &framebuffer->gl_id);
+
+	GLenum draw_buffers[VGPU_MAX_RENDER_TARGETS];
+	for(uint32_t i = 0; i < framebuffer->num_color_targets; ++i)
+	{
+		framebuffer->color_targets[i] = render_pass->color_targets[i]->gl_id;
+		glc->glNamedFramebufferTexture(framebuffer->gl_id, GL_COLOR_ATTACHMENT0 + i, framebuffer->color_targets[i], 0);
+		draw_buffers[i] = GL_COLOR_ATTACHMENT0 + i;
+	}
+	if(framebuffer->num_color_targets == 0)
+		draw_buffers[0] = GL_NONE;
+	glc->glNamedFramebufferDrawBuffers(framebuffer->gl_id, framebuffer->num_color_targets ? framebuffer->num_color_targets : 1, draw_buffers);
+
+	if(framebuffer->depth_stencil_target)
+		glc->glNamedFramebufferTexture(framebuffer->gl_id, GL_DEPTH_STENCIL_ATTACHMENT, framebuffer->depth_stencil_target, 0);
+	GLERR_CHECK(glc);
+
+	VGPU_ASSERT(device, glc->glCheckNamedFramebufferStatus(framebuffer->gl_id, GL_DRAW_FRAMEBUFFER) == GL_FRAMEBUFFER_COMPLETE, "Render pass targets don't make a complete framebuffer");
+
+	return framebuffer->gl_id;
+}
+
+static void evict_framebuffers(vgpu_device_t* device, GLuint texture_gl_id)
+{
+	for(uint32_t i = 0; i < device->num_framebuffers; )
+	{
+		const vgpu_gl_framebuffer_t* framebuffer = &device->framebuffers[i];
+		bool uses_texture = framebuffer->depth_stencil_target == texture_gl_id;
+		for(uint32_t t = 0; t < framebuffer->num_color_targets; ++t)
+			uses_texture |= framebuffer->color_targets[t] == texture_gl_id;
+
+		if(uses_texture)
+			delete_framebuffer(device, i);
+		else
+			++i;
+	}
+}
+
+static void clear_attachments(vgpu_glc_t* glc, GLuint framebuffer, const vgpu_render_pass_t* render_pass, uint32_t mask)
+{
+	for(uint32_t i = 0; i < render_pass->num_color_targets; ++i)
+	{
+		if(mask & (1u << i))
+			glc->glClearNamedFramebufferfv(framebuffer, GL_COLOR, i, render_pass->color_clear_value[i].color);
+	}
+	if(mask & VGPU_GL_DEPTH_STENCIL_ATTACHMENT)
+	{
+		// glClearNamedFramebufferfi has a wrong prototype in older headers, clear them one at a time
+		GLint stencil = render_pass->depth_stencil_clear_value.depth_stencil.stencil;
+		glc->glClearNamedFramebufferfv(framebuffer, GL_DEPTH, 0, &render_pass->depth_stencil_clear_value.depth_stencil.depth);
+		glc->glClearNamedFramebufferiv(framebuffer, GL_STENCIL, 0, &stencil);
+	}
+	GLERR_CHECK(glc);
+}
+
+// The driver may drop the contents, skipping the load before a clear or the store after a pass
+static void invalidate_attachments(vgpu_glc_t* glc, GLuint framebuffer, const vgpu_render_pass_t* render_pass, uint32_t mask)
+{
+	GLenum attachments[VGPU_MAX_RENDER_TARGETS + 2];
+	GLsizei num_attachments = 0;
+	for(uint32_t i = 0; i < render_pass->num_color_targets; ++i)
+	{
+		if(mask & (1u << i))
+			attachments[num_attachments++] = framebuffer ? GL_COLOR_ATTACHMENT0 + i : GL_COLOR;
+	}
+	if(mask & VGPU_GL_DEPTH_STENCIL_ATTACHMENT)
+	{
+		if(framebuffer)
+		{
+			attachments[num_attachments++] = GL_DEPTH_STENCIL_ATTACHMENT;
+		}
+		else
+		{
+			attachments[num_attachments++] = GL_DEPTH;
+			attachments[num_attachments++] = GL_STENCIL;
+		}
+	}
+
+	if(num_attachments > 0)
+		glc->glInvalidateNamedFramebufferData(framebuffer, num_attachments, attachments);
+	GLERR_CHECK(glc);
+}
+
+static void unbind_render_pass(vgpu_command_list_t* command_list)
+{
+	vgpu_render_pass_t* render_pass = command_list->curr_render_pass;
+	if(render_pass && render_pass->discard_mask)
+		invalidate_attachments(command_list->glc, command_list->curr_framebuffer, render_pass, render_pass->discard_mask);
+	command_list->curr_render_pass = nullptr;
+}
+
 /******************************************************************************\
  *
  *  Device operations
  *
 \******************************************************************************/
 
+static bool has_gl_extension(vgpu_glc_t* glc, const char* name)
+{
+	GLint num_extensions = 0;
+	glc->glGetIntegerv(GL_NUM_EXTENSIONS, &num_extensions);
+	for(GLint i = 0; i < num_extensions; ++i)
+	{
+		if(strcmp((const char*)glc->glGetStringi(GL_EXTENSIONS, i), name) == 0)
+			return true;
+	}
+	return false;
+}
+
+static void load_indirect_count_functions(vgpu_glc_t* glc)
+{
+	GLint major = 0, minor = 0;
+	glc->glGetIntegerv(GL_MAJOR_VERSION, &major);
+	glc->glGetIntegerv(GL_MINOR_VERSION, &minor);
+
+	glc->glMultiDrawArraysIndirectCount = nullptr;
+	glc->glMultiDrawElementsIndirectCount = nullptr;
+	if(major > 4 || (major == 4 && minor >= 6))
+	{
+		glc->glMultiDrawArraysIndirectCount = (PFNGLMULTIDRAWARRAYSINDIRECTCOUNTARBPROC)vgpu_platform_load_gl_func("glMultiDrawArraysIndirectCount");
+		glc->glMultiDrawElementsIndirectCount = (PFNGLMULTIDRAWELEMENTSINDIRECTCOUNTARBPROC)vgpu_platform_load_gl_func("glMultiDrawElementsIndirectCount");
+	}
+	else if(has_gl_extension(glc, "GL_ARB_indirect_parameters"))
+	{
+		glc->glMultiDrawArraysIndirectCount = (PFNGLMULTIDRAWARRAYSINDIRECTCOUNTARBPROC)vgpu_platform_load_gl_func("glMultiDrawArraysIndirectCountARB");
+		glc->glMultiDrawElementsIndirectCount = (PFNGLMULTIDRAWELEMENTSINDIRECTCOUNTARBPROC)vgpu_platform_load_gl_func("glMultiDrawElementsIndirectCountARB");
+	}
+}
+
+static void load_parallel_compile_functions(vgpu_glc_t* glc)
+{
+	glc->glMaxShaderCompilerThreads = nullptr;
+	if(has_gl_extension(glc, "GL_KHR_parallel_shader_compile"))
+		glc->glMaxShaderCompilerThreads = (PFNGLMAXSHADERCOMPILERTHREADSKHRPROC)vgpu_platform_load_gl_func("glMaxShaderCompilerThreadsKHR");
+	else if(has_gl_extension(glc, "GL_ARB_parallel_shader_compile"))
+		glc->glMaxShaderCompilerThreads = (PFNGLMAXSHADERCOMPILERTHREADSKHRPROC)vgpu_platform_load_gl_func("glMaxShaderCompilerThreadsARB");
+}
+
 vgpu_device_t* vgpu_create_device(const vgpu_create_device_params_t* params)
 {
 	extern vgpu_allocator_t vgpu_allocator_default;
@@ -158,21 +632,53 @@ vgpu_device_t* vgpu_create_device(const vgpu_create_device_params_t* params)
 
 	device->log_func = params->log_func;
 	device->error_func = params->error_func;
+#if defined(VGPU_GL_NO_ERROR_CHECKS)
+	device->error_check_mode = VGPU_ERROR_CHECK_NONE;
+#else
+	device->error_check_mode = params->error_check_mode;
+#endif
 
 	device->width = 1280;
 	device->height = 720;
 	device->frame_no = 0;
 	memset(&device->caps, 0, sizeof(device->caps));
-	device->caps.flags = (~params->force_disable_flags) & (VGPU_CAPS_FLAG_BIND_CONSTANT_BUFFER_AT_OFFSET | VGPU_CAPS_FLAG_BIND_BUFFER_AT_OFFSET);
+	device->caps.flags = (~params->force_disable_flags) & (VGPU_CAPS_FLAG_BIND_CONSTANT_BUFFER_AT_OFFSET | VGPU_CAPS_FLAG_BIND_BUFFER_AT_OFFSET |
+		VGPU_CAPS_FLAG_PIPELINE_STATE_SHADOWING | VGPU_CAPS_FLAG_PIPELINE_TRANSITION_CACHE | VGPU_CAPS_FLAG_DRAW_INDIRECT_COUNT |
+		VGPU_CAPS_FLAG_DRAW_MERGING | VGPU_CAPS_FLAG_ASYNC_PIPELINE_COMPILE);
+	device->caps.error_check_mode = device->error_check_mode;
+
+	device->buffer_pool.create(allocator, VGPU_OBJECTS_PER_SLAB);
+	device->resource_table_pool.create(allocator, VGPU_OBJECTS_PER_SLAB);
+	device->root_layout_pool.create(allocator, VGPU_OBJECTS_PER_SLAB);
+	device->texture_pool.create(allocator, VGPU_OBJECTS_PER_SLAB);
+	device->program_pool.create(allocator, VGPU_OBJECTS_PER_SLAB);
+	device->pipeline_pool.create(allocator, VGPU_OBJECTS_PER_SLAB);
+	device->render_pass_pool.create(allocator, VGPU_OBJECTS_PER_SLAB);
+	device->command_list_pool.create(allocator, VGPU_OBJECTS_PER_SLAB);
 
 	vgpu_platform_create_device(device, params);
 
 	vgpu_glc_t* glc = &device->glc;
 	vgpu_platform_load_gl_ptrs(glc);
+	glc->check_errors = device->error_check_mode == VGPU_ERROR_CHECK_FULL;
 	device->immediate_command_list = nullptr;
 
-	glc->glDebugMessageCallback(vgpu_gl_debug_callback, device);
-	GLERR_CHECK(glc);
+	load_indirect_count_functions(glc);
+	if(glc->glMultiDrawArraysIndirectCount == nullptr || glc->glMultiDrawElementsIndirectCount == nullptr)
+		device->caps.flags &= ~VGPU_CAPS_FLAG_DRAW_INDIRECT_COUNT;
+
+	// Let the driver pick how many compiler threads to use
+	load_parallel_compile_functions(glc);
+	if(glc->glMaxShaderCompilerThreads == nullptr)
+		device->caps.flags &= ~VGPU_CAPS_FLAG_ASYNC_PIPELINE_COMPILE;
+	else if(device->caps.flags & VGPU_CAPS_FLAG_ASYNC_PIPELINE_COMPILE)
+		glc->glMaxShaderCompilerThreads(0xFFFFFFFF);
+
+	if(device->error_check_mode != VGPU_ERROR_CHECK_NONE)
+	{
+		glc->glDebugMessageCallback(vgpu_gl_debug_callback, device);
+		GLERR_CHECK(glc);
+	}
 
 	glc->glViewport(0, 0, device->width, device->height);
 	GLERR_CHECK(glc);
@@ -182,8 +688,15 @@ vgpu_device_t* vgpu_create_device(const vgpu_create_device_params_t* params)
 
 	glc->glBindVertexArray(device->vao_gl_id);
 
+	memset(device->frame_fences, 0, sizeof(device->frame_fences));
+	memset(&device->frame_stats, 0, sizeof(device->frame_stats));
+	device->num_draws = 0;
+	device->num_driver_draws = 0;
+	create_staging_ring(device);
+
 	device->backbuffer.gl_id = 0;
 	device->backbuffer.type = VGPU_TEXTURETYPE_2D;
+	device->backbuffer.format = VGPU_TEXTUREFORMAT_RGBA8;
 	device->backbuffer.width = device->width;
 	device->backbuffer.height = device->height;
 	device->backbuffer.depth = 1;
@@ -193,6 +706,22 @@ vgpu_device_t* vgpu_create_device(const vgpu_create_device_params_t* params)
 	device->backbuffer.clear_value.b = 0.3f;
 	device->backbuffer.clear_value.a = 1.0f;
 
+	memset(&device->state, 0, sizeof(device->state));
+	device->next_pipeline_serial = 1;
+	device->transitions = nullptr;
+	if(device->caps.flags & VGPU_CAPS_FLAG_PIPELINE_TRANSITION_CACHE)
+	{
+		device->transitions = VGPU_ALLOC_ARRAY(allocator, VGPU_GL_TRANSITION_CACHE_SIZE, vgpu_gl_transition_t);
+		memset(device->transitions, 0, VGPU_GL_TRANSITION_CACHE_SIZE * sizeof(vgpu_gl_transition_t));
+	}
+
+	init_pipeline_cache(device, params->pipeline_cache_path);
+
+	device->num_framebuffers = 0;
+	device->bound_framebuffer = 0;
+
+	device->buffer_handles.create(allocator, params->max_buffer_handles);
+
 	return device;
 }
 
@@ -201,11 +730,38 @@ void vgpu_destroy_device(vgpu_device_t* device)
 	vgpu_glc_t* glc = &device->glc;
 	GLERR_CHECK(glc);
 
+	for(int i = 0; i < VGPU_MULTI_BUFFERING; ++i)
+	{
+		if(device->frame_fences[i])
+			glc->glDeleteSync(device->frame_fences[i]);
+	}
+	destroy_staging_ring(device);
+
+	// Needs the context and reads the immediate command list out of its pool
+	while(device->num_framebuffers > 0)
+		delete_framebuffer(device, device->num_framebuffers - 1);
+
 	glc->glDeleteVertexArrays(1, &device->vao_gl_id);
 	GLERR_CHECK(glc);
 
 	vgpu_platform_destroy_device(device);
 
+	device->buffer_pool.destroy();
+	device->resource_table_pool.destroy();
+	device->root_layout_pool.destroy();
+	device->texture_pool.destroy();
+	device->program_pool.destroy();
+	device->pipeline_pool.destroy();
+	device->render_pass_pool.destroy();
+	device->command_list_pool.destroy();
+
+	device->buffer_handles.destroy();
+
+	if(device->transitions)
+		VGPU_FREE(device->allocator, device->transitions);
+	if(device->pipeline_cache_path)
+		VGPU_FREE(device->allocator, device->pipeline_cache_path);
+
 	VGPU_FREE(device->allocator, device);
 }
 
@@ -220,9 +776,32 @@ void vgpu_apply_command_lists(vgpu_device_t* device, uint32_t num_command_lists,
 
 void vgpu_present(vgpu_device_t* device)
 {
+	vgpu_glc_t* glc = &device->glc;
+
+	flush_immediate_draws(device);
+	device->frame_stats.num_draws = device->num_draws;
+	device->frame_stats.num_driver_draws = device->num_driver_draws;
+	device->num_draws = 0;
+	device->num_driver_draws = 0;
+
 	vgpu_platform_swap(device);
+	device->frame_fences[device->frame_no % VGPU_MULTI_BUFFERING] = glc->glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
 
+	// Step the frame, then wait until the GPU is done with the frame that last used its slot
 	device->frame_no++;
+	GLsync* fence = &device->frame_fences[device->frame_no % VGPU_MULTI_BUFFERING];
+	device->frame_stats.last_wait_us = 0;
+	if(*fence)
+	{
+		uint64_t wait_start = vgpu_time_us();
+		wait_for_fence(glc, *fence);
+		*fence = nullptr;
+		device->frame_stats.last_wait_us = vgpu_time_us() - wait_start;
+		device->frame_stats.total_wait_us += device->frame_stats.last_wait_us;
+		device->frame_stats.num_waits++;
+	}
+
+	advance_staging_ring(device);
 }
 
 vgpu_texture_t* vgpu_get_back_buffer(vgpu_device_t* device)
@@ -249,6 +828,23 @@ void vgpu_get_caps(vgpu_device_t* device, vgpu_caps_t* out_caps)
 	memcpy(out_caps, &device->caps, sizeof(vgpu_caps_t));
 }
 
+void vgpu_get_frame_stats(vgpu_device_t* device, vgpu_frame_stats_t* out_stats)
+{
+	memcpy(out_stats, &device->frame_stats, sizeof(vgpu_frame_stats_t));
+}
+
+bool vgpu_save_pipeline_cache(vgpu_device_t* device)
+{
+	// Program binaries are written as soon as their pipeline links
+	return false;
+}
+
+void vgpu_get_memory_stats(vgpu_device_t* device, vgpu_memory_stats_t* out_stats)
+{
+	// The driver places GL objects, there is nothing to report
+	memset(out_stats, 0, sizeof(vgpu_memory_stats_t));
+}
+
 /******************************************************************************\
 *
 *  Thread context handling
@@ -258,16 +854,28 @@ void vgpu_get_caps(vgpu_device_t* device, vgpu_caps_t* out_caps)
 vgpu_thread_context_t* vgpu_create_thread_context(vgpu_device_t* device, const vgpu_create_thread_context_params_t* params)
 {
 	vgpu_thread_context_t* thread_context = VGPU_ALLOC_TYPE(device->allocator, vgpu_thread_context_t);
+	for(int i = 0; i < VGPU_MULTI_BUFFERING; ++i)
+		vgpu_linear_allocator_create(&thread_context->frame_allocator[i], device->allocator, VGPU_FRAME_ALLOCATOR_CHUNK_SIZE);
+	thread_context->frame_id = 0;
 	return thread_context;
 }
 
 void vgpu_destroy_thread_context(vgpu_device_t* device, vgpu_thread_context_t* thread_context)
 {
+	for(int i = 0; i < VGPU_MULTI_BUFFERING; ++i)
+		vgpu_linear_allocator_destroy(&thread_context->frame_allocator[i]);
 	VGPU_FREE(device->allocator, thread_context);
 }
 
 void vgpu_prepare_thread_context(vgpu_device_t* device, vgpu_thread_context_t* thread_context)
 {
+	thread_context->frame_id = device->frame_no % VGPU_MULTI_BUFFERING;
+	vgpu_linear_allocator_reset(&thread_context->frame_allocator[thread_context->frame_id]);
+}
+
+vgpu_allocator_t* vgpu_get_thread_frame_allocator(vgpu_thread_context_t* thread_context)
+{
+	return &thread_context->frame_allocator[thread_context->frame_id].base;
 }
 
 /******************************************************************************\
@@ -276,33 +884,45 @@ void vgpu_prepare_thread_context(vgpu_device_t* device, vgpu_thread_context_t* t
  *
 \******************************************************************************/
 
-vgpu_buffer_t* vgpu_create_buffer(vgpu_device_t* device, const vgpu_create_buffer_params_t* params)
+static void init_buffer(vgpu_device_t* device, vgpu_buffer_t* buffer, const vgpu_create_buffer_params_t* params)
 {
 	vgpu_glc_t* glc = &device->glc;
-	vgpu_buffer_t* buffer = VGPU_ALLOC_TYPE(device->allocator, vgpu_buffer_t);
 
 	glc->glCreateBuffers(1, &buffer->gl_id);
 	GLERR_CHECK(glc);
 
-	GLbitfield flags = GL_MAP_WRITE_BIT | GL_DYNAMIC_STORAGE_BIT; // TODO: remove this and have an upload buffer for updating non dynamic buffers
-	glc->glNamedBufferStorage(buffer->gl_id, params->num_bytes, nullptr, flags);
+	// Only written through copies from the staging ring, so no CPU access
+	glc->glNamedBufferStorage(buffer->gl_id, params->num_bytes, nullptr, 0);
 	GLERR_CHECK(glc);
 
 	buffer->num_bytes = params->num_bytes;
+}
 
+vgpu_buffer_t* vgpu_create_buffer(vgpu_device_t* device, const vgpu_create_buffer_params_t* params)
+{
+	vgpu_buffer_t* buffer = device->buffer_pool.alloc();
+	init_buffer(device, buffer, params);
 	return buffer;
 }
 
-void vgpu_destroy_buffer(vgpu_device_t* device, vgpu_buffer_t* buffer)
+static void release_buffer(vgpu_device_t* device, vgpu_buffer_t* buffer)
 {
 	vgpu_glc_t* glc = &device->glc;
+	flush_immediate_draws(device);
 
 	glc->glDeleteBuffers(1, &buffer->gl_id);
 	GLERR_CHECK(glc);
+}
 
-	VGPU_FREE(device->allocator, buffer);
+void vgpu_destroy_buffer(vgpu_device_t* device, vgpu_buffer_t* buffer)
+{
+	release_buffer(device, buffer);
+	device->buffer_pool.free(buffer);
 }
 
+// Buffer handle entry points on top of init_buffer and release_buffer
+#include "vgpu_buffer_handles.h"
+
 /******************************************************************************\
  *
  *  Resource table handling
@@ -311,7 +931,7 @@ void vgpu_destroy_buffer(vgpu_device_t* device, vgpu_buffer_t* buffer)
 
 vgpu_resource_table_t* vgpu_create_resource_table(vgpu_device_t* device, const vgpu_root_layout_t* root_layout, uint32_t root_slot, const vgpu_resource_table_entry_t* entries, size_t num_entries)
 {
-	vgpu_resource_table_t* resource_table = VGPU_ALLOC_TYPE(device->allocator, vgpu_resource_table_t);
+	vgpu_resource_table_t* resource_table = device->resource_table_pool.alloc();
 	memset(resource_table, 0, sizeof(*resource_table));
 	resource_table->num_entries = num_entries;
 	memcpy(resource_table->entries, entries, num_entries * sizeof(vgpu_resource_table_entry_t));
@@ -322,7 +942,12 @@ vgpu_resource_table_t* vgpu_create_resource_table(vgpu_device_t* device, const v
 
 void vgpu_destroy_resource_table(vgpu_device_t* device, vgpu_resource_table_t* resource_table)
 {
-	VGPU_FREE(device->allocator, resource_table);
+	device->resource_table_pool.free(resource_table);
+}
+
+void vgpu_compact_resource_tables(vgpu_device_t* device, uint32_t time_budget_us)
+{
+	// Nothing to compact, resource tables are not backed by a shared heap
 }
 
 /******************************************************************************\
@@ -333,7 +958,7 @@ void vgpu_destroy_resource_table(vgpu_device_t* device, vgpu_resource_table_t* r
 
 vgpu_root_layout_t* vgpu_create_root_layout(vgpu_device_t* device, const vgpu_root_layout_slot_t* slots, size_t num_slots)
 {
-	vgpu_root_layout_t* root_layout = VGPU_ALLOC_TYPE(device->allocator, vgpu_root_layout_t);
+	vgpu_root_layout_t* root_layout = device->root_layout_pool.alloc();
 	memset(root_layout, 0, sizeof(*root_layout));
 	memcpy(root_layout, slots, num_slots * sizeof(*slots));
 
@@ -342,7 +967,7 @@ vgpu_root_layout_t* vgpu_create_root_layout(vgpu_device_t* device, const vgpu_ro
 
 void vgpu_destroy_root_layout(vgpu_device_t* device, vgpu_root_layout_t* root_layout)
 {
-	VGPU_FREE(device->allocator, root_layout);
+	device->root_layout_pool.free(root_layout);
 }
 
 /******************************************************************************\
@@ -354,10 +979,12 @@ void vgpu_destroy_root_layout(vgpu_device_t* device, vgpu_root_layout_t* root_la
 vgpu_texture_t* vgpu_create_texture(vgpu_device_t* device, const vgpu_create_texture_params_t* params)
 {
 	vgpu_glc_t* glc = &device->glc;
-	vgpu_texture_t* texture = VGPU_ALLOC_TYPE(device->allocator, vgpu_texture_t);
+	vgpu_texture_t* texture = device->texture_pool.alloc();
 
 	VGPU_ASSERT(device, params->type == VGPU_TEXTURETYPE_2D, "Type must be 2D for now\n");
 
+	texture->type = params->type;
+	texture->format = params->format;
 	texture->width = params->width;
 	texture->height = params->height;
 	texture->depth = params->depth;
@@ -366,7 +993,10 @@ vgpu_texture_t* vgpu_create_texture(vgpu_device_t* device, const vgpu_create_tex
 	// TODO: use NamedTexture etc.
 	glc->glGenTextures(1, &texture->gl_id);
 	glc->glBindTexture(GL_TEXTURE_2D, texture->gl_id);
-	glc->glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA8, texture->width, texture->height, 0, GL_BGRA, GL_UNSIGNED_INT_8_8_8_8_REV, nullptr);
+	if(params->format == VGPU_TEXTUREFORMAT_D32F_S8X24)
+		glc->glTexImage2D(GL_TEXTURE_2D, 0, GL_DEPTH32F_STENCIL8, texture->width, texture->height, 0, GL_DEPTH_STENCIL, GL_FLOAT_32_UNSIGNED_INT_24_8_REV, nullptr);
+	else // TODO: BC formats
+		glc->glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA8, texture->width, texture->height, 0, GL_BGRA, GL_UNSIGNED_INT_8_8_8_8_REV, nullptr);
 	glc->glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
 	glc->glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
 	glc->glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_BORDER);
@@ -382,9 +1012,11 @@ vgpu_texture_t* vgpu_create_texture(vgpu_device_t* device, const vgpu_create_tex
 void vgpu_destroy_texture(vgpu_device_t* device, vgpu_texture_t* texture)
 {
 	vgpu_glc_t* glc = &device->glc;
+	flush_immediate_draws(device);
+	evict_framebuffers(device, texture->gl_id);
 	glc->glDeleteTextures(1, &texture->gl_id);
 
-	VGPU_FREE(device->allocator, texture);
+	device->texture_pool.free(texture);
 }
 
 /******************************************************************************\
@@ -414,27 +1046,57 @@ static void vgpu_gl_check_for_shader_errors(vgpu_glc_t* glc, GLuint shader)
 	}
 }
 
-vgpu_program_t* vgpu_create_program(vgpu_device_t* device, const vgpu_create_program_params_t* params)
+static void compile_program(vgpu_device_t* device, vgpu_program_t* program, const GLchar* data, GLint size)
 {
-	vgpu_program_t* program = VGPU_ALLOC_TYPE(device->allocator, vgpu_program_t);
-
 	vgpu_glc_t* glc = &device->glc;
 
-	GLenum type = translate_program_type[params->program_type];
+	GLenum type = translate_program_type[program->program_type];
 
 	GLERR_CHECK(glc);
 	program->gl_id = glc->glCreateShader(type);
 	GLERR_CHECK(glc);
-	const GLchar* data = (const GLchar*)params->data;
-	GLint size = params->size;
 	glc->glShaderSource(program->gl_id, 1, &data, &size);
 	GLERR_CHECK(glc);
 	glc->glCompileShader(program->gl_id);
 	GLERR_CHECK(glc);
-	vgpu_gl_check_for_shader_errors(glc, program->gl_id);
+	// Checking waits for the compile, async pipelines check when the link failed
+	if(!(device->caps.flags & VGPU_CAPS_FLAG_ASYNC_PIPELINE_COMPILE))
+		vgpu_gl_check_for_shader_errors(glc, program->gl_id);
 	GLERR_CHECK(glc);
+}
+
+// Compiles a program deferred by the pipeline cache, the source isn't needed after
+static GLuint get_program_shader(vgpu_device_t* device, vgpu_program_t* program)
+{
+	if(program->gl_id == 0)
+	{
+		compile_program(device, program, program->source, program->source_size);
+		VGPU_FREE(device->allocator, program->source);
+		program->source = nullptr;
+	}
+	return program->gl_id;
+}
 
+vgpu_program_t* vgpu_create_program(vgpu_device_t* device, const vgpu_create_program_params_t* params)
+{
+	vgpu_program_t* program = device->program_pool.alloc();
+	program->gl_id = 0;
 	program->program_type = params->program_type;
+	program->source = nullptr;
+	program->source_size = (GLint)params->size;
+
+	uint64_t type = params->program_type;
+	program->hash = vgpu_hash(params->data, params->size, vgpu_hash(&type, sizeof(type), VGPU_HASH_SEED));
+
+	if(device->pipeline_cache_path)
+	{
+		program->source = (char*)VGPU_ALLOC(device->allocator, params->size, 1);
+		memcpy(program->source, params->data, params->size);
+	}
+	else
+	{
+		compile_program(device, program, (const GLchar*)params->data, program->source_size);
+	}
 
 	return program;
 }
@@ -442,8 +1104,11 @@ vgpu_program_t* vgpu_create_program(vgpu_device_t* device, const vgpu_create_pro
 void vgpu_destroy_program(vgpu_device_t* device, vgpu_program_t* program)
 {
 	vgpu_glc_t* glc = &device->glc;
-	glc->glDeleteShader(program->gl_id);
-	VGPU_FREE(device->allocator, program);
+	if(program->gl_id)
+		glc->glDeleteShader(program->gl_id);
+	if(program->source)
+		VGPU_FREE(device->allocator, program->source);
+	device->program_pool.free(program);
 }
 
 /******************************************************************************\
@@ -473,18 +1138,72 @@ static void vgpu_gl_check_for_program_errors(vgpu_glc_t* glc, GLuint program)
 	}
 }
 
+// Waits for the link if it isn't done, reports errors and fills the pipeline cache
+static void finish_pipeline(vgpu_device_t* device, vgpu_pipeline_t* pipeline)
+{
+	vgpu_glc_t* glc = &device->glc;
+
+	GLint linked = GL_FALSE;
+	glc->glGetProgramiv(pipeline->gl_id, GL_LINK_STATUS, &linked);
+	if(linked != GL_TRUE)
+	{
+		if(device->caps.flags & VGPU_CAPS_FLAG_ASYNC_PIPELINE_COMPILE)
+		{
+			for(size_t i = 0; i < VGPU_ARRAY_LENGTH(pipeline->shaders); ++i)
+			{
+				if(pipeline->shaders[i])
+					vgpu_gl_check_for_shader_errors(glc, pipeline->shaders[i]);
+			}
+		}
+		vgpu_gl_check_for_program_errors(glc, pipeline->gl_id);
+	}
+	else if(pipeline->store_binary)
+	{
+		store_program_binary(device, pipeline->gl_id, pipeline->cache_key);
+	}
+	GLERR_CHECK(glc);
+
+	pipeline->ready = true;
+}
+
 vgpu_pipeline_t* vgpu_create_pipeline(vgpu_device_t* device, const vgpu_create_pipeline_params_t* params)
 {
 	vgpu_glc_t* glc = &device->glc;
-	vgpu_pipeline_t* pipeline = VGPU_ALLOC_TYPE(device->allocator, vgpu_pipeline_t);
+	vgpu_pipeline_t* pipeline = device->pipeline_pool.alloc();
 
 	pipeline->gl_id = glc->glCreateProgram();
 
-	glc->glAttachShader(pipeline->gl_id, params->vertex_program->gl_id);
-	if(params->fragment_program)
-		glc->glAttachShader(pipeline->gl_id, params->fragment_program->gl_id);
-	glc->glLinkProgram(pipeline->gl_id);
-	vgpu_gl_check_for_program_errors(glc, pipeline->gl_id);
+	pipeline->ready = true;
+	pipeline->shaders[0] = 0;
+	pipeline->shaders[1] = 0;
+	pipeline->store_binary = false;
+	pipeline->cache_key = 0;
+
+	bool cached = false;
+	if(device->pipeline_cache_path)
+	{
+		pipeline->cache_key = pipeline_cache_key(device, params);
+		cached = load_program_binary(device, pipeline->gl_id, pipeline->cache_key);
+	}
+
+	if(!cached)
+	{
+		pipeline->shaders[0] = get_program_shader(device, params->vertex_program);
+		glc->glAttachShader(pipeline->gl_id, pipeline->shaders[0]);
+		if(params->fragment_program)
+		{
+			pipeline->shaders[1] = get_program_shader(device, params->fragment_program);
+			glc->glAttachShader(pipeline->gl_id, pipeline->shaders[1]);
+		}
+		if(device->pipeline_cache_path)
+			glc->glProgramParameteri(pipeline->gl_id, GL_PROGRAM_BINARY_RETRIEVABLE_HINT, GL_TRUE);
+		glc->glLinkProgram(pipeline->gl_id);
+
+		pipeline->ready = false;
+		pipeline->store_binary = device->pipeline_cache_path != nullptr;
+		if(!(device->caps.flags & VGPU_CAPS_FLAG_ASYNC_PIPELINE_COMPILE))
+			finish_pipeline(device, pipeline);
+	}
 
 	pipeline->prim_type = translate_primitive_type[params->primitive_type];
 
@@ -501,15 +1220,15 @@ vgpu_pipeline_t* vgpu_create_pipeline(vgpu_device_t* device, const vgpu_create_p
 	{
 		int b = i > max_blend ? max_blend : i;
 
-		pipeline->blend[i].enabled = params->state.blend[i].enabled;
+		pipeline->blend[i].enabled = params->state.blend[b].enabled;
 
-		pipeline->blend[i].src_color_func = translate_blend_elem[params->state.blend[i].color_src];
-		pipeline->blend[i].dst_color_func = translate_blend_elem[params->state.blend[i].color_dst];
-		pipeline->blend[i].color_equation = translate_blend_op[params->state.blend[i].color_op];
+		pipeline->blend[i].src_color_func = translate_blend_elem[params->state.blend[b].color_src];
+		pipeline->blend[i].dst_color_func = translate_blend_elem[params->state.blend[b].color_dst];
+		pipeline->blend[i].color_equation = translate_blend_op[params->state.blend[b].color_op];
 
-		pipeline->blend[i].src_alpha_func = translate_blend_elem[params->state.blend[i].alpha_src];
-		pipeline->blend[i].dst_alpha_func = translate_blend_elem[params->state.blend[i].alpha_dst];
-		pipeline->blend[i].alpha_equation = translate_blend_op[params->state.blend[i].alpha_op];
+		pipeline->blend[i].src_alpha_func = translate_blend_elem[params->state.blend[b].alpha_src];
+		pipeline->blend[i].dst_alpha_func = translate_blend_elem[params->state.blend[b].alpha_dst];
+		pipeline->blend[i].alpha_equation = translate_blend_op[params->state.blend[b].alpha_op];
 	}
 
 	pipeline->depth_test.enabled = params->state.depth.enabled;
@@ -532,6 +1251,7 @@ vgpu_pipeline_t* vgpu_create_pipeline(vgpu_device_t* device, const vgpu_create_p
 	pipeline->stencil_test.back.mask = params->state.stencil.read_mask; // TODO: ???
 
 	pipeline->root_layout = params->root_layout;
+	pipeline->serial = device->next_pipeline_serial++;
 
 	return pipeline;
 }
@@ -539,8 +1259,29 @@ vgpu_pipeline_t* vgpu_create_pipeline(vgpu_device_t* device, const vgpu_create_p
 void vgpu_destroy_pipeline(vgpu_device_t* device, vgpu_pipeline_t* pipeline)
 {
 	vgpu_glc_t* glc = &device->glc;
+	flush_immediate_draws(device);
 	glc->glDeleteProgram(pipeline->gl_id);
-	VGPU_FREE(device->allocator, pipeline);
+
+	// The slot can be handed out again, don't let a new pipeline match the stale pointer
+	if(device->state.pipeline == pipeline)
+		device->state.pipeline = nullptr;
+	// GL may reuse the program name as well
+	if(device->state.program == pipeline->gl_id)
+		device->state.program = 0;
+	device->pipeline_pool.free(pipeline);
+}
+
+bool vgpu_is_pipeline_ready(vgpu_device_t* device, vgpu_pipeline_t* pipeline)
+{
+	if(!pipeline->ready)
+	{
+		GLint completed = GL_FALSE;
+		device->glc.glGetProgramiv(pipeline->gl_id, GL_COMPLETION_STATUS_KHR, &completed);
+		if(completed != GL_TRUE)
+			return false;
+		finish_pipeline(device, pipeline);
+	}
+	return true;
 }
 
 /******************************************************************************\
@@ -551,18 +1292,38 @@ void vgpu_destroy_pipeline(vgpu_device_t* device, vgpu_pipeline_t* pipeline)
 
 vgpu_render_pass_t* vgpu_create_render_pass(vgpu_device_t* device, const vgpu_create_render_pass_params_t* params)
 {
-	vgpu_render_pass_t* render_pass = VGPU_ALLOC_TYPE(device->allocator, vgpu_render_pass_t);
+	VGPU_ASSERT(device, params->num_color_targets <= VGPU_MAX_RENDER_TARGETS, "Too many color targets");
+
+	vgpu_render_pass_t* render_pass = device->render_pass_pool.alloc();
 	memset(render_pass, 0, sizeof(*render_pass));
 	render_pass->num_color_targets = params->num_color_targets;
 
 	for (size_t i = 0; i < params->num_color_targets; ++i)
 	{
-		render_pass->color_clear_value[i] = params->color_targets[i].texture->clear_value;
+		const vgpu_render_pass_target_param_t* target = &params->color_targets[i];
+		render_pass->color_targets[i] = target->texture;
+		render_pass->color_clear_value[i] = target->texture->clear_value;
+		render_pass->is_back_buffer |= target->texture == &device->backbuffer;
+		render_pass->clear_mask |= target->clear_on_bind ? 1u << i : 0;
+		render_pass->discard_mask |= target->discard_on_unbind ? 1u << i : 0;
 	}
+	VGPU_ASSERT(device, !render_pass->is_back_buffer || params->num_color_targets == 1, "The back buffer can't be combined with other color targets");
 
-	if (params->depth_stencil_target.texture)
+	const vgpu_render_pass_target_param_t* depth_stencil = &params->depth_stencil_target;
+	if (depth_stencil->texture)
 	{
-		render_pass->depth_stencil_clear_value = params->depth_stencil_target.texture->clear_value;
+		VGPU_ASSERT(device, !render_pass->is_back_buffer, "The back buffer has its own depth stencil buffer");
+		render_pass->depth_stencil_target = depth_stencil->texture;
+		render_pass->depth_stencil_clear_value = depth_stencil->texture->clear_value;
+		render_pass->clear_mask |= depth_stencil->clear_on_bind ? VGPU_GL_DEPTH_STENCIL_ATTACHMENT : 0;
+		render_pass->discard_mask |= depth_stencil->discard_on_unbind ? VGPU_GL_DEPTH_STENCIL_ATTACHMENT : 0;
+	}
+	else if (render_pass->is_back_buffer)
+	{
+		render_pass->depth_stencil_clear_value.depth_stencil.depth = 1.0f;
+		render_pass->depth_stencil_clear_value.depth_stencil.stencil = 0;
+		render_pass->clear_mask |= (render_pass->clear_mask & 1) ? VGPU_GL_DEPTH_STENCIL_ATTACHMENT : 0;
+		render_pass->discard_mask |= (render_pass->discard_mask & 1) ? VGPU_GL_DEPTH_STENCIL_ATTACHMENT : 0;
 	}
 
 	return render_pass;
@@ -570,7 +1331,7 @@ vgpu_render_pass_t* vgpu_create_render_pass(vgpu_device_t* device, const vgpu_cr
 
 void vgpu_destroy_render_pass(vgpu_device_t* device, vgpu_render_pass_t* render_pass)
 {
-	VGPU_FREE(device->allocator, render_pass);
+	device->render_pass_pool.free(render_pass);
 }
 
 /******************************************************************************\
@@ -584,7 +1345,7 @@ vgpu_command_list_t* vgpu_create_command_list(vgpu_device_t* device, const vgpu_
 	VGPU_ASSERT(device, params->type == VGPU_COMMAND_LIST_IMMEDIATE_GRAPHICS, "Only immediate graphics command lists supported on OpenGL");
 	VGPU_ASSERT(device, device->immediate_command_list == nullptr, "An immediate graphics command list has already been created");
 
-	vgpu_command_list_t* command_list = VGPU_ALLOC_TYPE(device->allocator, vgpu_command_list_t);
+	vgpu_command_list_t* command_list = device->command_list_pool.alloc();
 	command_list->device = device;
 	command_list->glc = &device->glc;
 	command_list->curr_pipeline = nullptr;
@@ -592,6 +1353,9 @@ vgpu_command_list_t* vgpu_create_command_list(vgpu_device_t* device, const vgpu_
 	command_list->curr_render_pass = nullptr;
 	command_list->curr_index_type = 0;
 	command_list->curr_index_size = 0;
+	command_list->curr_index_buffer = nullptr;
+	command_list->curr_framebuffer = 0;
+	command_list->batch.num_draws = 0;
 
 	device->immediate_command_list = command_list;
 
@@ -600,8 +1364,9 @@ vgpu_command_list_t* vgpu_create_command_list(vgpu_device_t* device, const vgpu_
 
 void vgpu_destroy_command_list(vgpu_device_t* device, vgpu_command_list_t* command_list)
 {
+	flush_draws(command_list);
 	device->immediate_command_list = nullptr;
-	VGPU_FREE(device->allocator, command_list);
+	device->command_list_pool.free(command_list);
 }
 
 bool vgpu_is_command_list_type_supported(vgpu_device_t* device, vgpu_command_list_type_t command_list_type)
@@ -624,14 +1389,18 @@ void vgpu_begin_command_list(vgpu_thread_context_t* thread_context, vgpu_command
 
 void vgpu_end_command_list(vgpu_command_list_t* command_list)
 {
+	flush_draws(command_list);
+	unbind_render_pass(command_list);
 }
 
 void* vgpu_lock_buffer(vgpu_command_list_t* command_list, vgpu_lock_buffer_params_t* params)
 {
-	vgpu_glc_t* glc = command_list->glc;
+	vgpu_device_t* device = command_list->device;
+	VGPU_ASSERT(device, params->offset + params->num_bytes <= params->buffer->num_bytes, "Lock range exceeds buffer range");
 
-	void* ptr = glc->glMapNamedBufferRange(params->buffer->gl_id, params->offset, params->num_bytes, GL_MAP_WRITE_BIT);
-	GLERR_CHECK(glc);
+	vgpu_gl_lock_data_t lock_data;
+	void* ptr = alloc_staging(device, params->num_bytes, &lock_data);
+	memcpy(params->unlock_data, &lock_data, sizeof(lock_data));
 
 	return ptr;
 }
@@ -640,21 +1409,36 @@ void vgpu_unlock_buffer(vgpu_command_list_t* command_list, const vgpu_lock_buffe
 {
 	vgpu_glc_t* glc = command_list->glc;
 
-	glc->glUnmapNamedBuffer(params->buffer->gl_id);
+	vgpu_gl_lock_data_t lock_data;
+	memcpy(&lock_data, params->unlock_data, sizeof(lock_data));
+
+	flush_draws(command_list);
+
+	if(lock_data.temporary)
+		glc->glUnmapNamedBuffer(lock_data.staging_gl_id);
+	glc->glCopyNamedBufferSubData(lock_data.staging_gl_id, params->buffer->gl_id, lock_data.staging_offset, params->offset, params->num_bytes);
+	// Deleting is deferred by GL until the copy is done
+	if(lock_data.temporary)
+		glc->glDeleteBuffers(1, &lock_data.staging_gl_id);
 	GLERR_CHECK(glc);
 }
 
 void vgpu_set_buffer_data(vgpu_command_list_t* command_list, vgpu_buffer_t* buffer, size_t offset, const void* data, size_t num_bytes)
 {
-	vgpu_glc_t* glc = command_list->glc;
-
-	glc->glNamedBufferSubData(buffer->gl_id, offset, num_bytes, data);
-	GLERR_CHECK(glc);
+	vgpu_lock_buffer_params_t lock_params;
+	lock_params.buffer = buffer;
+	lock_params.offset = offset;
+	lock_params.num_bytes = num_bytes;
+
+	void* ptr = vgpu_lock_buffer(command_list, &lock_params);
+	memcpy(ptr, data, num_bytes);
+	vgpu_unlock_buffer(command_list, &lock_params);
 }
 
 void vgpu_set_resource_table(vgpu_command_list_t* command_list, uint32_t slot, vgpu_resource_table_t* resource_table)
 {
 	vgpu_glc_t* glc = command_list->glc;
+	flush_draws(command_list);
 
 	vgpu_pipeline_t* pipeline = command_list->curr_pipeline;
 	for(size_t i = 0; i < resource_table->num_entries; ++i)
@@ -687,6 +1471,7 @@ void vgpu_set_resource_table(vgpu_command_list_t* command_list, uint32_t slot, v
 void vgpu_set_buffer(vgpu_command_list_t* command_list, uint32_t slot, vgpu_buffer_t* buffer, size_t offset, size_t num_bytes)
 {
 	vgpu_glc_t* glc = command_list->glc;
+	flush_draws(command_list);
 	glc->glBindBufferRange(GL_SHADER_STORAGE_BUFFER,
 		(GLint)command_list->curr_root_layout->slots[slot].resource.location,
 		buffer->gl_id,
@@ -695,116 +1480,370 @@ void vgpu_set_buffer(vgpu_command_list_t* command_list, uint32_t slot, vgpu_buff
 	GLERR_CHECK(glc);
 }
 
-void vgpu_set_pipeline(vgpu_command_list_t* command_list, vgpu_pipeline_t* pipeline)
+static void apply_polygon_state(vgpu_glc_t* glc, vgpu_gl_polygon_state_t* curr, const vgpu_gl_polygon_state_t* next, bool force)
 {
-	vgpu_glc_t* glc = command_list->glc;
+	if(force || curr->mode != next->mode)
+		glc->glPolygonMode(GL_FRONT_AND_BACK, next->mode);
+	if(force || curr->front_face != next->front_face)
+		glc->glFrontFace(next->front_face);
 
-	glc->glUseProgram(pipeline->gl_id);
+	if(force || curr->cull_face_enable != next->cull_face_enable)
+	{
+		if(next->cull_face_enable)
+			glc->glEnable(GL_CULL_FACE);
+		else
+			glc->glDisable(GL_CULL_FACE);
+	}
+	if(force || (next->cull_face_enable && curr->cull_face != next->cull_face))
+	{
+		glc->glCullFace(next->cull_face);
+		curr->cull_face = next->cull_face;
+	}
 
-	glc->glPolygonMode(GL_FRONT_AND_BACK, pipeline->polygon.mode);
-	GLERR_CHECK(glc);
-	glc->glFrontFace(pipeline->polygon.front_face);
-	GLERR_CHECK(glc);
-	if(pipeline->polygon.cull_face_enable)
+	if(force || curr->offset_enable != next->offset_enable)
 	{
-		glc->glEnable(GL_CULL_FACE);
-		glc->glCullFace(pipeline->polygon.cull_face);
-		GLERR_CHECK(glc);
+		if(next->offset_enable)
+			glc->glEnable(GL_POLYGON_OFFSET_FILL); // TODO: other fill modes
+		else
+			glc->glDisable(GL_POLYGON_OFFSET_FILL); // TODO: other fill modes
 	}
-	else
+	if(force || (next->offset_enable && (curr->offset_factor != next->offset_factor || curr->offset_units != next->offset_units)))
 	{
-		glc->glDisable(GL_CULL_FACE);
-		GLERR_CHECK(glc);
+		glc->glPolygonOffset(next->offset_factor, next->offset_units);
+		curr->offset_factor = next->offset_factor;
+		curr->offset_units = next->offset_units;
 	}
 
-	if(pipeline->polygon.offset_enable)
+	curr->mode = next->mode;
+	curr->front_face = next->front_face;
+	curr->cull_face_enable = next->cull_face_enable;
+	curr->offset_enable = next->offset_enable;
+}
+
+static void apply_blend_state(vgpu_glc_t* glc, GLuint target, vgpu_gl_blend_state_t* curr, const vgpu_gl_blend_state_t* next, bool force)
+{
+	if(force || curr->enabled != next->enabled)
 	{
-		glc->glEnable(GL_POLYGON_OFFSET_FILL); // TODO: other fill modes
-		glc->glPolygonOffset(
-				pipeline->polygon.offset_factor,
-				pipeline->polygon.offset_units);
-		GLERR_CHECK(glc);
+		if(next->enabled)
+			glc->glEnablei(GL_BLEND, target);
+		else
+			glc->glDisablei(GL_BLEND, target);
+		curr->enabled = next->enabled;
 	}
-	else
+
+	// Equation and factors are ignored while blending is off, leave them until it is turned on
+	if(!force && !next->enabled)
+		return;
+
+	if(force || curr->color_equation != next->color_equation || curr->alpha_equation != next->alpha_equation)
+		glc->glBlendEquationSeparatei(target, next->color_equation, next->alpha_equation);
+	if(force || curr->src_color_func != next->src_color_func || curr->dst_color_func != next->dst_color_func ||
+		curr->src_alpha_func != next->src_alpha_func || curr->dst_alpha_func != next->dst_alpha_func)
 	{
-		glc->glDisable(GL_POLYGON_OFFSET_FILL); // TODO: other fill modes
-		GLERR_CHECK(glc);
+		glc->glBlendFuncSeparatei(target, next->src_color_func, next->dst_color_func, next->src_alpha_func, next->dst_alpha_func);
+	}
+
+	*curr = *next;
+}
+
+static void apply_depth_state(vgpu_glc_t* glc, vgpu_gl_depth_state_t* curr, const vgpu_gl_depth_state_t* next, bool force)
+{
+	if(force || curr->enabled != next->enabled)
+	{
+		if(next->enabled)
+			glc->glEnable(GL_DEPTH_TEST);
+		else
+			glc->glDisable(GL_DEPTH_TEST);
+		curr->enabled = next->enabled;
+	}
+
+	if(force || (next->enabled && curr->func != next->func))
+	{
+		glc->glDepthFunc(next->func);
+		curr->func = next->func;
+	}
+}
+
+static void apply_stencil_face_state(vgpu_glc_t* glc, GLenum face, vgpu_gl_stencil_face_state_t* curr, const vgpu_gl_stencil_face_state_t* next, bool force)
+{
+	if(force || curr->func != next->func || curr->ref != next->ref || curr->mask != next->mask)
+		glc->glStencilFuncSeparate(face, next->func, next->ref, next->mask);
+	if(force || curr->fail_op != next->fail_op || curr->depth_fail_op != next->depth_fail_op || curr->pass_op != next->pass_op)
+		glc->glStencilOpSeparate(face, next->fail_op, next->depth_fail_op, next->pass_op);
+
+	*curr = *next;
+}
+
+static void apply_stencil_state(vgpu_glc_t* glc, vgpu_gl_stencil_state_t* curr, const vgpu_gl_stencil_state_t* next, bool force)
+{
+	if(force || curr->enabled != next->enabled)
+	{
+		if(next->enabled)
+			glc->glEnable(GL_STENCIL_TEST);
+		else
+			glc->glDisable(GL_STENCIL_TEST);
+		curr->enabled = next->enabled;
+	}
+
+	if(force || next->enabled)
+	{
+		apply_stencil_face_state(glc, GL_FRONT, &curr->front, &next->front, force);
+		apply_stencil_face_state(glc, GL_BACK, &curr->back, &next->back, force);
 	}
+}
+
+// The state that has to be sent when going from prev to next. Parameters of
+// disabled state are never sent, so they are only known to be set when prev
+// had the state enabled.
+static uint64_t compute_transition(const vgpu_pipeline_t* prev, const vgpu_pipeline_t* next)
+{
+#define STATE_BIT(bit) (1ull << (bit))
+	uint64_t bits = 0;
+
+	if(prev->gl_id != next->gl_id)
+		bits |= STATE_BIT(VGPU_GL_STATE_PROGRAM);
+
+	const vgpu_gl_polygon_state_t* pp = &prev->polygon;
+	const vgpu_gl_polygon_state_t* np = &next->polygon;
+	if(pp->mode != np->mode)
+		bits |= STATE_BIT(VGPU_GL_STATE_POLYGON_MODE);
+	if(pp->front_face != np->front_face)
+		bits |= STATE_BIT(VGPU_GL_STATE_FRONT_FACE);
+	if(pp->cull_face_enable != np->cull_face_enable)
+		bits |= STATE_BIT(VGPU_GL_STATE_CULL_ENABLE);
+	if(np->cull_face_enable && (!pp->cull_face_enable || pp->cull_face != np->cull_face))
+		bits |= STATE_BIT(VGPU_GL_STATE_CULL_FACE);
+	if(pp->offset_enable != np->offset_enable)
+		bits |= STATE_BIT(VGPU_GL_STATE_OFFSET_ENABLE);
+	if(np->offset_enable && (!pp->offset_enable || pp->offset_factor != np->offset_factor || pp->offset_units != np->offset_units))
+		bits |= STATE_BIT(VGPU_GL_STATE_OFFSET);
 
-	// blending
 	for(int i = 0; i < VGPU_MAX_RENDER_TARGETS; ++i)
 	{
-		if(pipeline->blend[0].enabled)
+		const vgpu_gl_blend_state_t* pb = &prev->blend[i];
+		const vgpu_gl_blend_state_t* nb = &next->blend[i];
+		if(pb->enabled != nb->enabled)
+			bits |= STATE_BIT(VGPU_GL_STATE_BLEND_ENABLE + i);
+		if(!nb->enabled)
+			continue;
+		if(!pb->enabled || pb->color_equation != nb->color_equation || pb->alpha_equation != nb->alpha_equation)
+			bits |= STATE_BIT(VGPU_GL_STATE_BLEND_EQUATION + i);
+		if(!pb->enabled || pb->src_color_func != nb->src_color_func || pb->dst_color_func != nb->dst_color_func ||
+			pb->src_alpha_func != nb->src_alpha_func || pb->dst_alpha_func != nb->dst_alpha_func)
 		{
-			glc->glEnablei(GL_BLEND, i);
-			glc->glBlendEquationSeparatei(i,
-					pipeline->blend[i].color_equation,
-					pipeline->blend[i].alpha_equation);
-			glc->glBlendFuncSeparatei(i,
-					pipeline->blend[i].src_color_func,
-					pipeline->blend[i].dst_color_func,
-					pipeline->blend[i].src_alpha_func,
-					pipeline->blend[i].dst_alpha_func);
-			GLERR_CHECK(glc);
+			bits |= STATE_BIT(VGPU_GL_STATE_BLEND_FUNC + i);
 		}
-		else
+	}
+
+	const vgpu_gl_depth_state_t* pd = &prev->depth_test;
+	const vgpu_gl_depth_state_t* nd = &next->depth_test;
+	if(pd->enabled != nd->enabled)
+		bits |= STATE_BIT(VGPU_GL_STATE_DEPTH_ENABLE);
+	if(nd->enabled && (!pd->enabled || pd->func != nd->func))
+		bits |= STATE_BIT(VGPU_GL_STATE_DEPTH_FUNC);
+
+	const vgpu_gl_stencil_state_t* ps = &prev->stencil_test;
+	const vgpu_gl_stencil_state_t* ns = &next->stencil_test;
+	if(ps->enabled != ns->enabled)
+		bits |= STATE_BIT(VGPU_GL_STATE_STENCIL_ENABLE);
+	if(ns->enabled)
+	{
+		bool known = ps->enabled;
+		if(!known || ps->front.func != ns->front.func || ps->front.ref != ns->front.ref || ps->front.mask != ns->front.mask)
+			bits |= STATE_BIT(VGPU_GL_STATE_STENCIL_FRONT_FUNC);
+		if(!known || ps->front.fail_op != ns->front.fail_op || ps->front.depth_fail_op != ns->front.depth_fail_op || ps->front.pass_op != ns->front.pass_op)
+			bits |= STATE_BIT(VGPU_GL_STATE_STENCIL_FRONT_OP);
+		if(!known || ps->back.func != ns->back.func || ps->back.ref != ns->back.ref || ps->back.mask != ns->back.mask)
+			bits |= STATE_BIT(VGPU_GL_STATE_STENCIL_BACK_FUNC);
+		if(!known || ps->back.fail_op != ns->back.fail_op || ps->back.depth_fail_op != ns->back.depth_fail_op || ps->back.pass_op != ns->back.pass_op)
+			bits |= STATE_BIT(VGPU_GL_STATE_STENCIL_BACK_OP);
+	}
+
+	return bits;
+#undef STATE_BIT
+}
+
+static uint64_t find_transition(vgpu_device_t* device, const vgpu_pipeline_t* prev, const vgpu_pipeline_t* next)
+{
+	uint64_t key = ((uint64_t)prev->serial << 32) | next->serial;
+	size_t index = (size_t)((key * 0x9E3779B97F4A7C15ull) >> 32) & (VGPU_GL_TRANSITION_CACHE_SIZE - 1);
+
+	vgpu_gl_transition_t* transition = &device->transitions[index];
+	if(transition->key != key)
+	{
+		transition->key = key;
+		transition->state_bits = compute_transition(prev, next);
+	}
+	return transition->state_bits;
+}
+
+static inline int vgpu_gl_ffs(uint64_t mask)
+{
+#if defined(VGPU_WINDOWS)
+	unsigned long index;
+	_BitScanForward64(&index, mask);
+	return (int)index;
+#else
+	return __builtin_ctzll(mask);
+#endif
+}
+
+// Sends the state in state_bits, one call per bit
+static void apply_transition(vgpu_glc_t* glc, uint64_t state_bits, const vgpu_pipeline_t* pipeline)
+{
+	while(state_bits)
+	{
+		int bit = vgpu_gl_ffs(state_bits);
+		state_bits &= state_bits - 1;
+
+		if(bit >= VGPU_GL_STATE_BLEND_ENABLE)
 		{
-			glc->glDisablei(GL_BLEND, i);
-			GLERR_CHECK(glc);
+			int target = (bit - VGPU_GL_STATE_BLEND_ENABLE) % VGPU_MAX_RENDER_TARGETS;
+			const vgpu_gl_blend_state_t* blend = &pipeline->blend[target];
+			switch(bit - target)
+			{
+				case VGPU_GL_STATE_BLEND_ENABLE:
+					if(blend->enabled)
+						glc->glEnablei(GL_BLEND, target);
+					else
+						glc->glDisablei(GL_BLEND, target);
+					break;
+				case VGPU_GL_STATE_BLEND_EQUATION:
+					glc->glBlendEquationSeparatei(target, blend->color_equation, blend->alpha_equation);
+					break;
+				case VGPU_GL_STATE_BLEND_FUNC:
+					glc->glBlendFuncSeparatei(target, blend->src_color_func, blend->dst_color_func, blend->src_alpha_func, blend->dst_alpha_func);
+					break;
+			}
+			continue;
+		}
+
+		switch(bit)
+		{
+			case VGPU_GL_STATE_PROGRAM:
+				glc->glUseProgram(pipeline->gl_id);
+				break;
+			case VGPU_GL_STATE_POLYGON_MODE:
+				glc->glPolygonMode(GL_FRONT_AND_BACK, pipeline->polygon.mode);
+				break;
+			case VGPU_GL_STATE_FRONT_FACE:
+				glc->glFrontFace(pipeline->polygon.front_face);
+				break;
+			case VGPU_GL_STATE_CULL_ENABLE:
+				if(pipeline->polygon.cull_face_enable)
+					glc->glEnable(GL_CULL_FACE);
+				else
+					glc->glDisable(GL_CULL_FACE);
+				break;
+			case VGPU_GL_STATE_CULL_FACE:
+				glc->glCullFace(pipeline->polygon.cull_face);
+				break;
+			case VGPU_GL_STATE_OFFSET_ENABLE:
+				if(pipeline->polygon.offset_enable)
+					glc->glEnable(GL_POLYGON_OFFSET_FILL); // TODO: other fill modes
+				else
+					glc->glDisable(GL_POLYGON_OFFSET_FILL); // TODO: other fill modes
+				break;
+			case VGPU_GL_STATE_OFFSET:
+				glc->glPolygonOffset(pipeline->polygon.offset_factor, pipeline->polygon.offset_units);
+				break;
+			case VGPU_GL_STATE_DEPTH_ENABLE:
+				if(pipeline->depth_test.enabled)
+					glc->glEnable(GL_DEPTH_TEST);
+				else
+					glc->glDisable(GL_DEPTH_TEST);
+				break;
+			case VGPU_GL_STATE_DEPTH_FUNC:
+				glc->glDepthFunc(pipeline->depth_test.func);
+				break;
+			case VGPU_GL_STATE_STENCIL_ENABLE:
+				if(pipeline->stencil_test.enabled)
+					glc->glEnable(GL_STENCIL_TEST);
+				else
+					glc->glDisable(GL_STENCIL_TEST);
+				break;
+			case VGPU_GL_STATE_STENCIL_FRONT_FUNC:
+				glc->glStencilFuncSeparate(GL_FRONT, pipeline->stencil_test.front.func, pipeline->stencil_test.front.ref, pipeline->stencil_test.front.mask);
+				break;
+			case VGPU_GL_STATE_STENCIL_FRONT_OP:
+				glc->glStencilOpSeparate(GL_FRONT, pipeline->stencil_test.front.fail_op, pipeline->stencil_test.front.depth_fail_op, pipeline->stencil_test.front.pass_op);
+				break;
+			case VGPU_GL_STATE_STENCIL_BACK_FUNC:
+				glc->glStencilFuncSeparate(GL_BACK, pipeline->stencil_test.back.func, pipeline->stencil_test.back.ref, pipeline->stencil_test.back.mask);
+				break;
+			case VGPU_GL_STATE_STENCIL_BACK_OP:
+				glc->glStencilOpSeparate(GL_BACK, pipeline->stencil_test.back.fail_op, pipeline->stencil_test.back.depth_fail_op, pipeline->stencil_test.back.pass_op);
+				break;
 		}
 	}
+}
+
+// Without shadowing or a known previous pipeline everything is sent
+static const uint64_t VGPU_GL_STATE_ALL = (1ull << VGPU_GL_STATE_COUNT) - 1;
+
+void vgpu_set_pipeline(vgpu_command_list_t* command_list, vgpu_pipeline_t* pipeline)
+{
+	vgpu_glc_t* glc = command_list->glc;
+	vgpu_device_t* device = command_list->device;
+	vgpu_gl_state_t* state = &device->state;
+
+	if(pipeline != command_list->curr_pipeline)
+		flush_draws(command_list);
+	if(!pipeline->ready)
+		finish_pipeline(device, pipeline);
+	command_list->curr_pipeline = pipeline;
+	command_list->curr_root_layout = pipeline->root_layout;
 
-	// depth
-	if(pipeline->depth_test.enabled)
+	uint32_t flags = device->caps.flags;
+	if(flags & (VGPU_CAPS_FLAG_PIPELINE_STATE_SHADOWING | VGPU_CAPS_FLAG_PIPELINE_TRANSITION_CACHE))
 	{
-		glc->glEnable(GL_DEPTH_TEST);
-		glc->glDepthFunc(pipeline->depth_test.func);
-		GLERR_CHECK(glc);
+		if(state->pipeline == pipeline)
+			return;
 	}
-	else
+
+	if(flags & VGPU_CAPS_FLAG_PIPELINE_TRANSITION_CACHE)
 	{
-		glc->glDisable(GL_DEPTH_TEST);
-		GLERR_CHECK(glc);
+		// Pipeline to pipeline, the field by field shadow below is not kept up to date
+		const vgpu_pipeline_t* prev = state->pipeline;
+		apply_transition(glc, prev ? find_transition(device, prev, pipeline) : VGPU_GL_STATE_ALL, pipeline);
 	}
+	else if(flags & VGPU_CAPS_FLAG_PIPELINE_STATE_SHADOWING)
+	{
+		// Everything is sent the first time, after that only what differs from the shadow state
+		bool force = !state->valid;
 
-	// stencil
-	if(pipeline->stencil_test.enabled)
-	{
-		glc->glEnable(GL_STENCIL_TEST);
-		glc->glStencilFuncSeparate(GL_FRONT,
-				pipeline->stencil_test.front.func,
-				pipeline->stencil_test.front.ref,
-				pipeline->stencil_test.front.mask);
-		glc->glStencilOpSeparate(GL_FRONT,
-				pipeline->stencil_test.front.fail_op,
-				pipeline->stencil_test.front.depth_fail_op,
-				pipeline->stencil_test.front.pass_op);
-		glc->glStencilFuncSeparate(GL_BACK,
-				pipeline->stencil_test.back.func,
-				pipeline->stencil_test.back.ref,
-				pipeline->stencil_test.back.mask);
-		glc->glStencilOpSeparate(GL_BACK,
-				pipeline->stencil_test.back.fail_op,
-				pipeline->stencil_test.back.depth_fail_op,
-				pipeline->stencil_test.back.pass_op);
-		GLERR_CHECK(glc);
+		if(force || state->program != pipeline->gl_id)
+		{
+			glc->glUseProgram(pipeline->gl_id);
+			state->program = pipeline->gl_id;
+		}
+
+		apply_polygon_state(glc, &state->polygon, &pipeline->polygon, force);
+		for(int i = 0; i < VGPU_MAX_RENDER_TARGETS; ++i)
+			apply_blend_state(glc, (GLuint)i, &state->blend[i], &pipeline->blend[i], force);
+		apply_depth_state(glc, &state->depth_test, &pipeline->depth_test, force);
+		apply_stencil_state(glc, &state->stencil_test, &pipeline->stencil_test, force);
+		state->valid = true;
 	}
 	else
 	{
-		glc->glDisable(GL_STENCIL_TEST);
-		GLERR_CHECK(glc);
+		apply_transition(glc, VGPU_GL_STATE_ALL, pipeline);
 	}
+	GLERR_CHECK(glc);
 
-	command_list->curr_pipeline = pipeline;
-	command_list->curr_root_layout = pipeline->root_layout;
+	state->pipeline = pipeline;
 }
 
 void vgpu_set_index_buffer(vgpu_command_list_t* command_list, vgpu_data_type_t index_type, vgpu_buffer_t* index_buffer)
 {
 	vgpu_glc_t* glc = command_list->glc;
+	if(index_buffer != command_list->curr_index_buffer || translate_data_type[index_type] != command_list->curr_index_type)
+		flush_draws(command_list);
+
 	glc->glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, index_buffer->gl_id);
 	GLERR_CHECK(glc);
 
+	command_list->curr_index_buffer = index_buffer;
 	command_list->curr_index_type = translate_data_type[index_type];
 	command_list->curr_index_size = translate_data_type_size[index_type];
 }
@@ -812,52 +1851,164 @@ void vgpu_set_index_buffer(vgpu_command_list_t* command_list, vgpu_data_type_t i
 void vgpu_draw(vgpu_command_list_t* command_list, uint32_t first_instance, uint32_t num_instances, uint32_t first_vertex, uint32_t num_vertices)
 {
 	vgpu_glc_t* glc = command_list->glc;
+	vgpu_device_t* device = command_list->device;
 	vgpu_pipeline_s* pipeline = command_list->curr_pipeline;
 
+	device->num_draws++;
+	if(num_instances == 1 && (device->caps.flags & VGPU_CAPS_FLAG_DRAW_MERGING))
+	{
+		queue_draw(command_list, false, num_vertices, first_vertex, nullptr);
+		return;
+	}
+
+	flush_draws(command_list);
 	glc->glDrawArraysInstanced(pipeline->prim_type,
 			first_vertex,
 			num_vertices,
 			num_instances);
 	GLERR_CHECK(glc);
+	device->num_driver_draws++;
 }
 
 void vgpu_draw_indexed(vgpu_command_list_t* command_list, uint32_t first_instance, uint32_t num_instances, uint32_t first_index, uint32_t num_indices, uint32_t first_vertex)
 {
 	vgpu_glc_t* glc = command_list->glc;
+	vgpu_device_t* device = command_list->device;
 	vgpu_pipeline_s* pipeline = command_list->curr_pipeline;
 
-	glc->glDrawElementsInstanced(pipeline->prim_type,
+	device->num_draws++;
+	if(num_instances == 1 && (device->caps.flags & VGPU_CAPS_FLAG_DRAW_MERGING))
+	{
+		queue_draw(command_list, true, num_indices, first_vertex, (char*)0 + first_index*command_list->curr_index_size);
+		return;
+	}
+
+	flush_draws(command_list);
+	glc->glDrawElementsInstancedBaseVertex(pipeline->prim_type,
 			num_indices,
 			command_list->curr_index_type,
 			(char*)0 + first_index*command_list->curr_index_size,
-			num_instances);
+			num_instances,
+			first_vertex);
 	GLERR_CHECK(glc);
+	device->num_driver_draws++;
 }
 
-void vgpu_clear_render_pass(vgpu_command_list_t* command_list, vgpu_render_pass_t* render_pass)
+// The args structs match DrawArraysIndirectCommand and DrawElementsIndirectCommand,
+// so a whole buffer of them is a single multi draw
+void vgpu_draw_indirect(vgpu_command_list_t* command_list, vgpu_buffer_t* buffer, uint64_t offset, uint32_t count)
+{
+	vgpu_glc_t* glc = command_list->glc;
+	vgpu_pipeline_s* pipeline = command_list->curr_pipeline;
+
+	flush_draws(command_list);
+	glc->glBindBuffer(GL_DRAW_INDIRECT_BUFFER, buffer->gl_id);
+	glc->glMultiDrawArraysIndirect(pipeline->prim_type,
+			(char*)0 + offset,
+			count,
+			sizeof(vgpu_draw_indirect_args_t));
+	GLERR_CHECK(glc);
+	command_list->device->num_draws++;
+	command_list->device->num_driver_draws++;
+}
+
+void vgpu_draw_indexed_indirect(vgpu_command_list_t* command_list, vgpu_buffer_t* buffer, uint64_t offset, uint32_t count)
 {
 	vgpu_glc_t* glc = command_list->glc;
+	vgpu_pipeline_s* pipeline = command_list->curr_pipeline;
+
+	flush_draws(command_list);
+	glc->glBindBuffer(GL_DRAW_INDIRECT_BUFFER, buffer->gl_id);
+	glc->glMultiDrawElementsIndirect(pipeline->prim_type,
+			command_list->curr_index_type,
+			(char*)0 + offset,
+			count,
+			sizeof(vgpu_draw_indexed_indirect_args_t));
+	GLERR_CHECK(glc);
+	command_list->device->num_draws++;
+	command_list->device->num_driver_draws++;
+}
 
-	// TODO: set up the FBO
-	glc->glClearColor(
-		render_pass->color_clear_value[0].r,
-		render_pass->color_clear_value[0].g,
-		render_pass->color_clear_value[0].b,
-		render_pass->color_clear_value[0].a);
-	glc->glClearDepth(render_pass->depth_stencil_clear_value.depth_stencil.depth);
-	glc->glClearStencil(render_pass->depth_stencil_clear_value.depth_stencil.stencil);
-	glc->glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT | GL_STENCIL_BUFFER_BIT);
+void vgpu_draw_indirect_count(vgpu_command_list_t* command_list, vgpu_buffer_t* buffer, uint64_t offset, vgpu_buffer_t* count_buffer, uint64_t count_offset, uint32_t max_count)
+{
+	vgpu_glc_t* glc = command_list->glc;
+	vgpu_pipeline_s* pipeline = command_list->curr_pipeline;
+	VGPU_ASSERT(command_list->device, command_list->device->caps.flags & VGPU_CAPS_FLAG_DRAW_INDIRECT_COUNT, "Indirect count draws are not supported");
+	if((command_list->device->caps.flags & VGPU_CAPS_FLAG_DRAW_INDIRECT_COUNT) == 0)
+		return;
+
+	flush_draws(command_list);
+	glc->glBindBuffer(GL_DRAW_INDIRECT_BUFFER, buffer->gl_id);
+	glc->glBindBuffer(GL_PARAMETER_BUFFER_ARB, count_buffer->gl_id);
+	glc->glMultiDrawArraysIndirectCount(pipeline->prim_type,
+			(GLintptr)offset,
+			(GLintptr)count_offset,
+			max_count,
+			sizeof(vgpu_draw_indirect_args_t));
+	GLERR_CHECK(glc);
+	command_list->device->num_draws++;
+	command_list->device->num_driver_draws++;
+}
+
+void vgpu_draw_indexed_indirect_count(vgpu_command_list_t* command_list, vgpu_buffer_t* buffer, uint64_t offset, vgpu_buffer_t* count_buffer, uint64_t count_offset, uint32_t max_count)
+{
+	vgpu_glc_t* glc = command_list->glc;
+	vgpu_pipeline_s* pipeline = command_list->curr_pipeline;
+	VGPU_ASSERT(command_list->device, command_list->device->caps.flags & VGPU_CAPS_FLAG_DRAW_INDIRECT_COUNT, "Indirect count draws are not supported");
+	if((command_list->device->caps.flags & VGPU_CAPS_FLAG_DRAW_INDIRECT_COUNT) == 0)
+		return;
+
+	flush_draws(command_list);
+	glc->glBindBuffer(GL_DRAW_INDIRECT_BUFFER, buffer->gl_id);
+	glc->glBindBuffer(GL_PARAMETER_BUFFER_ARB, count_buffer->gl_id);
+	glc->glMultiDrawElementsIndirectCount(pipeline->prim_type,
+			command_list->curr_index_type,
+			(GLintptr)offset,
+			(GLintptr)count_offset,
+			max_count,
+			sizeof(vgpu_draw_indexed_indirect_args_t));
 	GLERR_CHECK(glc);
+	command_list->device->num_draws++;
+	command_list->device->num_driver_draws++;
+}
+
+void vgpu_clear_render_pass(vgpu_command_list_t* command_list, vgpu_render_pass_t* render_pass)
+{
+	flush_draws(command_list);
+
+	uint32_t mask = (1u << render_pass->num_color_targets) - 1;
+	if(render_pass->depth_stencil_target || render_pass->is_back_buffer)
+		mask |= VGPU_GL_DEPTH_STENCIL_ATTACHMENT;
+	clear_attachments(command_list->glc, get_framebuffer(command_list->device, render_pass), render_pass, mask);
 }
 
 void vgpu_set_render_pass(vgpu_command_list_t* command_list, vgpu_render_pass_t* render_pass)
 {
 	vgpu_glc_t* glc = command_list->glc;
+	vgpu_device_t* device = command_list->device;
+	flush_draws(command_list);
+	unbind_render_pass(command_list);
 
-	command_list->curr_render_pass = render_pass;
-	// TODO: set up the FBO
+	GLuint framebuffer = get_framebuffer(device, render_pass);
+	if(device->bound_framebuffer != framebuffer)
+	{
+		glc->glBindFramebuffer(GL_FRAMEBUFFER, framebuffer);
+		device->bound_framebuffer = framebuffer;
+	}
+
+	const vgpu_texture_t* target = render_pass->num_color_targets ? render_pass->color_targets[0] : render_pass->depth_stencil_target;
+	if(target)
+		glc->glViewport(0, 0, target->width, target->height);
+	GLERR_CHECK(glc);
 
-	vgpu_clear_render_pass(command_list, render_pass);
+	if(render_pass->clear_mask)
+	{
+		invalidate_attachments(glc, framebuffer, render_pass, render_pass->clear_mask);
+		clear_attachments(glc, framebuffer, render_pass, render_pass->clear_mask);
+	}
+
+	command_list->curr_render_pass = render_pass;
+	command_list->curr_framebuffer = framebuffer;
 }
 
 void vgpu_transition_buffer(vgpu_command_list_t* command_list, vgpu_buffer_t* buffer, vgpu_resource_state_t state_before, vgpu_resource_state_t state_after)
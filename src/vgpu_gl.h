@@ -3,6 +3,9 @@
 
 #include <vgpu.h>
 #include "vgpu_internal.h"
+#include "vgpu_linear_allocator.h"
+#include "vgpu_slab_pool.h"
+#include "vgpu_handle_table.h"
 
 // TODO: enable asserts. error callback?
 #define ASSERT(X, ...)
@@ -14,6 +17,9 @@
 #	include "wglext.h"
 #elif defined(VGPU_MACOSX)
 #	include <OpenGL/gl3.h>
+#elif defined(VGPU_LINUX)
+#	define EGL_NO_X11
+#	include <EGL/egl.h>
 #else
 #	error not implemented for this platform
 #endif
@@ -21,6 +27,12 @@
 #include "glcorearb.h"
 #include "glext.h"
 
+#ifndef GL_KHR_parallel_shader_compile
+#define GL_MAX_SHADER_COMPILER_THREADS_KHR 0x91B0
+#define GL_COMPLETION_STATUS_KHR          0x91B1
+typedef void (APIENTRYP PFNGLMAXSHADERCOMPILERTHREADSKHRPROC) (GLuint count);
+#endif
+
 #if defined(VGPU_WINDOWS)
 typedef GLenum(APIENTRYP PFNGLGETERRORPROC)();
 typedef void (APIENTRYP PFNGLVIEWPORTPROC)(GLint x, GLint y, GLsizei width, GLsizei height);
@@ -83,6 +95,12 @@ typedef void (APIENTRYP PFNGLDRAWELEMENTSPROC) (GLenum mode, GLsizei count, GLen
 	X(0, DRAWELEMENTS,		DrawElements) \
 	X(1, DRAWARRAYSINSTANCED,DrawArraysInstanced) \
 	X(1, DRAWELEMENTSINSTANCED,DrawElementsInstanced) \
+	X(1, DRAWELEMENTSBASEVERTEX,			DrawElementsBaseVertex) \
+	X(1, DRAWELEMENTSINSTANCEDBASEVERTEX,	DrawElementsInstancedBaseVertex) \
+	X(1, MULTIDRAWARRAYS,				MultiDrawArrays) \
+	X(1, MULTIDRAWELEMENTSBASEVERTEX,	MultiDrawElementsBaseVertex) \
+	X(1, MULTIDRAWARRAYSINDIRECT,		MultiDrawArraysIndirect) \
+	X(1, MULTIDRAWELEMENTSINDIRECT,		MultiDrawElementsIndirect) \
 	/* Vertex array object management */ \
 	X(1, GENVERTEXARRAYS,	GenVertexArrays) \
 	X(1, DELETEVERTEXARRAYS,	DeleteVertexArrays) \
@@ -96,6 +114,11 @@ typedef void (APIENTRYP PFNGLDRAWELEMENTSPROC) (GLenum mode, GLsizei count, GLen
 	X(1, NAMEDBUFFERSUBDATA,NamedBufferSubData) \
 	X(1, MAPNAMEDBUFFERRANGE,			MapNamedBufferRange) \
 	X(1, UNMAPNAMEDBUFFER,				UnmapNamedBuffer) \
+	X(1, COPYNAMEDBUFFERSUBDATA,		CopyNamedBufferSubData) \
+	/* Synchronization */ \
+	X(1, FENCESYNC,			FenceSync) \
+	X(1, CLIENTWAITSYNC,		ClientWaitSync) \
+	X(1, DELETESYNC,			DeleteSync) \
 	/* Program management */ \
 	X(1, CREATESHADER,		CreateShader) \
 	X(1, DELETESHADER,		DeleteShader) \
@@ -111,8 +134,21 @@ typedef void (APIENTRYP PFNGLDRAWELEMENTSPROC) (GLenum mode, GLsizei count, GLen
 	X(1, GETPROGRAMINFOLOG,	GetProgramInfoLog) \
 	X(1, GETPROGRAMIV,		GetProgramiv) \
 	X(1, GETUNIFORMLOCATION,	GetUniformLocation) \
+	X(1, PROGRAMPARAMETERI,	ProgramParameteri) \
+	X(1, PROGRAMBINARY,		ProgramBinary) \
+	X(1, GETPROGRAMBINARY,	GetProgramBinary) \
 	/* Debug */ \
 	X(1, DEBUGMESSAGECALLBACK,DebugMessageCallback) \
+	/* Framebuffer management */ \
+	X(1, CREATEFRAMEBUFFERS,				CreateFramebuffers) \
+	X(1, DELETEFRAMEBUFFERS,				DeleteFramebuffers) \
+	X(1, BINDFRAMEBUFFER,				BindFramebuffer) \
+	X(1, NAMEDFRAMEBUFFERTEXTURE,		NamedFramebufferTexture) \
+	X(1, NAMEDFRAMEBUFFERDRAWBUFFERS,	NamedFramebufferDrawBuffers) \
+	X(1, CHECKNAMEDFRAMEBUFFERSTATUS,	CheckNamedFramebufferStatus) \
+	X(1, INVALIDATENAMEDFRAMEBUFFERDATA,	InvalidateNamedFramebufferData) \
+	X(1, CLEARNAMEDFRAMEBUFFERFV,		ClearNamedFramebufferfv) \
+	X(1, CLEARNAMEDFRAMEBUFFERIV,		ClearNamedFramebufferiv) \
 
 
 struct vgpu_buffer_s
@@ -137,6 +173,7 @@ struct vgpu_texture_s
 {
 	GLuint gl_id;
 	vgpu_texture_type_t type;
+	vgpu_texture_format_t format;
 	uint32_t width;
 	uint32_t height;
 	uint32_t depth;
@@ -149,6 +186,61 @@ struct vgpu_program_s
 {
 	GLuint gl_id;
 	vgpu_program_type_t program_type;
+
+	// With a pipeline cache the shader is compiled on the first pipeline that
+	// misses the cache, until then gl_id is 0 and the source is kept
+	uint64_t hash;
+	char* source;
+	GLint source_size;
+};
+
+// Pipeline state, the device keeps a shadow copy of the last one set in vgpu_gl_state_t
+struct vgpu_gl_polygon_state_t
+{
+	GLenum mode;
+	GLenum front_face;
+
+	bool cull_face_enable;
+	GLenum cull_face;
+
+	bool offset_enable;
+	float offset_factor;
+	float offset_units;
+};
+
+struct vgpu_gl_blend_state_t
+{
+	bool enabled;
+
+	GLenum src_color_func;
+	GLenum dst_color_func;
+	GLenum color_equation;
+
+	GLenum src_alpha_func;
+	GLenum dst_alpha_func;
+	GLenum alpha_equation;
+};
+
+struct vgpu_gl_depth_state_t
+{
+	bool enabled;
+	GLenum func;
+};
+
+struct vgpu_gl_stencil_face_state_t
+{
+	GLenum func;
+	GLenum fail_op;
+	GLenum depth_fail_op;
+	GLenum pass_op;
+	GLint ref;
+	GLuint mask;
+};
+
+struct vgpu_gl_stencil_state_t
+{
+	bool enabled;
+	vgpu_gl_stencil_face_state_t front, back;
 };
 
 struct vgpu_pipeline_s
@@ -156,72 +248,152 @@ struct vgpu_pipeline_s
 	GLuint gl_id;
 	GLenum prim_type;
 
-	struct
-	{
-		GLenum mode;
-		GLenum front_face;
-
-		bool cull_face_enable;
-		GLenum cull_face;
-
-		bool offset_enable;
-		float offset_factor;
-		float offset_units;
-	} polygon;
-
-	struct
-	{
-		bool enabled;
-
-		GLenum src_color_func;
-		GLenum dst_color_func;
-		GLenum color_equation;
-
-		GLenum src_alpha_func;
-		GLenum dst_alpha_func;
-		GLenum alpha_equation;
-	} blend[VGPU_MAX_RENDER_TARGETS];
-
-	struct
-	{
-		bool enabled;
-		GLenum func;
-	} depth_test;
-
-	struct
-	{
-		bool enabled;
-
-		struct
-		{
-			GLenum func;
-			GLenum fail_op;
-			GLenum depth_fail_op;
-			GLenum pass_op;
-			GLint ref;
-			GLuint mask;
-		} front, back;
-	} stencil_test;
+	// Never reused, keys the transition cache
+	uint32_t serial;
+
+	// Link status not checked yet, the driver may still be compiling
+	bool ready;
+	GLuint shaders[2];
+	// Store the binary in the pipeline cache once linked
+	bool store_binary;
+	uint64_t cache_key;
+
+	vgpu_gl_polygon_state_t polygon;
+	vgpu_gl_blend_state_t blend[VGPU_MAX_RENDER_TARGETS];
+	vgpu_gl_depth_state_t depth_test;
+	vgpu_gl_stencil_state_t stencil_test;
 
 	vgpu_root_layout_t* root_layout;
 };
 
+// Attachment bits of render pass masks, color targets are bits 0 to VGPU_MAX_RENDER_TARGETS-1
+#define VGPU_GL_DEPTH_STENCIL_ATTACHMENT (1u << VGPU_MAX_RENDER_TARGETS)
+
 struct vgpu_render_pass_s
 {
-	GLuint gl_id;
 	size_t num_color_targets;
+	vgpu_texture_t* color_targets[VGPU_MAX_RENDER_TARGETS];
+	vgpu_texture_t* depth_stencil_target;
+
+	// Renders to the default framebuffer, which has its own depth stencil
+	// buffer that is cleared and discarded along with the color
+	bool is_back_buffer;
+	uint32_t clear_mask;
+	uint32_t discard_mask;
 
 	vgpu_clear_value_t color_clear_value[VGPU_MAX_RENDER_TARGETS];
 	vgpu_clear_value_t depth_stencil_clear_value;
 };
 
+// FBOs are shared by render passes with the same attachments. An entry goes
+// when one of its textures is destroyed, or as the least recently used one
+// when the cache is full.
+#define VGPU_GL_MAX_FRAMEBUFFERS 64
+
+struct vgpu_gl_framebuffer_t
+{
+	GLuint gl_id;
+	uint32_t num_color_targets;
+	GLuint color_targets[VGPU_MAX_RENDER_TARGETS];
+	GLuint depth_stencil_target;
+	uint64_t last_used_frame;
+};
+
+// Shadow of the GL state set by vgpu_set_pipeline, so switching pipelines
+// only issues the calls for values that differ. Only valid once the first
+// pipeline has been set.
+struct vgpu_gl_state_t
+{
+	bool valid;
+	const vgpu_pipeline_t* pipeline;
+	GLuint program;
+
+	vgpu_gl_polygon_state_t polygon;
+	vgpu_gl_blend_state_t blend[VGPU_MAX_RENDER_TARGETS];
+	vgpu_gl_depth_state_t depth_test;
+	vgpu_gl_stencil_state_t stencil_test;
+};
+
+// Bits of a pipeline transition, set for every piece of state that has to be
+// sent to go from one pipeline to the next. The blend bits are per render
+// target, shifted by the target index.
+enum
+{
+	VGPU_GL_STATE_PROGRAM = 0,
+	VGPU_GL_STATE_POLYGON_MODE,
+	VGPU_GL_STATE_FRONT_FACE,
+	VGPU_GL_STATE_CULL_ENABLE,
+	VGPU_GL_STATE_CULL_FACE,
+	VGPU_GL_STATE_OFFSET_ENABLE,
+	VGPU_GL_STATE_OFFSET,
+	VGPU_GL_STATE_DEPTH_ENABLE,
+	VGPU_GL_STATE_DEPTH_FUNC,
+	VGPU_GL_STATE_STENCIL_ENABLE,
+	VGPU_GL_STATE_STENCIL_FRONT_FUNC,
+	VGPU_GL_STATE_STENCIL_FRONT_OP,
+	VGPU_GL_STATE_STENCIL_BACK_FUNC,
+	VGPU_GL_STATE_STENCIL_BACK_OP,
+	VGPU_GL_STATE_BLEND_ENABLE = 16,
+	VGPU_GL_STATE_BLEND_EQUATION = VGPU_GL_STATE_BLEND_ENABLE + VGPU_MAX_RENDER_TARGETS,
+	VGPU_GL_STATE_BLEND_FUNC = VGPU_GL_STATE_BLEND_EQUATION + VGPU_MAX_RENDER_TARGETS,
+	VGPU_GL_STATE_COUNT = VGPU_GL_STATE_BLEND_FUNC + VGPU_MAX_RENDER_TARGETS,
+};
+
+#define VGPU_GL_TRANSITION_CACHE_SIZE 1024
+
+// Direct mapped, a pair that hashes to a taken slot replaces it. Entries of
+// destroyed pipelines are never hit again as serials are not reused.
+struct vgpu_gl_transition_t
+{
+	uint64_t key; // prev serial << 32 | next serial, 0 when empty
+	uint64_t state_bits;
+};
+
+#define VGPU_GL_STAGING_FRAME_SIZE (4 * 1024 * 1024)
+
+// Persistently mapped upload buffer, one VGPU_GL_STAGING_FRAME_SIZE slot per
+// buffered frame. vgpu_lock_buffer hands out ranges of the current slot and
+// vgpu_unlock_buffer copies them to the locked buffer on the GPU. A slot is
+// written again once vgpu_present has waited for the frame fence of its last
+// frame.
+struct vgpu_gl_staging_ring_t
+{
+	GLuint gl_id;
+	uint8_t* ptr;
+	uint32_t frame_id;
+	size_t offset; // in the slot of frame_id
+};
+
 typedef struct vgpu_glc_s
 {
 #define X(load, type, name) PFNGL##type##PROC gl##name;
 	GPU_GL_FUNCTIONS
 #undef X
+
+	// GL 4.6 or GL_ARB_indirect_parameters, null without
+	PFNGLMULTIDRAWARRAYSINDIRECTCOUNTARBPROC glMultiDrawArraysIndirectCount;
+	PFNGLMULTIDRAWELEMENTSINDIRECTCOUNTARBPROC glMultiDrawElementsIndirectCount;
+	// GL_KHR_parallel_shader_compile or GL_ARB_parallel_shader_compile, null without
+	PFNGLMAXSHADERCOMPILERTHREADSKHRPROC glMaxShaderCompilerThreads;
+
+	// glGetError after calls, off unless VGPU_ERROR_CHECK_FULL
+	bool check_errors;
 } vgpu_glc_t;
 
+#define VGPU_GL_MAX_MERGED_DRAWS 256
+
+// Consecutive draws with the same state, not yet sent to the driver. Indexed
+// draws keep the byte offset of their first index in offsets and their base
+// vertex in firsts, non indexed draws their first vertex in firsts.
+struct vgpu_gl_draw_batch_t
+{
+	uint32_t num_draws;
+	bool indexed;
+	GLsizei counts[VGPU_GL_MAX_MERGED_DRAWS];
+	GLint firsts[VGPU_GL_MAX_MERGED_DRAWS];
+	const void* offsets[VGPU_GL_MAX_MERGED_DRAWS];
+};
+
 struct vgpu_command_list_s
 {
 	vgpu_device_t* device;
@@ -233,10 +405,16 @@ struct vgpu_command_list_s
 	vgpu_render_pass_t* curr_render_pass;
 	GLenum curr_index_type;
 	uint32_t curr_index_size;
+	vgpu_buffer_t* curr_index_buffer;
+	GLuint curr_framebuffer;
+
+	vgpu_gl_draw_batch_t batch;
 };
 
 struct vgpu_thread_context_s
 {
+	vgpu_linear_allocator_t frame_allocator[VGPU_MULTI_BUFFERING];
+	uint32_t frame_id;
 };
 
 struct vgpu_device_s
@@ -245,6 +423,7 @@ struct vgpu_device_s
 
 	vgpu_log_func_t log_func;
 	vgpu_error_func_t error_func;
+	vgpu_error_check_mode_t error_check_mode;
 
 	struct vgpu_platform_data_s* platform_data;
 	vgpu_glc_t glc;
@@ -256,9 +435,42 @@ struct vgpu_device_s
 	uint16_t height;
 	uint64_t frame_no;
 
+	// Signaled when the GPU is done with a frame, waited on before its slot of
+	// frame resources is used again
+	GLsync frame_fences[VGPU_MULTI_BUFFERING];
+	vgpu_frame_stats_t frame_stats;
+	// Counted during the frame, moved to frame_stats on present
+	uint64_t num_draws;
+	uint64_t num_driver_draws;
+
 	vgpu_texture_t backbuffer;
 
 	vgpu_caps_t caps;
+
+	vgpu_gl_state_t state;
+	vgpu_gl_staging_ring_t staging;
+	uint32_t next_pipeline_serial;
+	vgpu_gl_transition_t* transitions;
+
+	// Directory of the program binary cache, NULL without. Binaries are also
+	// keyed by driver_hash, so a driver update starts over.
+	char* pipeline_cache_path;
+	uint64_t driver_hash;
+
+	vgpu_gl_framebuffer_t framebuffers[VGPU_GL_MAX_FRAMEBUFFERS];
+	uint32_t num_framebuffers;
+	GLuint bound_framebuffer;
+
+	vgpu_slab_pool_t<vgpu_buffer_t> buffer_pool;
+	vgpu_slab_pool_t<vgpu_resource_table_t> resource_table_pool;
+	vgpu_slab_pool_t<vgpu_root_layout_t> root_layout_pool;
+	vgpu_slab_pool_t<vgpu_texture_t> texture_pool;
+	vgpu_slab_pool_t<vgpu_program_t> program_pool;
+	vgpu_slab_pool_t<vgpu_pipeline_t> pipeline_pool;
+	vgpu_slab_pool_t<vgpu_render_pass_t> render_pass_pool;
+	vgpu_slab_pool_t<vgpu_command_list_t> command_list_pool;
+
+	vgpu_handle_table_t<vgpu_buffer_t, vgpu_create_buffer_params_t> buffer_handles;
 };
 
 #ifdef __cplusplus
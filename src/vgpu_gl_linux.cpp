@@ -0,0 +1,164 @@
+#include <string.h>
+
+#include "vgpu_gl.h"
+
+#include <EGL/eglext.h>
+
+// Core functions are loaded through eglGetProcAddress as well, Mesa and the
+// NVIDIA driver both return them (EGL_KHR_get_all_proc_addresses)
+void vgpu_platform_load_gl_ptrs(vgpu_glc_t* glc)
+{
+#define X(load, type, name) \
+	glc->gl##name = (PFNGL##type##PROC)eglGetProcAddress("gl"#name); \
+	ASSERT(glc->gl##name, "Could not load gl function gl" #name);
+	GPU_GL_FUNCTIONS
+#undef X
+}
+
+void* vgpu_platform_load_gl_func(const char* name)
+{
+	return (void*)eglGetProcAddress(name);
+}
+
+struct vgpu_platform_data_s
+{
+	EGLDisplay display;
+	EGLSurface surface;
+	EGLContext context;
+};
+
+static bool has_extension(const char* extensions, const char* name)
+{
+	if(extensions == NULL)
+		return false;
+
+	size_t len = strlen(name);
+	for(const char* s = strstr(extensions, name); s; s = strstr(s + len, name))
+	{
+		if((s == extensions || s[-1] == ' ') && (s[len] == ' ' || s[len] == '\0'))
+			return true;
+	}
+	return false;
+}
+
+// Headless devices render into a pbuffer on the surfaceless platform when the
+// EGL implementation has it, which needs neither a display server nor a GPU.
+// Mesa runs it on llvmpipe.
+static EGLDisplay get_display(bool headless)
+{
+	const char* client_extensions = eglQueryString(EGL_NO_DISPLAY, EGL_EXTENSIONS);
+	if(headless && has_extension(client_extensions, "EGL_MESA_platform_surfaceless"))
+	{
+		PFNEGLGETPLATFORMDISPLAYEXTPROC eglGetPlatformDisplayEXT = (PFNEGLGETPLATFORMDISPLAYEXTPROC)eglGetProcAddress("eglGetPlatformDisplayEXT");
+		if(eglGetPlatformDisplayEXT)
+		{
+			EGLDisplay display = eglGetPlatformDisplayEXT(EGL_PLATFORM_SURFACELESS_MESA, EGL_DEFAULT_DISPLAY, NULL);
+			if(display != EGL_NO_DISPLAY && eglInitialize(display, NULL, NULL))
+				return display;
+		}
+	}
+
+	EGLDisplay display = eglGetDisplay(EGL_DEFAULT_DISPLAY);
+	if(display != EGL_NO_DISPLAY && eglInitialize(display, NULL, NULL))
+		return display;
+	return EGL_NO_DISPLAY;
+}
+
+void vgpu_platform_create_device(vgpu_device_t* device, const vgpu_create_device_params_t* params)
+{
+	device->platform_data = VGPU_ALLOC_TYPE(device->allocator, vgpu_platform_data_s);
+	vgpu_platform_data_s* data = device->platform_data;
+	data->display = EGL_NO_DISPLAY;
+	data->surface = EGL_NO_SURFACE;
+	data->context = EGL_NO_CONTEXT;
+
+	bool headless = params->window == NULL;
+
+	data->display = get_display(headless);
+	VGPU_ASSERT(device, data->display != EGL_NO_DISPLAY, "Could not initialize EGL");
+	if(data->display == EGL_NO_DISPLAY)
+		return;
+
+	eglBindAPI(EGL_OPENGL_API);
+
+	const EGLint config_attributes[] = {
+		EGL_SURFACE_TYPE, headless ? EGL_PBUFFER_BIT : EGL_WINDOW_BIT,
+		EGL_RENDERABLE_TYPE, EGL_OPENGL_BIT,
+		EGL_RED_SIZE, 8,
+		EGL_GREEN_SIZE, 8,
+		EGL_BLUE_SIZE, 8,
+		EGL_ALPHA_SIZE, 8,
+		EGL_DEPTH_SIZE, 24,
+		EGL_STENCIL_SIZE, 8,
+		EGL_NONE
+	};
+
+	EGLConfig config;
+	EGLint num_configs = 0;
+	eglChooseConfig(data->display, config_attributes, &config, 1, &num_configs);
+	VGPU_ASSERT(device, num_configs > 0, "No EGL config with OpenGL and %s support", headless ? "pbuffer" : "window");
+	if(num_configs == 0)
+		return;
+
+	// A no error context skips validation in the driver, and can't be a debug context
+	bool no_error = device->error_check_mode == VGPU_ERROR_CHECK_NONE && has_extension(eglQueryString(data->display, EGL_EXTENSIONS), "EGL_KHR_create_context_no_error");
+	EGLint context_attributes[] = {
+		EGL_CONTEXT_MAJOR_VERSION, 4,
+		EGL_CONTEXT_MINOR_VERSION, 5,
+		EGL_CONTEXT_OPENGL_PROFILE_MASK, EGL_CONTEXT_OPENGL_CORE_PROFILE_BIT,
+		EGL_CONTEXT_OPENGL_FORWARD_COMPATIBLE, EGL_TRUE,
+		EGL_CONTEXT_OPENGL_DEBUG, EGL_TRUE,
+		EGL_NONE
+	};
+	if(no_error)
+		context_attributes[8] = EGL_CONTEXT_OPENGL_NO_ERROR_KHR;
+	else if(device->error_check_mode == VGPU_ERROR_CHECK_NONE)
+		context_attributes[9] = EGL_FALSE;
+
+	data->context = eglCreateContext(data->display, config, EGL_NO_CONTEXT, context_attributes);
+	VGPU_ASSERT(device, data->context != EGL_NO_CONTEXT, "Could not create an OpenGL 4.5 core context");
+	if(data->context == EGL_NO_CONTEXT)
+		return;
+
+	if(headless)
+	{
+		// The pbuffer is the back buffer, same size as a window would have been
+		const EGLint pbuffer_attributes[] = {
+			EGL_WIDTH, device->width,
+			EGL_HEIGHT, device->height,
+			EGL_NONE
+		};
+		data->surface = eglCreatePbufferSurface(data->display, config, pbuffer_attributes);
+	}
+	else
+	{
+		data->surface = eglCreateWindowSurface(data->display, config, (EGLNativeWindowType)params->window, NULL);
+	}
+	VGPU_ASSERT(device, data->surface != EGL_NO_SURFACE, "Could not create the EGL surface");
+
+	eglMakeCurrent(data->display, data->surface, data->surface, data->context);
+	if(!headless)
+		eglSwapInterval(data->display, 0);
+}
+
+void vgpu_platform_destroy_device(vgpu_device_t* device)
+{
+	vgpu_platform_data_s* data = device->platform_data;
+	if(data->display != EGL_NO_DISPLAY)
+	{
+		eglMakeCurrent(data->display, EGL_NO_SURFACE, EGL_NO_SURFACE, EGL_NO_CONTEXT);
+		if(data->surface != EGL_NO_SURFACE)
+			eglDestroySurface(data->display, data->surface);
+		if(data->context != EGL_NO_CONTEXT)
+			eglDestroyContext(data->display, data->context);
+		eglTerminate(data->display);
+	}
+
+	VGPU_FREE(device->allocator, device->platform_data);
+	device->platform_data = NULL;
+}
+
+void vgpu_platform_swap(vgpu_device_t* device)
+{
+	eglSwapBuffers(device->platform_data->display, device->platform_data->surface);
+}
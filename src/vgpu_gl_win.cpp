@@ -1,5 +1,9 @@
 #include "vgpu_gl.h"
 
+#ifndef WGL_CONTEXT_OPENGL_NO_ERROR_ARB
+#define WGL_CONTEXT_OPENGL_NO_ERROR_ARB 0x31B3
+#endif
+
 void vgpu_platform_load_gl_ptrs(vgpu_glc_t* glc)
 {
 #define IF_0(t, f) f
@@ -32,11 +36,14 @@ void vgpu_platform_create_device(vgpu_device_t* device, const vgpu_create_device
 	device->platform_data = VGPU_ALLOC_TYPE(device->allocator, vgpu_platform_data_s);
 	device->platform_data->hwnd = (HWND)params->window;
 
+	// A no error context skips validation in the driver, and can't be a debug context
+	bool no_error = device->error_check_mode == VGPU_ERROR_CHECK_NONE;
 	const int attributes[] = {
 		WGL_CONTEXT_MAJOR_VERSION_ARB, 4,
 		WGL_CONTEXT_MINOR_VERSION_ARB, 4,
-		WGL_CONTEXT_FLAGS_ARB, WGL_CONTEXT_FORWARD_COMPATIBLE_BIT_ARB | WGL_CONTEXT_DEBUG_BIT_ARB,
+		WGL_CONTEXT_FLAGS_ARB, WGL_CONTEXT_FORWARD_COMPATIBLE_BIT_ARB | (no_error ? 0 : WGL_CONTEXT_DEBUG_BIT_ARB),
 		WGL_CONTEXT_PROFILE_MASK_ARB, WGL_CONTEXT_CORE_PROFILE_BIT_ARB,
+		WGL_CONTEXT_OPENGL_NO_ERROR_ARB, no_error ? 1 : 0,
 		0
 	};
 
@@ -78,6 +85,18 @@ void vgpu_platform_create_device(vgpu_device_t* device, const vgpu_create_device
 	PFNWGLCREATECONTEXTATTRIBSARBPROC wglCreateContextAttribsARB = (PFNWGLCREATECONTEXTATTRIBSARBPROC)wglGetProcAddress("wglCreateContextAttribsARB");
 
 	device->platform_data->glrc = wglCreateContextAttribsARB(device->platform_data->hdc, NULL, attributes);
+	if(device->platform_data->glrc == NULL && no_error)
+	{
+		// Driver without WGL_ARB_create_context_no_error
+		const int fallback_attributes[] = {
+			WGL_CONTEXT_MAJOR_VERSION_ARB, 4,
+			WGL_CONTEXT_MINOR_VERSION_ARB, 4,
+			WGL_CONTEXT_FLAGS_ARB, WGL_CONTEXT_FORWARD_COMPATIBLE_BIT_ARB,
+			WGL_CONTEXT_PROFILE_MASK_ARB, WGL_CONTEXT_CORE_PROFILE_BIT_ARB,
+			0
+		};
+		device->platform_data->glrc = wglCreateContextAttribsARB(device->platform_data->hdc, NULL, fallback_attributes);
+	}
 	wglMakeCurrent(NULL, NULL);
 	wglDeleteContext(glrc_temp);
 	wglMakeCurrent(device->platform_data->hdc, device->platform_data->glrc);
@@ -0,0 +1,156 @@
+#ifndef VGPU_HANDLE_TABLE_H
+#define VGPU_HANDLE_TABLE_H
+
+#ifdef __cplusplus
+
+#include <stdint.h>
+#include <atomic>
+#include "vgpu_internal.h"
+#include "vgpu_atomic_id_pool.h"
+
+// Fixed capacity table of objects addressed by 32 bit handles. A handle is
+// the slot index in the low INDEX_BITS and the generation of the slot in the
+// rest. The generation is bumped every time a slot is freed, so a handle to
+// a destroyed object no longer matches and lookup() returns NULL instead of
+// touching whatever took the slot. Generation 0 is skipped, so the handle 0
+// is never valid.
+//
+// The objects are stored by value in one array (hot, what command recording
+// reads) and their creation parameters in another (cold, only read by
+// validation), with the generations in a third. The arrays never move, so
+// pointers to hot objects stay valid for the lifetime of the slot.
+//
+// Slots come from a vgpu_atomic_id_pool_t, alloc() and free() can be called
+// from any thread. The generation bump in free() is a release and
+// is_valid()/lookup() acquire it, so a thread that sees a handle go stale also
+// sees everything done to the object before it was freed.
+template<class HOT, class COLD>
+struct vgpu_handle_table_t
+{
+	enum
+	{
+		INDEX_BITS = 20,
+		GENERATION_BITS = 32 - INDEX_BITS,
+		MAX_CAPACITY = 1 << INDEX_BITS,
+	};
+
+	static const uint32_t INDEX_MASK = (1u << INDEX_BITS) - 1;
+	static const uint32_t GENERATION_MASK = (1u << GENERATION_BITS) - 1;
+	static const uint32_t INVALID_HANDLE = 0;
+
+	vgpu_allocator_t* _alloc;
+	vgpu_atomic_id_pool_t<uint32_t> _ids;
+	std::atomic<uint16_t>* _generations;
+	HOT* _hot;
+	COLD* _cold;
+	uint32_t _capacity;
+
+	vgpu_handle_table_t() : _alloc(NULL), _ids(), _generations(NULL), _hot(NULL), _cold(NULL), _capacity(0) { }
+
+	~vgpu_handle_table_t()
+	{
+		if(_alloc)
+			destroy();
+	}
+
+	void create(vgpu_allocator_t* alloc, uint32_t capacity)
+	{
+		VGPU_HARD_ASSERT(capacity <= MAX_CAPACITY, "handle table too large");
+
+		_alloc = NULL;
+		_generations = NULL;
+		_hot = NULL;
+		_cold = NULL;
+		_capacity = capacity;
+		if(capacity == 0)
+			return;
+
+		_alloc = alloc;
+		_ids.create(alloc, capacity);
+		_generations = VGPU_ALLOC_ARRAY(alloc, capacity, std::atomic<uint16_t>);
+		_hot = VGPU_ALLOC_ARRAY_T(alloc, capacity, HOT);
+		_cold = VGPU_ALLOC_ARRAY_T(alloc, capacity, COLD);
+
+		for(uint32_t i = 0; i < capacity; ++i)
+			_generations[i].store(1, std::memory_order_relaxed);
+	}
+
+	void destroy()
+	{
+		if(_alloc)
+		{
+			_ids.destroy();
+			VGPU_FREE(_alloc, _generations);
+			VGPU_FREE(_alloc, _hot);
+			VGPU_FREE(_alloc, _cold);
+		}
+
+		_alloc = NULL;
+		_generations = NULL;
+		_hot = NULL;
+		_cold = NULL;
+		_capacity = 0;
+	}
+
+	uint32_t capacity() const
+	{
+		return _capacity;
+	}
+
+	size_t num_used() const
+	{
+		return _capacity ? _ids.num_used() : 0;
+	}
+
+	// INVALID_HANDLE when the table is full
+	uint32_t alloc()
+	{
+		if(_capacity == 0)
+			return INVALID_HANDLE;
+
+		// Ordered after the free() that released the slot by the id pool
+		uint32_t index = _ids.try_alloc_index();
+		if(index == _ids.INVALID_INDEX)
+			return INVALID_HANDLE;
+		return make_handle(index, _generations[index].load(std::memory_order_relaxed));
+	}
+
+	void free(uint32_t handle)
+	{
+		uint32_t index = handle & INDEX_MASK;
+		uint16_t generation = (uint16_t)((_generations[index].load(std::memory_order_relaxed) + 1) & GENERATION_MASK);
+		_generations[index].store(generation ? generation : 1, std::memory_order_release);
+		_ids.free_handle(index);
+	}
+
+	bool is_valid(uint32_t handle) const
+	{
+		uint32_t index = handle & INDEX_MASK;
+		return index < _capacity && _generations[index].load(std::memory_order_acquire) == (handle >> INDEX_BITS);
+	}
+
+	HOT* lookup(uint32_t handle) const
+	{
+		return is_valid(handle) ? &_hot[handle & INDEX_MASK] : NULL;
+	}
+
+	// No validation, only for handles known to be valid
+	HOT* hot(uint32_t handle) const
+	{
+		return &_hot[handle & INDEX_MASK];
+	}
+
+	COLD* cold(uint32_t handle) const
+	{
+		return &_cold[handle & INDEX_MASK];
+	}
+
+	static uint32_t make_handle(uint32_t index, uint32_t generation)
+	{
+		return (generation << INDEX_BITS) | index;
+	}
+};
+
+#endif
+
+#endif // VGPU_HANDLE_TABLE_H
@@ -23,7 +23,8 @@ struct vgpu_id_pool_t
 
 	~vgpu_id_pool_t()
 	{
-		VGPU_ALLOCATOR_FREE(_alloc, _handles);
+		if(_alloc)
+			VGPU_FREE(_alloc, _handles);
 	}
 
 	void create(vgpu_allocator_t* alloc, size_t capacity)
@@ -31,7 +32,7 @@ struct vgpu_id_pool_t
 		_alloc= alloc;
 		_capacity = capacity;
 		_num_free = capacity;
-		_handles = (TH*)VGPU_ALLOC_ARRAY(alloc, capacity, TH);
+		_handles = (TH*)VGPU_ALLOC_ARRAY_T(alloc, capacity, TH);
 
 		for(size_t i = 0; i < capacity; ++i)
 			_handles[i] = static_cast<TH>(capacity - i - 1);
@@ -8,27 +8,74 @@
 #elif defined(MACOSX) || defined(__APPLE__) || defined(__DARWIN__)
 #	define VGPU_MACOSX
 #	define VGPU_UNIX
+#elif defined(__linux__)
+#	define VGPU_LINUX
+#	define VGPU_UNIX
 #else
 #	error not implemented for this platform
 #endif
 
-void* vgpu_alloc_wrapper(vgpu_allocator_t* allocator, size_t count, size_t size, size_t align, const char* file, int line);
-void* vgpu_realloc_wrapper(vgpu_allocator_t* allocator, void* memory, size_t count, size_t size, size_t align, const char* file, int line);
+// The type name of the allocation in flight, NULL for untyped allocations.
+// Allocators that want it, like the tracking allocator, read it in alloc and
+// realloc, which keeps vgpu_allocator_t unchanged.
+extern thread_local const char* vgpu_alloc_type_name;
+
+void* vgpu_alloc_wrapper(vgpu_allocator_t* allocator, size_t count, size_t size, size_t align, const char* type_name, const char* file, int line);
+void* vgpu_realloc_wrapper(vgpu_allocator_t* allocator, void* memory, size_t count, size_t size, size_t align, const char* type_name, const char* file, int line);
 void vgpu_free_wrapper(vgpu_allocator_t* allocator, void* memory, const char* file, int line);
 
-#define VGPU_ALLOC(allocator, size, align) vgpu_alloc_wrapper(allocator, 1, size, align, __FILE__, __LINE__)
-#define VGPU_ALLOC_TYPE(allocator, type) (type*)vgpu_alloc_wrapper(allocator, 1, sizeof(type), alignof(type), __FILE__, __LINE__)
-#define VGPU_ALLOC_ARRAY(allocator, count, type) (type*)vgpu_alloc_wrapper(allocator, count, sizeof(type), alignof(type), __FILE__, __LINE__)
-#define VGPU_REALLOC(allocator, memory, size, align) vgpu_realloc_wrapper(allocator, memory, 1, size, align, __FILE__, __LINE__)
-#define VGPU_REALLOC_ARRAY(allocator, memory, count, type) (type*)vgpu_realloc_wrapper(allocator, memory, count, sizeof(type), alignof(type), __FILE__, __LINE__)
+uint64_t vgpu_time_us();
+
+// 64 bit FNV-1a, chain calls by passing the previous hash as seed
+#define VGPU_HASH_SEED 0xcbf29ce484222325ull
+uint64_t vgpu_hash(const void* data, size_t size, uint64_t seed);
+
+// Whole file in memory freed with VGPU_FREE, NULL if it can't be read
+void* vgpu_read_file(vgpu_allocator_t* allocator, const char* path, size_t* out_size);
+// Writes a temporary file next to path and renames it over path, so readers
+// never see a partial file
+bool vgpu_write_file(const char* path, const void* data, size_t size);
+
+// Name of T for allocations made inside of templates, where #type would only
+// give the name of the template parameter. Parsed once per type out of the
+// compiler's function signature.
+struct vgpu_type_name_t
+{
+	char name[128];
+	explicit vgpu_type_name_t(const char* signature);
+};
+
+template<class T>
+const char* vgpu_type_name()
+{
+#if defined(_MSC_VER)
+	static const vgpu_type_name_t type_name(__FUNCSIG__);
+#else
+	static const vgpu_type_name_t type_name(__PRETTY_FUNCTION__);
+#endif
+	return type_name.name;
+}
+
+#define VGPU_ALLOC(allocator, size, align) vgpu_alloc_wrapper(allocator, 1, size, align, NULL, __FILE__, __LINE__)
+#define VGPU_ALLOC_TYPE(allocator, type) (type*)vgpu_alloc_wrapper(allocator, 1, sizeof(type), alignof(type), #type, __FILE__, __LINE__)
+#define VGPU_ALLOC_ARRAY(allocator, count, type) (type*)vgpu_alloc_wrapper(allocator, count, sizeof(type), alignof(type), #type, __FILE__, __LINE__)
+#define VGPU_REALLOC(allocator, memory, size, align) vgpu_realloc_wrapper(allocator, memory, 1, size, align, NULL, __FILE__, __LINE__)
+#define VGPU_REALLOC_ARRAY(allocator, memory, count, type) (type*)vgpu_realloc_wrapper(allocator, memory, count, sizeof(type), alignof(type), #type, __FILE__, __LINE__)
 #define VGPU_FREE(allocator, memory) vgpu_free_wrapper(allocator, memory, __FILE__, __LINE__)
 
+// Same as the above for a template parameter type
+#define VGPU_ALLOC_ARRAY_T(allocator, count, type) (type*)vgpu_alloc_wrapper(allocator, count, sizeof(type), alignof(type), vgpu_type_name<type>(), __FILE__, __LINE__)
+#define VGPU_REALLOC_ARRAY_T(allocator, memory, count, type) (type*)vgpu_realloc_wrapper(allocator, memory, count, sizeof(type), alignof(type), vgpu_type_name<type>(), __FILE__, __LINE__)
+
 #include <new>
-#define VGPU_NEW(allocator, type, ...) (new (vgpu_alloc_wrapper(allocator, 1, sizeof(type), alignof(type), __FILE__, __LINE__)) type(__VA_ARGS__))
+#define VGPU_NEW(allocator, type, ...) (new (vgpu_alloc_wrapper(allocator, 1, sizeof(type), alignof(type), #type, __FILE__, __LINE__)) type(__VA_ARGS__))
 #define VGPU_DELETE(allocator, type, ptr) do{ if(ptr){ (ptr)->~type(); vgpu_free_wrapper(allocator, ptr, __FILE__, __LINE__); } }while(0)
 
-// TODO
-#define VGPU_BREAKPOINT() __debugbreak()
+#if defined(VGPU_WINDOWS)
+#	define VGPU_BREAKPOINT() __debugbreak()
+#else
+#	define VGPU_BREAKPOINT() __builtin_trap()
+#endif
 
 #define VGPU_ASSERT(device, cond, ...) ( (void)( ( !(cond) ) && ( device->error_func( __FILE__, __LINE__, #cond, __VA_ARGS__ ) == 1 ) && ( VGPU_BREAKPOINT(), 1 ) ) )
 #define VGPU_HARD_ASSERT(cond, ...) ( (void)( ( !(cond) ) && ( VGPU_BREAKPOINT(), 1 ) ) )
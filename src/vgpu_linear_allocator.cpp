@@ -0,0 +1,118 @@
+#include <string.h>
+
+#include "vgpu_linear_allocator.h"
+
+static const size_t CHUNK_HEADER_SIZE = VGPU_ALIGN_UP(sizeof(vgpu_linear_allocator_t::chunk_t), 16);
+
+static void push_chunk(vgpu_linear_allocator_t* allocator, size_t size)
+{
+	vgpu_linear_allocator_t::chunk_t* chunk = (vgpu_linear_allocator_t::chunk_t*)VGPU_ALLOC(allocator->parent, size, 16);
+	chunk->next = allocator->chunks;
+	chunk->size = size;
+	allocator->chunks = chunk;
+
+	allocator->ptr = (uint8_t*)chunk + CHUNK_HEADER_SIZE;
+	allocator->end = (uint8_t*)chunk + size;
+	allocator->last = NULL;
+}
+
+static void* linear_alloc(vgpu_allocator_t* base, size_t count, size_t size, size_t align, const char* file, int line)
+{
+	vgpu_linear_allocator_t* allocator = (vgpu_linear_allocator_t*)base;
+	size_t num_bytes = count * size;
+	if(align < sizeof(size_t))
+		align = sizeof(size_t);
+
+	// Every allocation is preceded by its size so realloc knows how much to copy
+	uint8_t* ptr = (uint8_t*)VGPU_ALIGN_UP((uintptr_t)allocator->ptr + sizeof(size_t), align);
+	if(ptr + num_bytes > allocator->end)
+	{
+		size_t needed = CHUNK_HEADER_SIZE + sizeof(size_t) + align + num_bytes;
+		push_chunk(allocator, needed > allocator->chunk_size ? needed : allocator->chunk_size);
+		ptr = (uint8_t*)VGPU_ALIGN_UP((uintptr_t)allocator->ptr + sizeof(size_t), align);
+	}
+
+	((size_t*)ptr)[-1] = num_bytes;
+	allocator->ptr = ptr + num_bytes;
+	allocator->last = ptr;
+	return ptr;
+}
+
+static void* linear_realloc(vgpu_allocator_t* base, void* memory, size_t count, size_t size, size_t align, const char* file, int line)
+{
+	vgpu_linear_allocator_t* allocator = (vgpu_linear_allocator_t*)base;
+	if(memory == NULL)
+		return linear_alloc(base, count, size, align, file, line);
+
+	size_t num_bytes = count * size;
+	uint8_t* ptr = (uint8_t*)memory;
+	if(ptr == allocator->last && ptr + num_bytes <= allocator->end)
+	{
+		((size_t*)ptr)[-1] = num_bytes;
+		allocator->ptr = ptr + num_bytes;
+		return memory;
+	}
+
+	size_t old_num_bytes = ((size_t*)ptr)[-1];
+	void* new_memory = linear_alloc(base, count, size, align, file, line);
+	memcpy(new_memory, memory, old_num_bytes < num_bytes ? old_num_bytes : num_bytes);
+	return new_memory;
+}
+
+static void linear_free(vgpu_allocator_t* base, void* memory, const char* file, int line)
+{
+	// Everything is released at once by vgpu_linear_allocator_reset
+}
+
+void vgpu_linear_allocator_create(vgpu_linear_allocator_t* allocator, vgpu_allocator_t* parent, size_t chunk_size)
+{
+	allocator->base.alloc = linear_alloc;
+	allocator->base.realloc = linear_realloc;
+	allocator->base.free = linear_free;
+
+	allocator->parent = parent;
+	allocator->chunk_size = chunk_size;
+	allocator->chunks = NULL;
+
+	push_chunk(allocator, chunk_size);
+}
+
+void vgpu_linear_allocator_destroy(vgpu_linear_allocator_t* allocator)
+{
+	vgpu_linear_allocator_t::chunk_t* chunk = allocator->chunks;
+	while(chunk)
+	{
+		vgpu_linear_allocator_t::chunk_t* next = chunk->next;
+		VGPU_FREE(allocator->parent, chunk);
+		chunk = next;
+	}
+
+	allocator->chunks = NULL;
+	allocator->ptr = NULL;
+	allocator->end = NULL;
+	allocator->last = NULL;
+}
+
+void vgpu_linear_allocator_reset(vgpu_linear_allocator_t* allocator)
+{
+	vgpu_linear_allocator_t::chunk_t* chunk = allocator->chunks;
+	if(chunk->next)
+	{
+		// Last frame did not fit in one chunk, replace them all with one that does
+		size_t total_size = 0;
+		while(chunk)
+		{
+			vgpu_linear_allocator_t::chunk_t* next = chunk->next;
+			total_size += chunk->size;
+			VGPU_FREE(allocator->parent, chunk);
+			chunk = next;
+		}
+
+		allocator->chunks = NULL;
+		push_chunk(allocator, total_size);
+		return;
+	}
+
+	allocator->ptr = (uint8_t*)chunk + CHUNK_HEADER_SIZE;
+	allocator->last = NULL;
+}
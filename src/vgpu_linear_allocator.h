@@ -0,0 +1,44 @@
+#ifndef VGPU_LINEAR_ALLOCATOR_H
+#define VGPU_LINEAR_ALLOCATOR_H
+
+#include <stdint.h>
+#include "vgpu_internal.h"
+
+#define VGPU_FRAME_ALLOCATOR_CHUNK_SIZE (64 * 1024)
+
+// Bump allocator for memory that only lives until the next reset, usually one
+// frame. Allocating is a pointer increment, free is a no-op and realloc only
+// copies when the block is not the last one allocated.
+//
+// Memory comes from the parent allocator in chunks. When a frame needed more
+// than one chunk, reset replaces them with a single chunk large enough for the
+// whole frame, so after a few frames nothing hits the parent anymore.
+//
+// The struct starts with a vgpu_allocator_t so it can be passed anywhere one
+// is expected.
+struct vgpu_linear_allocator_t
+{
+	struct chunk_t
+	{
+		chunk_t* next;
+		size_t size;
+	};
+
+	vgpu_allocator_t base;
+
+	vgpu_allocator_t* parent;
+	size_t chunk_size;
+
+	chunk_t* chunks; // most recent first
+	uint8_t* ptr;
+	uint8_t* end;
+	uint8_t* last; // last allocation, can be grown in place
+};
+
+void vgpu_linear_allocator_create(vgpu_linear_allocator_t* allocator, vgpu_allocator_t* parent, size_t chunk_size);
+
+void vgpu_linear_allocator_destroy(vgpu_linear_allocator_t* allocator);
+
+void vgpu_linear_allocator_reset(vgpu_linear_allocator_t* allocator);
+
+#endif // VGPU_LINEAR_ALLOCATOR_H
@@ -3,6 +3,9 @@
 
 #include <vgpu.h>
 #include "vgpu_internal.h"
+#include "vgpu_linear_allocator.h"
+#include "vgpu_handle_table.h"
+#include "vgpu_slab_pool.h"
 
 /******************************************************************************\
  *
@@ -41,10 +44,13 @@ struct vgpu_render_pass_s
 struct vgpu_command_list_s
 {
 	vgpu_device_t* device;
+	vgpu_thread_context_t* thread_context;
 };
 
 struct vgpu_thread_context_s
 {
+	vgpu_linear_allocator_t frame_allocator[VGPU_MULTI_BUFFERING];
+	uint32_t frame_id;
 };
 
 struct vgpu_device_s
@@ -56,6 +62,17 @@ struct vgpu_device_s
 
 	uint64_t frame_no;
 	vgpu_caps_t caps;
+
+	vgpu_slab_pool_t<vgpu_buffer_t> buffer_pool;
+	vgpu_slab_pool_t<vgpu_resource_table_t> resource_table_pool;
+	vgpu_slab_pool_t<vgpu_root_layout_t> root_layout_pool;
+	vgpu_slab_pool_t<vgpu_texture_t> texture_pool;
+	vgpu_slab_pool_t<vgpu_program_t> program_pool;
+	vgpu_slab_pool_t<vgpu_pipeline_t> pipeline_pool;
+	vgpu_slab_pool_t<vgpu_render_pass_t> render_pass_pool;
+	vgpu_slab_pool_t<vgpu_command_list_t> command_list_pool;
+
+	vgpu_handle_table_t<vgpu_buffer_t, vgpu_create_buffer_params_t> buffer_handles;
 };
 
 /******************************************************************************\
@@ -77,13 +94,37 @@ vgpu_device_t* vgpu_create_device(const vgpu_create_device_params_t* params)
 
 	device->frame_no = 0;
 	memset(&device->caps, 0, sizeof(device->caps));
-	device->caps.flags = (~params->force_disable_flags) & (VGPU_CAPS_FLAG_BIND_CONSTANT_BUFFER_AT_OFFSET | VGPU_CAPS_FLAG_BIND_BUFFER_AT_OFFSET);
+	device->caps.flags = (~params->force_disable_flags) & (VGPU_CAPS_FLAG_BIND_CONSTANT_BUFFER_AT_OFFSET | VGPU_CAPS_FLAG_BIND_BUFFER_AT_OFFSET |
+		VGPU_CAPS_FLAG_DRAW_INDIRECT_COUNT);
+	device->caps.error_check_mode = params->error_check_mode;
+
+	device->buffer_pool.create(allocator, VGPU_OBJECTS_PER_SLAB);
+	device->resource_table_pool.create(allocator, VGPU_OBJECTS_PER_SLAB);
+	device->root_layout_pool.create(allocator, VGPU_OBJECTS_PER_SLAB);
+	device->texture_pool.create(allocator, VGPU_OBJECTS_PER_SLAB);
+	device->program_pool.create(allocator, VGPU_OBJECTS_PER_SLAB);
+	device->pipeline_pool.create(allocator, VGPU_OBJECTS_PER_SLAB);
+	device->render_pass_pool.create(allocator, VGPU_OBJECTS_PER_SLAB);
+	device->command_list_pool.create(allocator, VGPU_OBJECTS_PER_SLAB);
+
+	device->buffer_handles.create(allocator, params->max_buffer_handles);
 
 	return device;
 }
 
 void vgpu_destroy_device(vgpu_device_t* device)
 {
+	device->buffer_pool.destroy();
+	device->resource_table_pool.destroy();
+	device->root_layout_pool.destroy();
+	device->texture_pool.destroy();
+	device->program_pool.destroy();
+	device->pipeline_pool.destroy();
+	device->render_pass_pool.destroy();
+	device->command_list_pool.destroy();
+
+	device->buffer_handles.destroy();
+
 	VGPU_FREE(device->allocator, device);
 }
 
@@ -126,6 +167,24 @@ void vgpu_get_caps(vgpu_device_t* device, vgpu_caps_t* out_caps)
 	memcpy(out_caps, &device->caps, sizeof(vgpu_caps_t));
 }
 
+void vgpu_get_frame_stats(vgpu_device_t* device, vgpu_frame_stats_t* out_stats)
+{
+	// Presenting never waits on a fence
+	memset(out_stats, 0, sizeof(vgpu_frame_stats_t));
+}
+
+bool vgpu_save_pipeline_cache(vgpu_device_t* device)
+{
+	// Pipelines are never compiled
+	return false;
+}
+
+void vgpu_get_memory_stats(vgpu_device_t* device, vgpu_memory_stats_t* out_stats)
+{
+	// Nothing is backed by device memory
+	memset(out_stats, 0, sizeof(vgpu_memory_stats_t));
+}
+
 /******************************************************************************\
 *
 *  Thread context handling
@@ -135,16 +194,28 @@ void vgpu_get_caps(vgpu_device_t* device, vgpu_caps_t* out_caps)
 vgpu_thread_context_t* vgpu_create_thread_context(vgpu_device_t* device, const vgpu_create_thread_context_params_t* params)
 {
 	vgpu_thread_context_t* thread_context = VGPU_ALLOC_TYPE(device->allocator, vgpu_thread_context_t);
+	for(int i = 0; i < VGPU_MULTI_BUFFERING; ++i)
+		vgpu_linear_allocator_create(&thread_context->frame_allocator[i], device->allocator, VGPU_FRAME_ALLOCATOR_CHUNK_SIZE);
+	thread_context->frame_id = 0;
 	return thread_context;
 }
 
 void vgpu_destroy_thread_context(vgpu_device_t* device, vgpu_thread_context_t* thread_context)
 {
+	for(int i = 0; i < VGPU_MULTI_BUFFERING; ++i)
+		vgpu_linear_allocator_destroy(&thread_context->frame_allocator[i]);
 	VGPU_FREE(device->allocator, thread_context);
 }
 
 void vgpu_prepare_thread_context(vgpu_device_t* device, vgpu_thread_context_t* thread_context)
 {
+	thread_context->frame_id = device->frame_no % VGPU_MULTI_BUFFERING;
+	vgpu_linear_allocator_reset(&thread_context->frame_allocator[thread_context->frame_id]);
+}
+
+vgpu_allocator_t* vgpu_get_thread_frame_allocator(vgpu_thread_context_t* thread_context)
+{
+	return &thread_context->frame_allocator[thread_context->frame_id].base;
 }
 
 /******************************************************************************\
@@ -153,17 +224,30 @@ void vgpu_prepare_thread_context(vgpu_device_t* device, vgpu_thread_context_t* t
  *
 \******************************************************************************/
 
+static void init_buffer(vgpu_device_t* device, vgpu_buffer_t* buffer, const vgpu_create_buffer_params_t* params)
+{
+}
+
 vgpu_buffer_t* vgpu_create_buffer(vgpu_device_t* device, const vgpu_create_buffer_params_t* params)
 {
-	vgpu_buffer_t* buffer = VGPU_ALLOC_TYPE(device->allocator, vgpu_buffer_t);
+	vgpu_buffer_t* buffer = device->buffer_pool.alloc();
+	init_buffer(device, buffer, params);
 	return buffer;
 }
 
+static void release_buffer(vgpu_device_t* device, vgpu_buffer_t* buffer)
+{
+}
+
 void vgpu_destroy_buffer(vgpu_device_t* device, vgpu_buffer_t* buffer)
 {
-	VGPU_FREE(device->allocator, buffer);
+	release_buffer(device, buffer);
+	device->buffer_pool.free(buffer);
 }
 
+// Buffer handle entry points on top of init_buffer and release_buffer
+#include "vgpu_buffer_handles.h"
+
 /******************************************************************************\
  *
  *  Resource table handling
@@ -172,13 +256,18 @@ void vgpu_destroy_buffer(vgpu_device_t* device, vgpu_buffer_t* buffer)
 
 vgpu_resource_table_t* vgpu_create_resource_table(vgpu_device_t* device, const vgpu_root_layout_t* root_layout, uint32_t root_slot, const vgpu_resource_table_entry_t* entries, size_t num_entries)
 {
-	vgpu_resource_table_t* resource_table = VGPU_ALLOC_TYPE(device->allocator, vgpu_resource_table_t);
+	vgpu_resource_table_t* resource_table = device->resource_table_pool.alloc();
 	return resource_table;
 }
 
 void vgpu_destroy_resource_table(vgpu_device_t* device, vgpu_resource_table_t* resource_table)
 {
-	VGPU_FREE(device->allocator, resource_table);
+	device->resource_table_pool.free(resource_table);
+}
+
+void vgpu_compact_resource_tables(vgpu_device_t* device, uint32_t time_budget_us)
+{
+	// Nothing to compact, resource tables are not backed by a shared heap
 }
 
 /******************************************************************************\
@@ -189,13 +278,13 @@ void vgpu_destroy_resource_table(vgpu_device_t* device, vgpu_resource_table_t* r
 
 vgpu_root_layout_t* vgpu_create_root_layout(vgpu_device_t* device, const vgpu_root_layout_slot_t* slots, size_t num_slots)
 {
-	vgpu_root_layout_t* root_layout = VGPU_ALLOC_TYPE(device->allocator, vgpu_root_layout_t);
+	vgpu_root_layout_t* root_layout = device->root_layout_pool.alloc();
 	return root_layout;
 }
 
 void vgpu_destroy_root_layout(vgpu_device_t* device, vgpu_root_layout_t* root_layout)
 {
-	VGPU_FREE(device->allocator, root_layout);
+	device->root_layout_pool.free(root_layout);
 }
 
 /******************************************************************************\
@@ -206,13 +295,13 @@ void vgpu_destroy_root_layout(vgpu_device_t* device, vgpu_root_layout_t* root_la
 
 vgpu_texture_t* vgpu_create_texture(vgpu_device_t* device, const vgpu_create_texture_params_t* params)
 {
-	vgpu_texture_t* texture = VGPU_ALLOC_TYPE(device->allocator, vgpu_texture_t);
+	vgpu_texture_t* texture = device->texture_pool.alloc();
 	return texture;
 }
 
 void vgpu_destroy_texture(vgpu_device_t* device, vgpu_texture_t* texture)
 {
-	VGPU_FREE(device->allocator, texture);
+	device->texture_pool.free(texture);
 }
 
 /******************************************************************************\
@@ -223,13 +312,13 @@ void vgpu_destroy_texture(vgpu_device_t* device, vgpu_texture_t* texture)
 
 vgpu_program_t* vgpu_create_program(vgpu_device_t* device, const vgpu_create_program_params_t* params)
 {
-	vgpu_program_t* program = VGPU_ALLOC_TYPE(device->allocator, vgpu_program_t);
+	vgpu_program_t* program = device->program_pool.alloc();
 	return program;
 }
 
 void vgpu_destroy_program(vgpu_device_t* device, vgpu_program_t* program)
 {
-	VGPU_FREE(device->allocator, program);
+	device->program_pool.free(program);
 }
 
 /******************************************************************************\
@@ -240,13 +329,18 @@ void vgpu_destroy_program(vgpu_device_t* device, vgpu_program_t* program)
 
 vgpu_pipeline_t* vgpu_create_pipeline(vgpu_device_t* device, const vgpu_create_pipeline_params_t* params)
 {
-	vgpu_pipeline_t* pipeline = VGPU_ALLOC_TYPE(device->allocator, vgpu_pipeline_t);
+	vgpu_pipeline_t* pipeline = device->pipeline_pool.alloc();
 	return pipeline;
 }
 
 void vgpu_destroy_pipeline(vgpu_device_t* device, vgpu_pipeline_t* pipeline)
 {
-	VGPU_FREE(device->allocator, pipeline);
+	device->pipeline_pool.free(pipeline);
+}
+
+bool vgpu_is_pipeline_ready(vgpu_device_t* device, vgpu_pipeline_t* pipeline)
+{
+	return true;
 }
 
 /******************************************************************************\
@@ -257,13 +351,13 @@ void vgpu_destroy_pipeline(vgpu_device_t* device, vgpu_pipeline_t* pipeline)
 
 vgpu_render_pass_t* vgpu_create_render_pass(vgpu_device_t* device, const vgpu_create_render_pass_params_t* params)
 {
-	vgpu_render_pass_t* render_pass = VGPU_ALLOC_TYPE(device->allocator, vgpu_render_pass_t);
+	vgpu_render_pass_t* render_pass = device->render_pass_pool.alloc();
 	return render_pass;
 }
 
 void vgpu_destroy_render_pass(vgpu_device_t* device, vgpu_render_pass_t* render_pass)
 {
-	VGPU_FREE(device->allocator, render_pass);
+	device->render_pass_pool.free(render_pass);
 }
 
 /******************************************************************************\
@@ -274,14 +368,15 @@ void vgpu_destroy_render_pass(vgpu_device_t* device, vgpu_render_pass_t* render_
 
 vgpu_command_list_t* vgpu_create_command_list(vgpu_device_t* device, const vgpu_create_command_list_params_t* params)
 {
-	vgpu_command_list_t* command_list = VGPU_ALLOC_TYPE(device->allocator, vgpu_command_list_t);
+	vgpu_command_list_t* command_list = device->command_list_pool.alloc();
 	command_list->device = device;
+	command_list->thread_context = NULL;
 	return command_list;
 }
 
 void vgpu_destroy_command_list(vgpu_device_t* device, vgpu_command_list_t* command_list)
 {
-	VGPU_FREE(device->allocator, command_list);
+	device->command_list_pool.free(command_list);
 }
 
 bool vgpu_is_command_list_type_supported(vgpu_device_t* device, vgpu_command_list_type_t command_list_type)
@@ -297,6 +392,7 @@ bool vgpu_is_command_list_type_supported(vgpu_device_t* device, vgpu_command_lis
 
 void vgpu_begin_command_list(vgpu_thread_context_t* thread_context, vgpu_command_list_t* command_list, vgpu_render_pass_t* render_pass)
 {
+	command_list->thread_context = thread_context;
 }
 
 void vgpu_end_command_list(vgpu_command_list_t* command_list)
@@ -305,13 +401,14 @@ void vgpu_end_command_list(vgpu_command_list_t* command_list)
 
 void* vgpu_lock_buffer(vgpu_command_list_t* command_list, vgpu_lock_buffer_params_t* params)
 {
-	params->unlock_data[0] = (uintptr_t)VGPU_ALLOC(command_list->device->allocator, params->num_bytes, 16);
+	vgpu_allocator_t* allocator = vgpu_get_thread_frame_allocator(command_list->thread_context);
+	params->unlock_data[0] = (uintptr_t)VGPU_ALLOC(allocator, params->num_bytes, 16);
 	return (void*)params->unlock_data[0];
 }
 
 void vgpu_unlock_buffer(vgpu_command_list_t* command_list, const vgpu_lock_buffer_params_t* params)
 {
-	VGPU_FREE(command_list->device->allocator, (void*)params->unlock_data[0]);
+	// Released with the frame allocator
 }
 
 void vgpu_set_buffer_data(vgpu_command_list_t* command_list, vgpu_buffer_t* buffer, size_t offset, const void* data, size_t num_bytes)
@@ -350,6 +447,14 @@ void vgpu_draw_indexed_indirect(vgpu_command_list_t* command_list, vgpu_buffer_t
 {
 }
 
+void vgpu_draw_indirect_count(vgpu_command_list_t* command_list, vgpu_buffer_t* buffer, uint64_t offset, vgpu_buffer_t* count_buffer, uint64_t count_offset, uint32_t max_count)
+{
+}
+
+void vgpu_draw_indexed_indirect_count(vgpu_command_list_t* command_list, vgpu_buffer_t* buffer, uint64_t offset, vgpu_buffer_t* count_buffer, uint64_t count_offset, uint32_t max_count)
+{
+}
+
 void vgpu_clear_render_pass(vgpu_command_list_t* command_list, vgpu_render_pass_t* render_pass)
 {
 }
@@ -35,7 +35,7 @@ struct vgpu_range_pool_t
 			num_ids,
 		};
 
-		_ranges.append(range);
+		_ranges.push_back(range);
 	}
 
 	T alloc(const T count)
@@ -76,6 +76,7 @@ struct vgpu_range_pool_t
 				// Insert a new slot in the range list
 				range_t new_range = { begin, end };
 				_ranges.insert_at(i, new_range);
+				return;
 			}
 			else if(end == range.begin)
 			{
@@ -100,6 +101,10 @@ struct vgpu_range_pool_t
 				return;
 			}
 		}
+
+		// The whole range is above all free ranges
+		range_t new_range = { begin, end };
+		_ranges.push_back(new_range);
 	}
 };
 
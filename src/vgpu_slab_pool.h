@@ -0,0 +1,164 @@
+#ifndef VGPU_SLAB_POOL_H
+#define VGPU_SLAB_POOL_H
+
+#ifdef __cplusplus
+
+#include <stdint.h>
+#include <atomic>
+#include "vgpu_internal.h"
+
+#define VGPU_CACHE_LINE_SIZE 64
+#define VGPU_OBJECTS_PER_SLAB 64
+
+// Fixed size object pool for device objects. Slots are rounded up to a cache
+// line so no two objects share one, and are carved out of slabs of
+// slots_per_slab slots taken from the parent allocator. Freed slots go on an
+// intrusive free list and are handed out again before the pool grows, so
+// objects of one type stay packed together and create/destroy never touch
+// the parent allocator once the pool is warm.
+//
+// Slabs are only returned to the parent allocator in destroy(). alloc() does
+// not construct the object, same as VGPU_ALLOC_TYPE.
+//
+// alloc() and free() are guarded by a spinlock so objects can be created
+// from any thread.
+template<class T>
+struct vgpu_slab_pool_t
+{
+	static const size_t SLOT_SIZE = VGPU_ALIGN_UP(sizeof(T), VGPU_CACHE_LINE_SIZE);
+
+	struct slab_t
+	{
+		slab_t* next;
+	};
+
+	struct free_slot_t
+	{
+		free_slot_t* next;
+	};
+
+	vgpu_allocator_t* _alloc;
+	size_t _slots_per_slab;
+	slab_t* _slabs;
+	free_slot_t* _free;
+	size_t _num_slots;
+	size_t _num_used;
+	std::atomic_flag _lock;
+
+	vgpu_slab_pool_t() : _alloc(NULL), _slots_per_slab(0), _slabs(NULL), _free(NULL), _num_slots(0), _num_used(0) { _lock.clear(); }
+
+	vgpu_slab_pool_t(vgpu_allocator_t* alloc, size_t slots_per_slab) : _alloc(NULL), _slots_per_slab(0), _slabs(NULL), _free(NULL), _num_slots(0), _num_used(0)
+	{
+		create(alloc, slots_per_slab);
+	}
+
+	~vgpu_slab_pool_t()
+	{
+		if(_alloc)
+			destroy();
+	}
+
+	void create(vgpu_allocator_t* alloc, size_t slots_per_slab)
+	{
+		VGPU_HARD_ASSERT(slots_per_slab > 0, "slab needs at least one slot");
+
+		_alloc = alloc;
+		_slots_per_slab = slots_per_slab;
+		_slabs = NULL;
+		_free = NULL;
+		_num_slots = 0;
+		_num_used = 0;
+		_lock.clear();
+	}
+
+	void destroy()
+	{
+		slab_t* slab = _slabs;
+		while(slab)
+		{
+			slab_t* next = slab->next;
+			VGPU_FREE(_alloc, slab);
+			slab = next;
+		}
+
+		_alloc = NULL;
+		_slabs = NULL;
+		_free = NULL;
+		_num_slots = 0;
+		_num_used = 0;
+	}
+
+	size_t num_slots() const
+	{
+		return _num_slots;
+	}
+
+	size_t num_used() const
+	{
+		return _num_used;
+	}
+
+	T* alloc()
+	{
+		lock();
+		if(_free == NULL)
+			grow();
+
+		free_slot_t* slot = _free;
+		_free = slot->next;
+		++_num_used;
+		unlock();
+
+		return (T*)slot;
+	}
+
+	void free(T* object)
+	{
+		if(object == NULL)
+			return;
+
+		free_slot_t* slot = (free_slot_t*)object;
+		lock();
+		slot->next = _free;
+		_free = slot;
+		--_num_used;
+		unlock();
+	}
+
+	void lock()
+	{
+		while(_lock.test_and_set(std::memory_order_acquire))
+			;
+	}
+
+	void unlock()
+	{
+		_lock.clear(std::memory_order_release);
+	}
+
+	void grow()
+	{
+		// The slab header takes the first cache line so every slot starts on one.
+		// Tracked under T so the allocation report shows objects per type.
+		size_t size = VGPU_CACHE_LINE_SIZE + _slots_per_slab * SLOT_SIZE;
+		uint8_t* memory = (uint8_t*)vgpu_alloc_wrapper(_alloc, 1, size, VGPU_CACHE_LINE_SIZE, vgpu_type_name<T>(), __FILE__, __LINE__);
+		slab_t* slab = (slab_t*)memory;
+		slab->next = _slabs;
+		_slabs = slab;
+
+		// Link back to front so the slots are handed out in address order
+		uint8_t* slots = memory + VGPU_CACHE_LINE_SIZE;
+		for(size_t i = _slots_per_slab; i-- > 0; )
+		{
+			free_slot_t* slot = (free_slot_t*)(slots + i * SLOT_SIZE);
+			slot->next = _free;
+			_free = slot;
+		}
+
+		_num_slots += _slots_per_slab;
+	}
+};
+
+#endif
+
+#endif // VGPU_SLAB_POOL_H
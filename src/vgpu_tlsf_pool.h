@@ -0,0 +1,484 @@
+#ifndef VGPU_TLSF_POOL_H
+#define VGPU_TLSF_POOL_H
+
+#ifdef __cplusplus
+
+#include <stdint.h>
+#include "vgpu_array.h"
+
+#if defined(VGPU_WINDOWS)
+#	include <intrin.h>
+#endif
+
+static inline uint32_t vgpu_tlsf_ffs(uint64_t mask)
+{
+#if defined(VGPU_WINDOWS)
+	unsigned long index;
+	_BitScanForward64(&index, mask);
+	return (uint32_t)index;
+#else
+	return (uint32_t)__builtin_ctzll(mask);
+#endif
+}
+
+static inline uint32_t vgpu_tlsf_fls(uint64_t mask)
+{
+#if defined(VGPU_WINDOWS)
+	unsigned long index;
+	_BitScanReverse64(&index, mask);
+	return (uint32_t)index;
+#else
+	return 63 - (uint32_t)__builtin_clzll(mask);
+#endif
+}
+
+// Two level segregated fit allocator for ranges of ids, with the same
+// interface as vgpu_range_pool_t. Free ranges are binned by size into
+// FL_COUNT * SL_COUNT lists with bitmaps on top, so both alloc and free are
+// O(1), and freed ranges are merged with their neighbours immediately.
+//
+// Every range, free or used, is a node linked to its physical neighbours.
+// The node of a used range is found from its offset through _node_at, which
+// costs one uint32_t per id in the pool.
+//
+// Ranges allocated with an owner can be moved towards the start of the pool
+// by compact_step(), see there.
+template<class T = uint32_t>
+struct vgpu_tlsf_pool_t
+{
+	typedef void (*relocate_func_t)(void* owner, T old_offset, T new_offset, T count, void* user_data);
+
+	enum
+	{
+		SL_LOG2 = 4,
+		SL_COUNT = 1 << SL_LOG2,
+		FL_COUNT = sizeof(T) * 8 - SL_LOG2 + 1,
+	};
+
+	static const uint32_t INVALID_NODE = 0xFFFFFFFF;
+	static const uint32_t COMPACT_SCAN = 64;
+	static const uint32_t COMPACT_STEP_NODES = 64;
+
+	struct node_t
+	{
+		T begin;
+		T count;
+		uint32_t prev_phys;
+		uint32_t next_phys;
+		uint32_t prev_free;
+		uint32_t next_free; // doubles as the link in the unused node list
+		void* owner;
+		bool is_free;
+	};
+
+	vgpu_allocator_t* _alloc;
+	vgpu_array_t<node_t> _nodes;
+	uint32_t _unused_nodes;
+	uint32_t* _node_at;
+	uint32_t _tail;
+	T _num_ids;
+	T _num_free;
+
+	uint64_t _fl_bitmap;
+	uint32_t _sl_bitmap[FL_COUNT];
+	uint32_t _free_lists[FL_COUNT][SL_COUNT];
+
+	// Start of the range the next compact_step() looks at, where the scan for
+	// a range to move resumes (_num_ids for the tail) and how many nodes were
+	// scanned for the free range at _compact_offset so far
+	T _compact_offset;
+	T _compact_scan;
+	uint32_t _compact_scanned;
+	relocate_func_t _relocate_func;
+	void* _relocate_user_data;
+
+	vgpu_tlsf_pool_t() : _alloc(NULL), _nodes(), _unused_nodes(INVALID_NODE), _node_at(NULL), _tail(INVALID_NODE), _num_ids(0), _num_free(0), _fl_bitmap(0), _compact_offset(0), _compact_scan(0), _compact_scanned(0), _relocate_func(NULL), _relocate_user_data(NULL) { }
+
+	vgpu_tlsf_pool_t(vgpu_allocator_t* alloc, T num_ids, size_t range_capacity = 0) : _alloc(NULL), _nodes(), _unused_nodes(INVALID_NODE), _node_at(NULL), _tail(INVALID_NODE), _num_ids(0), _num_free(0), _fl_bitmap(0), _compact_offset(0), _compact_scan(0), _compact_scanned(0), _relocate_func(NULL), _relocate_user_data(NULL)
+	{
+		create(alloc, num_ids, range_capacity);
+	}
+
+	~vgpu_tlsf_pool_t()
+	{
+		if(_alloc)
+			VGPU_FREE(_alloc, _node_at);
+	}
+
+	void create(vgpu_allocator_t* alloc, T num_ids, size_t range_capacity = 0)
+	{
+		VGPU_HARD_ASSERT(num_ids > 0, "pool needs at least one id");
+
+		_alloc = alloc;
+		_nodes.create(alloc, range_capacity ? range_capacity : 64);
+		_unused_nodes = INVALID_NODE;
+		_node_at = VGPU_ALLOC_ARRAY(alloc, num_ids, uint32_t);
+		_num_ids = num_ids;
+		_num_free = 0;
+		_compact_offset = 0;
+		_compact_scan = num_ids;
+		_compact_scanned = 0;
+
+		_fl_bitmap = 0;
+		for(uint32_t fl = 0; fl < FL_COUNT; ++fl)
+		{
+			_sl_bitmap[fl] = 0;
+			for(uint32_t sl = 0; sl < SL_COUNT; ++sl)
+				_free_lists[fl][sl] = INVALID_NODE;
+		}
+
+		uint32_t n = new_node(0, num_ids);
+		_nodes[n].is_free = true;
+		insert_free(n);
+		_tail = n;
+	}
+
+	T num_ids() const
+	{
+		return _num_ids;
+	}
+
+	T num_free() const
+	{
+		return _num_free;
+	}
+
+	void set_relocate_func(relocate_func_t func, void* user_data)
+	{
+		_relocate_func = func;
+		_relocate_user_data = user_data;
+	}
+
+	// Only ranges with an owner are moved by compact_step()
+	T alloc(const T count, void* owner = NULL)
+	{
+		T offset = try_alloc(count, owner);
+		if(offset == (T)-1)
+			VGPU_BREAKPOINT();
+		return offset;
+	}
+
+	// Same as alloc() but running out of space is expected, for callers that
+	// fall back to another pool
+	T try_alloc(const T count, void* owner = NULL)
+	{
+		VGPU_HARD_ASSERT(count > 0, "cannot allocate an empty range");
+
+		uint32_t n = find_free(count);
+		if(n == INVALID_NODE)
+			return (T)-1;
+
+		remove_free(n);
+
+		if(_nodes[n].count > count)
+		{
+			// Split off the tail and return it to the free lists
+			uint32_t r = new_node(_nodes[n].begin + count, _nodes[n].count - count);
+			link_phys_after(n, r);
+			_nodes[r].is_free = true;
+			insert_free(r);
+			_nodes[n].count = count;
+		}
+
+		_nodes[n].is_free = false;
+		_nodes[n].owner = owner;
+		return _nodes[n].begin;
+	}
+
+	void free(const T offset, const T count)
+	{
+		VGPU_HARD_ASSERT(offset < _num_ids, "offset outside of pool");
+
+		uint32_t n = _node_at[offset];
+		VGPU_HARD_ASSERT(n < _nodes.length() && !_nodes[n].is_free && _nodes[n].begin == offset, "range was not allocated from this pool");
+		VGPU_HARD_ASSERT(_nodes[n].count == count, "range freed with a different count than it was allocated with");
+		(void)count;
+
+		_nodes[n].is_free = true;
+		_nodes[n].owner = NULL;
+
+		uint32_t prev = _nodes[n].prev_phys;
+		if(prev != INVALID_NODE && _nodes[prev].is_free)
+		{
+			remove_free(prev);
+			_nodes[prev].count += _nodes[n].count;
+			unlink_phys(n);
+			delete_node(n);
+			n = prev;
+		}
+
+		uint32_t next = _nodes[n].next_phys;
+		if(next != INVALID_NODE && _nodes[next].is_free)
+		{
+			remove_free(next);
+			_nodes[n].count += _nodes[next].count;
+			unlink_phys(next);
+			delete_node(next);
+		}
+
+		if(_nodes[n].begin < _compact_offset)
+		{
+			_compact_offset = _nodes[n].begin;
+			_compact_scanned = 0;
+		}
+
+		insert_free(n);
+	}
+
+	// Fills the lowest free range with an owned range taken from the top of
+	// the pool and reports the move through the relocate func. The old range
+	// stays allocated so it can still be read by the GPU, the owner has to
+	// free it once that is no longer the case.
+	//
+	// At most max_nodes nodes are visited per call, so the caller can check a
+	// time budget between calls. The scan for a range to move goes top down
+	// from where the previous one stopped, wrapping around to the tail, so
+	// successive free ranges look at different candidates instead of the same
+	// ones at the top. A free range is skipped after COMPACT_SCAN candidates.
+	//
+	// Returns false once the end of the pool is reached, the next call then
+	// starts over from the beginning.
+	bool compact_step(uint32_t max_nodes = COMPACT_STEP_NODES)
+	{
+		VGPU_HARD_ASSERT(_relocate_func != NULL, "no relocate func set");
+
+		uint32_t visited = 0;
+		while(_compact_offset < _num_ids)
+		{
+			if(visited >= max_nodes)
+				return true;
+
+			uint32_t f = _node_at[_compact_offset];
+			if(!_nodes[f].is_free)
+			{
+				_compact_offset += _nodes[f].count;
+				_compact_scanned = 0;
+				++visited;
+				continue;
+			}
+
+			// Resume at the cursor if its node is still there and above f
+			uint32_t u = _tail;
+			if(_compact_scan < _num_ids && _compact_scan > _nodes[f].begin)
+			{
+				uint32_t n = _node_at[_compact_scan];
+				if(_nodes[n].count && _nodes[n].begin == _compact_scan)
+					u = n;
+			}
+
+			for(; u != f && visited < max_nodes && _compact_scanned < COMPACT_SCAN; u = _nodes[u].prev_phys)
+			{
+				if(!_nodes[u].is_free && _nodes[u].owner && _nodes[u].count <= _nodes[f].count)
+					break;
+				++visited;
+				++_compact_scanned;
+			}
+
+			if(u == f)
+			{
+				// Nothing above fits, the next scan starts at the tail again
+				_compact_offset += _nodes[f].count;
+				_compact_scan = _num_ids;
+				_compact_scanned = 0;
+				continue;
+			}
+
+			if(_nodes[u].is_free || !_nodes[u].owner || _nodes[u].count > _nodes[f].count)
+			{
+				_compact_scan = _nodes[u].begin;
+				if(_compact_scanned >= COMPACT_SCAN)
+				{
+					// Give up on this free range, the cursor stays where it is
+					_compact_offset += _nodes[f].count;
+					_compact_scanned = 0;
+				}
+				continue;
+			}
+
+			void* owner = _nodes[u].owner;
+			T old_offset = _nodes[u].begin;
+			T count = _nodes[u].count;
+			_nodes[u].owner = NULL;
+			_compact_scan = _nodes[_nodes[u].prev_phys].begin;
+
+			remove_free(f);
+			if(_nodes[f].count > count)
+			{
+				uint32_t r = new_node(_nodes[f].begin + count, _nodes[f].count - count);
+				link_phys_after(f, r);
+				_nodes[r].is_free = true;
+				insert_free(r);
+				_nodes[f].count = count;
+			}
+			_nodes[f].is_free = false;
+			_nodes[f].owner = owner;
+
+			T new_offset = _nodes[f].begin;
+			_compact_offset = new_offset;
+			_compact_scanned = 0;
+			_relocate_func(owner, old_offset, new_offset, count, _relocate_user_data);
+			return true;
+		}
+
+		_compact_offset = 0;
+		_compact_scanned = 0;
+		return false;
+	}
+
+	static void mapping(uint64_t count, uint32_t* fl, uint32_t* sl)
+	{
+		if(count < SL_COUNT)
+		{
+			*fl = 0;
+			*sl = (uint32_t)count;
+		}
+		else
+		{
+			uint32_t msb = vgpu_tlsf_fls(count);
+			*fl = msb - SL_LOG2 + 1;
+			*sl = (uint32_t)(count >> (msb - SL_LOG2)) - SL_COUNT;
+		}
+	}
+
+	uint32_t find_free(T count) const
+	{
+		// Round up to the next list boundary so any range in the list fits
+		uint64_t rounded = count;
+		if(rounded >= SL_COUNT)
+			rounded += (1ull << (vgpu_tlsf_fls(rounded) - SL_LOG2)) - 1;
+
+		uint32_t fl, sl;
+		mapping(rounded, &fl, &sl);
+		if(fl < FL_COUNT)
+		{
+			uint32_t sl_map = _sl_bitmap[fl] & (~0u << sl);
+			uint64_t fl_map = _fl_bitmap & (~0ull << (fl + 1));
+			if(sl_map || fl_map)
+			{
+				if(!sl_map)
+				{
+					fl = vgpu_tlsf_ffs(fl_map);
+					sl_map = _sl_bitmap[fl];
+				}
+
+				sl = vgpu_tlsf_ffs(sl_map);
+				return _free_lists[fl][sl];
+			}
+		}
+
+		// Nothing in the larger lists, the list count maps to may still hold
+		// a range that is big enough
+		mapping(count, &fl, &sl);
+		for(uint32_t n = _free_lists[fl][sl]; n != INVALID_NODE; n = _nodes[n].next_free)
+		{
+			if(_nodes[n].count >= count)
+				return n;
+		}
+
+		return INVALID_NODE;
+	}
+
+	void insert_free(uint32_t n)
+	{
+		uint32_t fl, sl;
+		mapping(_nodes[n].count, &fl, &sl);
+
+		uint32_t head = _free_lists[fl][sl];
+		_nodes[n].prev_free = INVALID_NODE;
+		_nodes[n].next_free = head;
+		if(head != INVALID_NODE)
+			_nodes[head].prev_free = n;
+		_free_lists[fl][sl] = n;
+
+		_fl_bitmap |= 1ull << fl;
+		_sl_bitmap[fl] |= 1u << sl;
+
+		_num_free += _nodes[n].count;
+	}
+
+	void remove_free(uint32_t n)
+	{
+		uint32_t fl, sl;
+		mapping(_nodes[n].count, &fl, &sl);
+
+		uint32_t prev = _nodes[n].prev_free;
+		uint32_t next = _nodes[n].next_free;
+		if(prev != INVALID_NODE)
+			_nodes[prev].next_free = next;
+		else
+			_free_lists[fl][sl] = next;
+		if(next != INVALID_NODE)
+			_nodes[next].prev_free = prev;
+
+		if(_free_lists[fl][sl] == INVALID_NODE)
+		{
+			_sl_bitmap[fl] &= ~(1u << sl);
+			if(!_sl_bitmap[fl])
+				_fl_bitmap &= ~(1ull << fl);
+		}
+
+		_num_free -= _nodes[n].count;
+	}
+
+	uint32_t new_node(T begin, T count)
+	{
+		uint32_t n = _unused_nodes;
+		if(n != INVALID_NODE)
+		{
+			_unused_nodes = _nodes[n].next_free;
+		}
+		else
+		{
+			_nodes.emplace();
+			n = (uint32_t)_nodes.length() - 1;
+		}
+
+		_nodes[n].begin = begin;
+		_nodes[n].count = count;
+		_nodes[n].prev_phys = INVALID_NODE;
+		_nodes[n].next_phys = INVALID_NODE;
+		_nodes[n].prev_free = INVALID_NODE;
+		_nodes[n].next_free = INVALID_NODE;
+		_nodes[n].owner = NULL;
+		_nodes[n].is_free = false;
+		_node_at[begin] = n;
+
+		return n;
+	}
+
+	void delete_node(uint32_t n)
+	{
+		// Marks the node as gone for the compaction scan cursor
+		_nodes[n].count = 0;
+		_nodes[n].next_free = _unused_nodes;
+		_unused_nodes = n;
+	}
+
+	void link_phys_after(uint32_t n, uint32_t r)
+	{
+		uint32_t next = _nodes[n].next_phys;
+		_nodes[r].prev_phys = n;
+		_nodes[r].next_phys = next;
+		if(next != INVALID_NODE)
+			_nodes[next].prev_phys = r;
+		else
+			_tail = r;
+		_nodes[n].next_phys = r;
+	}
+
+	void unlink_phys(uint32_t n)
+	{
+		uint32_t prev = _nodes[n].prev_phys;
+		uint32_t next = _nodes[n].next_phys;
+		if(prev != INVALID_NODE)
+			_nodes[prev].next_phys = next;
+		if(next != INVALID_NODE)
+			_nodes[next].prev_phys = prev;
+		else
+			_tail = prev;
+	}
+};
+
+#endif
+
+#endif // VGPU_TLSF_POOL_H
@@ -0,0 +1,486 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <atomic>
+
+#include "vgpu_internal.h"
+#include "vgpu_array.h"
+
+/******************************************************************************\
+ *
+ *  Structures
+ *
+\******************************************************************************/
+
+struct vgpu_allocation_stats_t
+{
+	uint64_t live_bytes;
+	uint64_t peak_bytes;
+	uint64_t live_count;
+	uint64_t total_count;
+};
+
+struct vgpu_allocation_site_t
+{
+	const char* file;
+	int line;
+	const char* type_name;
+	uint32_t type; // of type_name, most sites only ever allocate one type
+	vgpu_allocation_stats_t stats;
+};
+
+struct vgpu_allocation_type_t
+{
+	const char* name;
+	vgpu_allocation_stats_t stats;
+};
+
+// Placed right in front of every allocation handed out
+struct vgpu_allocation_header_t
+{
+	uint64_t num_bytes;
+	uint32_t site;
+	uint32_t type;
+	uint32_t offset; // from the start of the parent allocation
+	uint32_t pad;
+};
+
+// Maps a type name pointer to its entry in types. The same name can show up
+// under several pointers since string literals are not merged across
+// translation units.
+struct vgpu_allocation_type_alias_t
+{
+	const char* name;
+	uint32_t type;
+};
+
+struct vgpu_tracking_allocator_t
+{
+	vgpu_allocator_t base;
+	vgpu_allocator_t* parent;
+
+	std::atomic_flag lock;
+
+	vgpu_allocation_stats_t total;
+	vgpu_array_t<vgpu_allocation_site_t> sites;
+	vgpu_array_t<vgpu_allocation_type_t> types;
+
+	// Open addressing, site index + 1, 0 is empty
+	uint32_t* site_lookup;
+	size_t site_lookup_size;
+
+	vgpu_allocation_type_alias_t* type_lookup;
+	size_t type_lookup_size;
+	size_t num_type_aliases;
+};
+
+static const size_t INITIAL_LOOKUP_SIZE = 1024;
+
+/******************************************************************************\
+ *
+ *  Lookup
+ *
+\******************************************************************************/
+
+static size_t hash_site(const void* ptr, int line)
+{
+	uint64_t h = (uint64_t)(uintptr_t)ptr * 0x9E3779B97F4A7C15ull;
+	h ^= (uint64_t)(uint32_t)line * 0xC2B2AE3D27D4EB4Full;
+	return (size_t)(h >> 32);
+}
+
+static void insert_site(uint32_t* lookup, size_t size, const vgpu_allocation_site_t& site, uint32_t index)
+{
+	size_t slot = hash_site(site.file, site.line) & (size - 1);
+	while(lookup[slot])
+		slot = (slot + 1) & (size - 1);
+	lookup[slot] = index + 1;
+}
+
+static void insert_type_alias(vgpu_allocation_type_alias_t* lookup, size_t size, const char* name, uint32_t type)
+{
+	size_t slot = hash_site(name, 0) & (size - 1);
+	while(lookup[slot].name)
+		slot = (slot + 1) & (size - 1);
+	lookup[slot].name = name;
+	lookup[slot].type = type;
+}
+
+static uint32_t find_type(vgpu_tracking_allocator_t* allocator, const char* name);
+
+static uint32_t find_site(vgpu_tracking_allocator_t* allocator, const char* file, int line, const char* type_name)
+{
+	size_t mask = allocator->site_lookup_size - 1;
+	for(size_t slot = hash_site(file, line) & mask; allocator->site_lookup[slot]; slot = (slot + 1) & mask)
+	{
+		uint32_t index = allocator->site_lookup[slot] - 1;
+		if(allocator->sites[index].file == file && allocator->sites[index].line == line)
+			return index;
+	}
+
+	vgpu_allocation_site_t site;
+	memset(&site, 0, sizeof(site));
+	site.file = file;
+	site.line = line;
+	site.type_name = type_name;
+	site.type = find_type(allocator, type_name);
+	allocator->sites.push_back(site);
+	uint32_t index = (uint32_t)allocator->sites.length() - 1;
+
+	if(allocator->sites.length() * 2 > allocator->site_lookup_size)
+	{
+		size_t size = allocator->site_lookup_size * 2;
+		uint32_t* lookup = VGPU_ALLOC_ARRAY(allocator->parent, size, uint32_t);
+		memset(lookup, 0, size * sizeof(uint32_t));
+		for(uint32_t i = 0; i < index; ++i)
+			insert_site(lookup, size, allocator->sites[i], i);
+
+		VGPU_FREE(allocator->parent, allocator->site_lookup);
+		allocator->site_lookup = lookup;
+		allocator->site_lookup_size = size;
+	}
+	insert_site(allocator->site_lookup, allocator->site_lookup_size, site, index);
+
+	return index;
+}
+
+static uint32_t find_type(vgpu_tracking_allocator_t* allocator, const char* name)
+{
+	if(name == NULL)
+		name = "untyped";
+
+	size_t mask = allocator->type_lookup_size - 1;
+	for(size_t slot = hash_site(name, 0) & mask; allocator->type_lookup[slot].name; slot = (slot + 1) & mask)
+	{
+		if(allocator->type_lookup[slot].name == name)
+			return allocator->type_lookup[slot].type;
+	}
+
+	uint32_t type = 0;
+	for(; type < allocator->types.length(); ++type)
+	{
+		if(strcmp(allocator->types[type].name, name) == 0)
+			break;
+	}
+
+	if(type == allocator->types.length())
+	{
+		vgpu_allocation_type_t& new_type = allocator->types.emplace();
+		new_type.name = name;
+	}
+
+	allocator->num_type_aliases += 1;
+	if(allocator->num_type_aliases * 2 > allocator->type_lookup_size)
+	{
+		size_t size = allocator->type_lookup_size * 2;
+		vgpu_allocation_type_alias_t* lookup = VGPU_ALLOC_ARRAY(allocator->parent, size, vgpu_allocation_type_alias_t);
+		memset(lookup, 0, size * sizeof(vgpu_allocation_type_alias_t));
+		for(size_t i = 0; i < allocator->type_lookup_size; ++i)
+		{
+			if(allocator->type_lookup[i].name)
+				insert_type_alias(lookup, size, allocator->type_lookup[i].name, allocator->type_lookup[i].type);
+		}
+
+		VGPU_FREE(allocator->parent, allocator->type_lookup);
+		allocator->type_lookup = lookup;
+		allocator->type_lookup_size = size;
+	}
+	insert_type_alias(allocator->type_lookup, allocator->type_lookup_size, name, type);
+
+	return type;
+}
+
+/******************************************************************************\
+ *
+ *  Allocator callbacks
+ *
+\******************************************************************************/
+
+static void lock(vgpu_tracking_allocator_t* allocator)
+{
+	while(allocator->lock.test_and_set(std::memory_order_acquire))
+		;
+}
+
+static void unlock(vgpu_tracking_allocator_t* allocator)
+{
+	allocator->lock.clear(std::memory_order_release);
+}
+
+static void stats_add(vgpu_allocation_stats_t* stats, uint64_t num_bytes)
+{
+	stats->live_bytes += num_bytes;
+	stats->live_count += 1;
+	stats->total_count += 1;
+	if(stats->live_bytes > stats->peak_bytes)
+		stats->peak_bytes = stats->live_bytes;
+}
+
+static void stats_remove(vgpu_allocation_stats_t* stats, uint64_t num_bytes)
+{
+	stats->live_bytes -= num_bytes;
+	stats->live_count -= 1;
+}
+
+static vgpu_allocation_header_t* get_header(void* memory)
+{
+	return (vgpu_allocation_header_t*)memory - 1;
+}
+
+static void* tracking_alloc(vgpu_allocator_t* base, size_t count, size_t size, size_t align, const char* file, int line)
+{
+	vgpu_tracking_allocator_t* allocator = (vgpu_tracking_allocator_t*)base;
+	const char* type_name = vgpu_alloc_type_name;
+
+	if(align < alignof(vgpu_allocation_header_t))
+		align = alignof(vgpu_allocation_header_t);
+	size_t offset = VGPU_ALIGN_UP(sizeof(vgpu_allocation_header_t), align);
+	size_t num_bytes = count * size;
+
+	uint8_t* base_ptr = (uint8_t*)allocator->parent->alloc(allocator->parent, 1, offset + num_bytes, align, file, line);
+	if(base_ptr == NULL)
+		return NULL;
+
+	vgpu_allocation_header_t* header = get_header(base_ptr + offset);
+	header->num_bytes = num_bytes;
+	header->offset = (uint32_t)offset;
+
+	lock(allocator);
+	header->site = find_site(allocator, file, line, type_name);
+	const vgpu_allocation_site_t& site = allocator->sites[header->site];
+	header->type = site.type_name == type_name ? site.type : find_type(allocator, type_name);
+	stats_add(&allocator->sites[header->site].stats, num_bytes);
+	stats_add(&allocator->types[header->type].stats, num_bytes);
+	stats_add(&allocator->total, num_bytes);
+	unlock(allocator);
+
+	return base_ptr + offset;
+}
+
+static void tracking_free(vgpu_allocator_t* base, void* memory, const char* file, int line)
+{
+	if(memory == NULL)
+		return;
+
+	vgpu_tracking_allocator_t* allocator = (vgpu_tracking_allocator_t*)base;
+	vgpu_allocation_header_t* header = get_header(memory);
+
+	lock(allocator);
+	stats_remove(&allocator->sites[header->site].stats, header->num_bytes);
+	stats_remove(&allocator->types[header->type].stats, header->num_bytes);
+	stats_remove(&allocator->total, header->num_bytes);
+	unlock(allocator);
+
+	allocator->parent->free(allocator->parent, (uint8_t*)memory - header->offset, file, line);
+}
+
+static void* tracking_realloc(vgpu_allocator_t* base, void* memory, size_t count, size_t size, size_t align, const char* file, int line)
+{
+	// The header has to move with the data, so this is always a new allocation
+	void* new_memory = tracking_alloc(base, count, size, align, file, line);
+	if(memory && new_memory)
+	{
+		size_t old_num_bytes = (size_t)get_header(memory)->num_bytes;
+		size_t num_bytes = count * size;
+		memcpy(new_memory, memory, old_num_bytes < num_bytes ? old_num_bytes : num_bytes);
+		tracking_free(base, memory, file, line);
+	}
+	return new_memory;
+}
+
+/******************************************************************************\
+ *
+ *  Report
+ *
+\******************************************************************************/
+
+struct vgpu_allocation_report_entry_t
+{
+	const char* name;
+	const char* file;
+	int line;
+	vgpu_allocation_stats_t stats;
+};
+
+static int compare_report_entries(const void* a, const void* b)
+{
+	const vgpu_allocation_stats_t& sa = ((const vgpu_allocation_report_entry_t*)a)->stats;
+	const vgpu_allocation_stats_t& sb = ((const vgpu_allocation_report_entry_t*)b)->stats;
+	if(sa.live_bytes != sb.live_bytes)
+		return sa.live_bytes < sb.live_bytes ? 1 : -1;
+	if(sa.peak_bytes != sb.peak_bytes)
+		return sa.peak_bytes < sb.peak_bytes ? 1 : -1;
+	if(sa.total_count != sb.total_count)
+		return sa.total_count < sb.total_count ? 1 : -1;
+	return 0;
+}
+
+// Only quotes and backslashes can show up in file and type names
+static void json_escape(char* out, size_t out_size, const char* str)
+{
+	size_t n = 0;
+	for(; *str && n + 2 < out_size; ++str)
+	{
+		if(*str == '"' || *str == '\\')
+			out[n++] = '\\';
+		out[n++] = *str;
+	}
+	out[n] = 0;
+}
+
+static void log_entries(vgpu_log_func_t log_func, vgpu_allocation_report_format_t format, const vgpu_allocation_report_entry_t* entries, size_t num_entries)
+{
+	char line[1024];
+	char name[256];
+	char file[512];
+	for(size_t i = 0; i < num_entries; ++i)
+	{
+		const vgpu_allocation_report_entry_t& e = entries[i];
+		if(format == VGPU_ALLOCATION_REPORT_JSON)
+		{
+			json_escape(name, sizeof(name), e.name);
+			if(e.file)
+			{
+				json_escape(file, sizeof(file), e.file);
+				snprintf(line, sizeof(line), "    { \"file\": \"%s\", \"line\": %d, \"type\": \"%s\", \"live_bytes\": %llu, \"peak_bytes\": %llu, \"live_count\": %llu, \"total_count\": %llu }%s",
+					file, e.line, name,
+					(unsigned long long)e.stats.live_bytes, (unsigned long long)e.stats.peak_bytes,
+					(unsigned long long)e.stats.live_count, (unsigned long long)e.stats.total_count,
+					i + 1 < num_entries ? "," : "");
+			}
+			else
+			{
+				snprintf(line, sizeof(line), "    { \"type\": \"%s\", \"live_bytes\": %llu, \"peak_bytes\": %llu, \"live_count\": %llu, \"total_count\": %llu }%s",
+					name,
+					(unsigned long long)e.stats.live_bytes, (unsigned long long)e.stats.peak_bytes,
+					(unsigned long long)e.stats.live_count, (unsigned long long)e.stats.total_count,
+					i + 1 < num_entries ? "," : "");
+			}
+		}
+		else
+		{
+			if(e.file)
+				snprintf(name, sizeof(name), "%s(%d) %s", e.file, e.line, e.name);
+			else
+				snprintf(name, sizeof(name), "%s", e.name);
+
+			snprintf(line, sizeof(line), "%14llu %14llu %10llu %12llu  %s",
+				(unsigned long long)e.stats.live_bytes, (unsigned long long)e.stats.peak_bytes,
+				(unsigned long long)e.stats.live_count, (unsigned long long)e.stats.total_count,
+				name);
+		}
+		log_func(line);
+	}
+}
+
+/******************************************************************************\
+ *
+ *  Public interface
+ *
+\******************************************************************************/
+
+vgpu_allocator_t* vgpu_create_tracking_allocator(vgpu_allocator_t* parent)
+{
+	extern vgpu_allocator_t vgpu_allocator_default;
+	if(parent == NULL)
+		parent = &vgpu_allocator_default;
+
+	vgpu_tracking_allocator_t* allocator = VGPU_NEW(parent, vgpu_tracking_allocator_t);
+	allocator->base.alloc = tracking_alloc;
+	allocator->base.realloc = tracking_realloc;
+	allocator->base.free = tracking_free;
+	allocator->parent = parent;
+	allocator->lock.clear();
+
+	memset(&allocator->total, 0, sizeof(allocator->total));
+	allocator->sites.create(parent, 256);
+	allocator->types.create(parent, 64);
+
+	allocator->site_lookup_size = INITIAL_LOOKUP_SIZE;
+	allocator->site_lookup = VGPU_ALLOC_ARRAY(parent, INITIAL_LOOKUP_SIZE, uint32_t);
+	memset(allocator->site_lookup, 0, INITIAL_LOOKUP_SIZE * sizeof(uint32_t));
+
+	allocator->type_lookup_size = INITIAL_LOOKUP_SIZE;
+	allocator->type_lookup = VGPU_ALLOC_ARRAY(parent, INITIAL_LOOKUP_SIZE, vgpu_allocation_type_alias_t);
+	memset(allocator->type_lookup, 0, INITIAL_LOOKUP_SIZE * sizeof(vgpu_allocation_type_alias_t));
+	allocator->num_type_aliases = 0;
+
+	return &allocator->base;
+}
+
+void vgpu_destroy_tracking_allocator(vgpu_allocator_t* base)
+{
+	vgpu_tracking_allocator_t* allocator = (vgpu_tracking_allocator_t*)base;
+	vgpu_allocator_t* parent = allocator->parent;
+	VGPU_FREE(parent, allocator->site_lookup);
+	VGPU_FREE(parent, allocator->type_lookup);
+	VGPU_DELETE(parent, vgpu_tracking_allocator_t, allocator);
+}
+
+void vgpu_dump_tracking_allocator(vgpu_allocator_t* base, vgpu_allocation_report_format_t format, vgpu_log_func_t log_func)
+{
+	vgpu_tracking_allocator_t* allocator = (vgpu_tracking_allocator_t*)base;
+
+	// Take a copy so the lock is not held while logging
+	lock(allocator);
+	size_t num_sites = allocator->sites.length();
+	size_t num_types = allocator->types.length();
+	vgpu_allocation_stats_t total = allocator->total;
+	vgpu_allocation_report_entry_t* entries = VGPU_ALLOC_ARRAY(allocator->parent, num_sites + num_types, vgpu_allocation_report_entry_t);
+	for(size_t i = 0; i < num_sites; ++i)
+	{
+		const vgpu_allocation_site_t& site = allocator->sites[i];
+		entries[i].name = site.type_name ? site.type_name : "untyped";
+		entries[i].file = site.file;
+		entries[i].line = site.line;
+		entries[i].stats = site.stats;
+	}
+	for(size_t i = 0; i < num_types; ++i)
+	{
+		const vgpu_allocation_type_t& type = allocator->types[i];
+		entries[num_sites + i].name = type.name;
+		entries[num_sites + i].file = NULL;
+		entries[num_sites + i].line = 0;
+		entries[num_sites + i].stats = type.stats;
+	}
+	unlock(allocator);
+
+	vgpu_allocation_report_entry_t* site_entries = entries;
+	vgpu_allocation_report_entry_t* type_entries = entries + num_sites;
+	qsort(site_entries, num_sites, sizeof(vgpu_allocation_report_entry_t), compare_report_entries);
+	qsort(type_entries, num_types, sizeof(vgpu_allocation_report_entry_t), compare_report_entries);
+
+	char line[256];
+	if(format == VGPU_ALLOCATION_REPORT_JSON)
+	{
+		log_func("{");
+		snprintf(line, sizeof(line), "  \"total\": { \"live_bytes\": %llu, \"peak_bytes\": %llu, \"live_count\": %llu, \"total_count\": %llu },",
+			(unsigned long long)total.live_bytes, (unsigned long long)total.peak_bytes,
+			(unsigned long long)total.live_count, (unsigned long long)total.total_count);
+		log_func(line);
+		log_func("  \"types\": [");
+		log_entries(log_func, format, type_entries, num_types);
+		log_func("  ],");
+		log_func("  \"sites\": [");
+		log_entries(log_func, format, site_entries, num_sites);
+		log_func("  ]");
+		log_func("}");
+	}
+	else
+	{
+		snprintf(line, sizeof(line), "vgpu allocations: %llu bytes live in %llu allocations, %llu bytes peak, %llu allocations total",
+			(unsigned long long)total.live_bytes, (unsigned long long)total.live_count,
+			(unsigned long long)total.peak_bytes, (unsigned long long)total.total_count);
+		log_func(line);
+
+		snprintf(line, sizeof(line), "%14s %14s %10s %12s  %s", "live bytes", "peak bytes", "live", "total", "type");
+		log_func(line);
+		log_entries(log_func, format, type_entries, num_types);
+
+		snprintf(line, sizeof(line), "%14s %14s %10s %12s  %s", "live bytes", "peak bytes", "live", "total", "call site");
+		log_func(line);
+		log_entries(log_func, format, site_entries, num_sites);
+	}
+
+	VGPU_FREE(allocator->parent, entries);
+}
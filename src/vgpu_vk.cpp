@@ -4,6 +4,9 @@
 #include <vgpu.h>
 #include "vgpu_internal.h"
 #include "vgpu_array.h"
+#include "vgpu_linear_allocator.h"
+#include "vgpu_handle_table.h"
+#include "vgpu_tlsf_pool.h"
 
 #include <cstring>
 
@@ -39,6 +42,17 @@
 #define VGPU_VK_SETUP_TYPE(s, type) do { (s).sType = (type); (s).pNext = nullptr; } while (0);
 #define VGPU_VK_ADD_TYPE(type) (type), nullptr
 
+// Device memory is allocated in blocks and handed out in granules, resources
+// that would take more than half a block get an allocation of their own
+#define VGPU_VK_MEMORY_BLOCK_SIZE (64ull * 1024 * 1024)
+#define VGPU_VK_MEMORY_GRANULE 256ull
+// Render targets this large are recreated on resize, keep them out of the
+// blocks so they don't leave holes behind
+#define VGPU_VK_DEDICATED_RENDER_TARGET_SIZE (4ull * 1024 * 1024)
+// Initial size of the per frame staging buffer of a thread context, it grows
+// when a frame uploads more than that
+#define VGPU_VK_STAGING_BUFFER_SIZE (8ull * 1024 * 1024)
+
 /******************************************************************************\
 *
 *  Translation utils
@@ -67,10 +81,65 @@ static const VkIndexType translate_indextype[] = {
  *
 \******************************************************************************/
 
+// Buffers and optimally tiled images never share a block, so
+// bufferImageGranularity doesn't have to be respected between neighbours
+enum vgpu_vk_memory_kind_t
+{
+	VGPU_VK_MEMORY_KIND_LINEAR,
+	VGPU_VK_MEMORY_KIND_OPTIMAL,
+
+	VGPU_VK_MEMORY_KIND_COUNT,
+};
+
+struct vgpu_vk_memory_block_t
+{
+	VkDeviceMemory memory;
+	VkDeviceSize size;
+	uint32_t memory_type;
+	vgpu_vk_memory_kind_t kind;
+	bool dedicated;
+
+	// In granules, unused for dedicated blocks
+	vgpu_tlsf_pool_t<uint32_t> pool;
+	uint32_t num_allocations;
+
+	// Host visible blocks are mapped for their whole lifetime
+	uint8_t* mapped;
+	bool coherent;
+};
+
+struct vgpu_vk_allocation_t
+{
+	vgpu_vk_memory_block_t* block;
+	VkDeviceSize offset;
+	VkDeviceSize size;
+	uint32_t pool_offset;
+	uint32_t pool_count;
+};
+
+// Objects destroyed while a frame in flight may still use them
+struct vgpu_vk_delayed_release_t
+{
+	VkBuffer buffer;
+	VkImage image;
+	vgpu_vk_allocation_t allocation;
+};
+
+// Host visible ring that locks of device local buffers are written to
+struct vgpu_vk_staging_buffer_t
+{
+	VkBuffer buffer;
+	vgpu_vk_allocation_t allocation;
+	uint8_t* data;
+	VkDeviceSize size;
+	VkDeviceSize offset;
+};
+
 struct vgpu_buffer_s
 {
 	VkBuffer buffer;
-	VkDeviceMemory mem;
+	vgpu_vk_allocation_t allocation;
+	bool device_local;
 };
 
 struct vgpu_resource_table_s
@@ -85,7 +154,7 @@ struct vgpu_root_layout_s
 struct vgpu_texture_s
 {
 	VkImage image;
-	VkDeviceMemory mem;
+	vgpu_vk_allocation_t allocation;
 	VkFormat format;
 	VkClearValue clear_value;
 };
@@ -104,6 +173,8 @@ struct vgpu_pipeline_s
 struct vgpu_render_pass_s
 {
 	VkRenderPass render_pass;
+	// Same attachments without the clears, to resume the pass after a copy
+	VkRenderPass load_render_pass;
 	VkFramebuffer framebuffer[VGPU_MULTI_BUFFERING];
 
 	size_t num_color_targets;
@@ -127,6 +198,8 @@ struct vgpu_command_list_s
 	VkCommandBuffer command_buffer;
 	
 	vgpu_render_pass_t* curr_pass;
+	// curr_pass was begun by vgpu_set_render_pass and has to be ended here
+	bool in_render_pass;
 	bool present_semaphore_needed;
 };
 
@@ -134,8 +207,12 @@ struct vgpu_thread_context_s
 {
 	VkCommandPool command_pool[VGPU_MULTI_BUFFERING];
 
-	vgpu_array_t<VkCommandBuffer> free[VGPU_MULTI_BUFFERING];
-	vgpu_array_t<VkCommandBuffer> pending[VGPU_MULTI_BUFFERING];
+	vgpu_small_array_t<VkCommandBuffer, 8> free[VGPU_MULTI_BUFFERING];
+	vgpu_small_array_t<VkCommandBuffer, 8> pending[VGPU_MULTI_BUFFERING];
+
+	vgpu_linear_allocator_t frame_allocator[VGPU_MULTI_BUFFERING];
+	vgpu_vk_staging_buffer_t staging[VGPU_MULTI_BUFFERING];
+	uint32_t frame_id;
 };
 
 struct vgpu_device_s
@@ -173,8 +250,412 @@ struct vgpu_device_s
 	VkSemaphore present_semaphore[VGPU_MULTI_BUFFERING];
 	uint32_t swapchain_image_index;
 	bool present_semaphore_waited_on;
+
+	struct frame_data_t
+	{
+		// Signalled once the GPU is done with everything submitted for the frame
+		VkFence fence;
+		bool fence_submitted;
+		vgpu_array_t<vgpu_vk_delayed_release_t> delay_release_queue;
+	} frame[VGPU_MULTI_BUFFERING];
+	vgpu_frame_stats_t frame_stats;
+
+	SRWLOCK memory_lock;
+	VkDeviceSize memory_block_size[VK_MAX_MEMORY_TYPES];
+	vgpu_array_t<vgpu_vk_memory_block_t*> memory_blocks[VK_MAX_MEMORY_TYPES][VGPU_VK_MEMORY_KIND_COUNT];
+	vgpu_memory_stats_t memory_stats;
+
+	VkPipelineCache pipeline_cache;
+	char* pipeline_cache_file;
+
+	vgpu_handle_table_t<vgpu_buffer_t, vgpu_create_buffer_params_t> buffer_handles;
 };
 
+/******************************************************************************\
+ *
+ *  Memory allocation
+ *
+\******************************************************************************/
+
+static uint32_t vgpu_vk_memory_type_from_properties(vgpu_device_t* device, uint32_t type_bits, VkFlags requirements_mask)
+{
+	for (uint32_t i = 0; i < 32; i++) {
+		if ((type_bits & 1) == 1) {
+			if ((device->memory_props.memoryTypes[i].propertyFlags & requirements_mask) == requirements_mask) {
+				return i;
+			}
+		}
+		type_bits >>= 1;
+	}
+	VGPU_ASSERT(device, false, "Failed to find memory type");
+	return 0;
+}
+
+static vgpu_device_t::frame_data_t& curr_frame(vgpu_device_t* device)
+{
+	return device->frame[device->frame_no % VGPU_MULTI_BUFFERING];
+}
+
+static void init_memory(vgpu_device_t* device)
+{
+	InitializeSRWLock(&device->memory_lock);
+
+	for (uint32_t i = 0; i < device->memory_props.memoryTypeCount; ++i)
+	{
+		// Small heaps like the host visible part of VRAM get smaller blocks so
+		// a few half empty ones can't use all of it up
+		VkDeviceSize heap_size = device->memory_props.memoryHeaps[device->memory_props.memoryTypes[i].heapIndex].size;
+		VkDeviceSize block_size = VGPU_VK_MEMORY_BLOCK_SIZE;
+		while (block_size > 1024 * 1024 && block_size > heap_size / 8)
+			block_size /= 2;
+		device->memory_block_size[i] = block_size;
+
+		for (uint32_t k = 0; k < VGPU_VK_MEMORY_KIND_COUNT; ++k)
+			device->memory_blocks[i][k].create(device->allocator, 8);
+	}
+
+	for (uint32_t i = 0; i < VGPU_MULTI_BUFFERING; ++i)
+		device->frame[i].delay_release_queue.create(device->allocator, 128);
+}
+
+static vgpu_vk_memory_block_t* create_memory_block(vgpu_device_t* device, uint32_t memory_type, vgpu_vk_memory_kind_t kind, VkDeviceSize size, bool dedicated)
+{
+	VkMemoryAllocateInfo alloc_info =
+	{
+		VGPU_VK_ADD_TYPE(VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO),
+		size,
+		memory_type,
+	};
+	VkDeviceMemory memory;
+	VkResult res = vkAllocateMemory(device->vk_device, &alloc_info, &device->vk_allocator, &memory);
+	if (res != VK_SUCCESS)
+		return nullptr;
+
+	vgpu_vk_memory_block_t* block = VGPU_NEW(device->allocator, vgpu_vk_memory_block_t);
+	block->memory = memory;
+	block->size = size;
+	block->memory_type = memory_type;
+	block->kind = kind;
+	block->dedicated = dedicated;
+	block->num_allocations = 0;
+	block->mapped = nullptr;
+	block->coherent = (device->memory_props.memoryTypes[memory_type].propertyFlags & VK_MEMORY_PROPERTY_HOST_COHERENT_BIT) != 0;
+	if (device->memory_props.memoryTypes[memory_type].propertyFlags & VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT)
+	{
+		void* mapped = nullptr;
+		res = vkMapMemory(device->vk_device, memory, 0, VK_WHOLE_SIZE, 0, &mapped);
+		VGPU_ASSERT(device, res == VK_SUCCESS, "Failed to map memory");
+		block->mapped = (uint8_t*)mapped;
+	}
+	if (!dedicated)
+		block->pool.create(device->allocator, (uint32_t)(size / VGPU_VK_MEMORY_GRANULE));
+
+	device->memory_stats.num_blocks++;
+	device->memory_stats.num_dedicated_blocks += dedicated ? 1 : 0;
+	device->memory_stats.allocated_bytes += size;
+	return block;
+}
+
+static void destroy_memory_block(vgpu_device_t* device, vgpu_vk_memory_block_t* block)
+{
+	if (block->mapped)
+		vkUnmapMemory(device->vk_device, block->memory);
+	vkFreeMemory(device->vk_device, block->memory, &device->vk_allocator);
+
+	device->memory_stats.num_blocks--;
+	device->memory_stats.num_dedicated_blocks -= block->dedicated ? 1 : 0;
+	device->memory_stats.allocated_bytes -= block->size;
+
+	VGPU_DELETE(device->allocator, vgpu_vk_memory_block_t, block);
+}
+
+static bool alloc_memory(vgpu_device_t* device, const VkMemoryRequirements* reqs, VkMemoryPropertyFlags property_flags, vgpu_vk_memory_kind_t kind, bool dedicated, vgpu_vk_allocation_t* out_allocation)
+{
+	uint32_t memory_type = vgpu_vk_memory_type_from_properties(device, reqs->memoryTypeBits, property_flags);
+	VkDeviceSize block_size = device->memory_block_size[memory_type];
+
+	// Blocks start granule aligned, larger alignments are reached by padding
+	// the range and moving the offset up inside of it
+	VkDeviceSize alignment = reqs->alignment > VGPU_VK_MEMORY_GRANULE ? reqs->alignment : VGPU_VK_MEMORY_GRANULE;
+	VkDeviceSize padded_size = VGPU_ALIGN_UP(reqs->size, VGPU_VK_MEMORY_GRANULE) + alignment - VGPU_VK_MEMORY_GRANULE;
+
+	memset(out_allocation, 0, sizeof(vgpu_vk_allocation_t));
+	out_allocation->size = reqs->size;
+
+	AcquireSRWLockExclusive(&device->memory_lock);
+
+	if (dedicated || padded_size > block_size / 2)
+	{
+		out_allocation->block = create_memory_block(device, memory_type, kind, reqs->size, true);
+		if (out_allocation->block)
+			out_allocation->block->num_allocations = 1;
+	}
+	else
+	{
+		uint32_t count = (uint32_t)(padded_size / VGPU_VK_MEMORY_GRANULE);
+		vgpu_array_t<vgpu_vk_memory_block_t*>& blocks = device->memory_blocks[memory_type][kind];
+
+		// Newest blocks first, older ones are the most likely to be full
+		for (size_t i = blocks.length(); i-- > 0 && !out_allocation->block;)
+		{
+			if (blocks[i]->pool.num_free() < count)
+				continue;
+
+			uint32_t offset = blocks[i]->pool.try_alloc(count);
+			if (offset != UINT32_MAX)
+			{
+				out_allocation->block = blocks[i];
+				out_allocation->pool_offset = offset;
+			}
+		}
+
+		if (!out_allocation->block)
+		{
+			vgpu_vk_memory_block_t* block = create_memory_block(device, memory_type, kind, block_size, false);
+			if (block)
+			{
+				blocks.push_back(block);
+				out_allocation->block = block;
+				out_allocation->pool_offset = block->pool.alloc(count);
+			}
+		}
+
+		if (out_allocation->block)
+		{
+			out_allocation->block->num_allocations++;
+			out_allocation->pool_count = count;
+			out_allocation->offset = VGPU_ALIGN_UP(out_allocation->pool_offset * VGPU_VK_MEMORY_GRANULE, alignment);
+		}
+	}
+
+	if (out_allocation->block)
+	{
+		device->memory_stats.used_bytes += reqs->size;
+		device->memory_stats.num_allocations++;
+	}
+
+	ReleaseSRWLockExclusive(&device->memory_lock);
+
+	VGPU_ASSERT(device, out_allocation->block != nullptr, "Failed to allocate device memory");
+	return out_allocation->block != nullptr;
+}
+
+// Call with the memory lock held
+static void free_memory_locked(vgpu_device_t* device, const vgpu_vk_allocation_t* allocation)
+{
+	vgpu_vk_memory_block_t* block = allocation->block;
+	if (block == nullptr)
+		return;
+
+	device->memory_stats.used_bytes -= allocation->size;
+	device->memory_stats.num_allocations--;
+
+	if (block->dedicated)
+	{
+		destroy_memory_block(device, block);
+		return;
+	}
+
+	block->pool.free(allocation->pool_offset, allocation->pool_count);
+	if (--block->num_allocations > 0)
+		return;
+
+	// Keep a single empty block per memory type and kind, so a resource that
+	// is destroyed and created again doesn't go to the driver every time
+	vgpu_array_t<vgpu_vk_memory_block_t*>& blocks = device->memory_blocks[block->memory_type][block->kind];
+	size_t index = blocks.length();
+	bool other_empty = false;
+	for (size_t i = 0; i < blocks.length(); ++i)
+	{
+		if (blocks[i] == block)
+			index = i;
+		else if (blocks[i]->num_allocations == 0)
+			other_empty = true;
+	}
+	VGPU_ASSERT(device, index < blocks.length(), "Memory block is not in its list");
+
+	if (other_empty)
+	{
+		blocks.remove_at(index);
+		destroy_memory_block(device, block);
+	}
+}
+
+static uint8_t* mapped_memory(vgpu_device_t* device, const vgpu_vk_allocation_t* allocation)
+{
+	VGPU_ASSERT(device, allocation->block->mapped != nullptr, "Memory is not host visible");
+	return allocation->block->mapped + allocation->offset;
+}
+
+// Makes CPU writes visible to the device, only needed for memory types that
+// are not host coherent
+static void flush_memory(vgpu_device_t* device, const vgpu_vk_allocation_t* allocation, VkDeviceSize offset, VkDeviceSize size)
+{
+	vgpu_vk_memory_block_t* block = allocation->block;
+	if (block->coherent)
+		return;
+
+	VkDeviceSize atom_size = device->device_props.limits.nonCoherentAtomSize;
+	VkDeviceSize begin = allocation->offset + offset;
+	VkDeviceSize end = VGPU_ALIGN_UP(begin + size, atom_size);
+	begin -= begin % atom_size;
+
+	VkMappedMemoryRange range =
+	{
+		VGPU_VK_ADD_TYPE(VK_STRUCTURE_TYPE_MAPPED_MEMORY_RANGE),
+		block->memory,
+		begin,
+		end < block->size ? end - begin : VK_WHOLE_SIZE,
+	};
+	VkResult res = vkFlushMappedMemoryRanges(device->vk_device, 1, &range);
+	VGPU_ASSERT(device, res == VK_SUCCESS, "Failed to flush mapped memory");
+}
+
+// The buffer or image and its memory are released once the frames that are
+// in flight are done with them
+static void delay_release(vgpu_device_t* device, VkBuffer buffer, VkImage image, const vgpu_vk_allocation_t* allocation)
+{
+	vgpu_vk_delayed_release_t release;
+	release.buffer = buffer;
+	release.image = image;
+	release.allocation = *allocation;
+
+	AcquireSRWLockExclusive(&device->memory_lock);
+	curr_frame(device).delay_release_queue.push_back(release);
+	ReleaseSRWLockExclusive(&device->memory_lock);
+}
+
+static void process_delay_release_queue(vgpu_device_t* device, vgpu_device_t::frame_data_t& frame)
+{
+	AcquireSRWLockExclusive(&device->memory_lock);
+	for (size_t i = 0; i < frame.delay_release_queue.length(); ++i)
+	{
+		vgpu_vk_delayed_release_t& release = frame.delay_release_queue[i];
+		if (release.buffer != VK_NULL_HANDLE)
+			vkDestroyBuffer(device->vk_device, release.buffer, &device->vk_allocator);
+		if (release.image != VK_NULL_HANDLE)
+			vkDestroyImage(device->vk_device, release.image, &device->vk_allocator);
+		free_memory_locked(device, &release.allocation);
+	}
+	frame.delay_release_queue.set_length(0);
+	ReleaseSRWLockExclusive(&device->memory_lock);
+}
+
+static void destroy_memory(vgpu_device_t* device)
+{
+	for (uint32_t i = 0; i < VGPU_MULTI_BUFFERING; ++i)
+		process_delay_release_queue(device, device->frame[i]);
+
+	for (uint32_t i = 0; i < device->memory_props.memoryTypeCount; ++i)
+	{
+		for (uint32_t k = 0; k < VGPU_VK_MEMORY_KIND_COUNT; ++k)
+		{
+			vgpu_array_t<vgpu_vk_memory_block_t*>& blocks = device->memory_blocks[i][k];
+			for (size_t b = 0; b < blocks.length(); ++b)
+			{
+				VGPU_ASSERT(device, blocks[b]->num_allocations == 0, "Device memory is still in use by %u resources", blocks[b]->num_allocations);
+				destroy_memory_block(device, blocks[b]);
+			}
+			blocks.set_length(0);
+		}
+	}
+}
+
+/******************************************************************************\
+ *
+ *  Pipeline cache
+ *
+\******************************************************************************/
+
+// Data from another driver or GPU is not guaranteed to be rejected by
+// vkCreatePipelineCache, so the header is checked against the device first
+static bool is_pipeline_cache_compatible(vgpu_device_t* device, const uint8_t* data, size_t size)
+{
+	uint32_t header[4];
+	if (size < sizeof(header) + VK_UUID_SIZE)
+		return false;
+	memcpy(header, data, sizeof(header));
+
+	return header[0] >= sizeof(header) + VK_UUID_SIZE &&
+		header[1] == VK_PIPELINE_CACHE_HEADER_VERSION_ONE &&
+		header[2] == device->device_props.vendorID &&
+		header[3] == device->device_props.deviceID &&
+		memcmp(data + sizeof(header), device->device_props.pipelineCacheUUID, VK_UUID_SIZE) == 0;
+}
+
+static void init_pipeline_cache(vgpu_device_t* device, const char* path)
+{
+	device->pipeline_cache_file = nullptr;
+
+	size_t size = 0;
+	uint8_t* data = nullptr;
+	if (path)
+	{
+		char file[1024];
+		int len = snprintf(file, sizeof(file), "%s/vk_pipeline_cache.bin", path);
+		if (len > 0 && (size_t)len < sizeof(file))
+		{
+			device->pipeline_cache_file = (char*)VGPU_ALLOC(device->allocator, len + 1, 1);
+			memcpy(device->pipeline_cache_file, file, len + 1);
+
+			data = (uint8_t*)vgpu_read_file(device->allocator, file, &size);
+			if (data && !is_pipeline_cache_compatible(device, data, size))
+			{
+				VGPU_FREE(device->allocator, data);
+				data = nullptr;
+				size = 0;
+			}
+		}
+	}
+
+	// Even without a file the cache saves work for pipelines that share state
+	VkPipelineCacheCreateInfo create_info =
+	{
+		VGPU_VK_ADD_TYPE(VK_STRUCTURE_TYPE_PIPELINE_CACHE_CREATE_INFO),
+		0,
+		size,
+		data,
+	};
+	VkResult res = vkCreatePipelineCache(device->vk_device, &create_info, &device->vk_allocator, &device->pipeline_cache);
+	if (res != VK_SUCCESS && data)
+	{
+		// Rejected by the driver after all, start over empty
+		create_info.initialDataSize = 0;
+		create_info.pInitialData = nullptr;
+		res = vkCreatePipelineCache(device->vk_device, &create_info, &device->vk_allocator, &device->pipeline_cache);
+	}
+	VGPU_ASSERT(device, res == VK_SUCCESS, "Failed to create pipeline cache");
+
+	if (data)
+		VGPU_FREE(device->allocator, data);
+}
+
+static bool store_pipeline_cache(vgpu_device_t* device)
+{
+	if (device->pipeline_cache_file == nullptr)
+		return false;
+
+	size_t size = 0;
+	VkResult res = vkGetPipelineCacheData(device->vk_device, device->pipeline_cache, &size, nullptr);
+	if (res != VK_SUCCESS || size == 0)
+		return false;
+
+	void* data = VGPU_ALLOC(device->allocator, size, 16);
+	res = vkGetPipelineCacheData(device->vk_device, device->pipeline_cache, &size, data);
+	bool stored = res == VK_SUCCESS && vgpu_write_file(device->pipeline_cache_file, data, size);
+	VGPU_FREE(device->allocator, data);
+
+	return stored;
+}
+
+static void destroy_pipeline_cache(vgpu_device_t* device)
+{
+	store_pipeline_cache(device);
+	vkDestroyPipelineCache(device->vk_device, device->pipeline_cache, &device->vk_allocator);
+	if (device->pipeline_cache_file)
+		VGPU_FREE(device->allocator, device->pipeline_cache_file);
+}
+
 /******************************************************************************\
  *
  *  Device operations
@@ -228,26 +709,12 @@ static VkBool32 VKAPI_PTR vgpu_vk_debug_func(
 	return false;
 }
 
-static uint32_t vgpu_vk_memory_type_from_properties(vgpu_device_t* device, uint32_t type_bits, VkFlags requirements_mask)
-{
-	for (uint32_t i = 0; i < 32; i++) {
-		if ((type_bits & 1) == 1) {
-			if ((device->memory_props.memoryTypes[i].propertyFlags & requirements_mask) == requirements_mask) {
-				return i;
-			}
-		}
-		type_bits >>= 1;
-	}
-	VGPU_ASSERT(device, false, "Failed to find memory type");
-	return 0;
-}
-
 vgpu_device_t* vgpu_create_device(const vgpu_create_device_params_t* params)
 {
 	extern vgpu_allocator_t vgpu_allocator_default;
 
 	vgpu_allocator_t* allocator = params->allocator ? params->allocator : &vgpu_allocator_default;
-	vgpu_device_t* device = VGPU_ALLOC_TYPE(allocator, vgpu_device_t);
+	vgpu_device_t* device = VGPU_NEW(allocator, vgpu_device_t);
 	device->allocator = allocator;
 
 	device->vk_allocator.pUserData = device->allocator;
@@ -263,6 +730,7 @@ vgpu_device_t* vgpu_create_device(const vgpu_create_device_params_t* params)
 	device->frame_no = 0;
 	memset(&device->caps, 0, sizeof(device->caps));
 	device->caps.flags = (~params->force_disable_flags) & (VGPU_CAPS_FLAG_BIND_CONSTANT_BUFFER_AT_OFFSET | VGPU_CAPS_FLAG_BIND_BUFFER_AT_OFFSET);
+	device->caps.error_check_mode = params->error_check_mode;
 
 	VkResult res = VK_SUCCESS;
 
@@ -353,6 +821,7 @@ vgpu_device_t* vgpu_create_device(const vgpu_create_device_params_t* params)
 
 	vkGetPhysicalDeviceMemoryProperties(device->vk_gpu, &device->memory_props);
 	vkGetPhysicalDeviceProperties(device->vk_gpu, &device->device_props);
+	init_memory(device);
 
 	float queue_priorities[1] = { 0.0 };
 	VkDeviceQueueCreateInfo queue_create_infos[] =
@@ -559,16 +1028,41 @@ vgpu_device_t* vgpu_create_device(const vgpu_create_device_params_t* params)
 	res = vkAcquireNextImageKHR(device->vk_device, device->swapchain, UINT64_MAX, device->present_semaphore[0], VK_NULL_HANDLE, &device->swapchain_image_index);
 	VGPU_ASSERT(device, res == VK_SUCCESS, "Failed to acquire next swapchain image");
 
+	VkFenceCreateInfo fence_create_info =
+	{
+		VGPU_VK_ADD_TYPE(VK_STRUCTURE_TYPE_FENCE_CREATE_INFO),
+		0,
+	};
+	for (uint32_t i = 0; i < VGPU_MULTI_BUFFERING; ++i)
+	{
+		res = vkCreateFence(device->vk_device, &fence_create_info, &device->vk_allocator, &device->frame[i].fence);
+		VGPU_ASSERT(device, res == VK_SUCCESS, "Failed to create frame fence");
+		device->frame[i].fence_submitted = false;
+	}
+
+	init_pipeline_cache(device, params->pipeline_cache_path);
+
+	device->buffer_handles.create(allocator, params->max_buffer_handles);
+
 	return device;
 }
 
 void vgpu_destroy_device(vgpu_device_t* device)
 {
+	vkDeviceWaitIdle(device->vk_device);
+	destroy_memory(device);
+	destroy_pipeline_cache(device);
+	for (uint32_t i = 0; i < VGPU_MULTI_BUFFERING; ++i)
+		vkDestroyFence(device->vk_device, device->frame[i].fence, &device->vk_allocator);
+
 	vkDestroySwapchainKHR(device->vk_device, device->swapchain, &device->vk_allocator);
 	device->vkDestroyDebugReportCallbackEXT(device->vk_instance, device->debug_callback, &device->vk_allocator);
 	vkDestroyDevice(device->vk_device, &device->vk_allocator);
 	vkDestroyInstance(device->vk_instance, &device->vk_allocator);
-	VGPU_FREE(device->allocator, device);
+
+	device->buffer_handles.destroy();
+
+	VGPU_DELETE(device->allocator, vgpu_device_t, device);
 }
 
 vgpu_device_type_t vgpu_get_device_type(vgpu_device_t* device)
@@ -584,13 +1078,14 @@ void vgpu_apply_command_lists(vgpu_device_t* device, uint32_t num_command_lists,
 	VGPU_ASSERT(device, num_command_lists > 0, "No command lists to apply");
 
 	VkCommandBuffer command_buffers[128];
+	uint32_t num_command_buffers = 0;
 	bool present_semaphore_needed = false;
 	VGPU_ASSERT(device, num_command_lists <= VGPU_ARRAY_LENGTH(command_buffers), "Too many command lists to apply");
 	for (uint32_t i = 0; i < num_command_lists; ++i)
 	{
-		command_buffers[i] = command_lists[i]->command_buffer;
+		command_buffers[num_command_buffers++] = command_lists[i]->command_buffer;
 		present_semaphore_needed |= command_lists[i]->present_semaphore_needed;
-		command_lists[i]->thread_context->pending[id].append(command_lists[i]->command_buffer);
+		command_lists[i]->thread_context->pending[id].push_back(command_lists[i]->command_buffer);
 		command_lists[i]->command_buffer = VK_NULL_HANDLE;
 		command_lists[i]->thread_context = nullptr;
 	}
@@ -609,7 +1104,7 @@ void vgpu_apply_command_lists(vgpu_device_t* device, uint32_t num_command_lists,
 		present_semaphore_needed ? 1u : 0u,
 		present_semaphore_needed ? &device->present_semaphore[id] : nullptr,
 		nullptr,
-		num_command_lists,
+		num_command_buffers,
 		command_buffers,
 		0u,
 		nullptr,
@@ -620,6 +1115,12 @@ void vgpu_apply_command_lists(vgpu_device_t* device, uint32_t num_command_lists,
 
 void vgpu_present(vgpu_device_t* device)
 {
+	// An empty submit signals the fence once all earlier submits are done
+	vgpu_device_t::frame_data_t& this_frame = curr_frame(device);
+	VkResult res = vkQueueSubmit(device->vk_queue, 0, nullptr, this_frame.fence);
+	VGPU_ASSERT(device, res == VK_SUCCESS, "Failed to submit frame fence");
+	this_frame.fence_submitted = true;
+
 	uint32_t current_buffer = device->frame_no % VGPU_MULTI_BUFFERING;
 	VkPresentInfoKHR present_info =
 	{
@@ -631,10 +1132,33 @@ void vgpu_present(vgpu_device_t* device)
 		&current_buffer,
 		nullptr,
 	};
-	VkResult res = vkQueuePresentKHR(device->vk_queue, &present_info);
+	res = vkQueuePresentKHR(device->vk_queue, &present_info);
 	VGPU_ASSERT(device, res == VK_SUCCESS, "Failed to queue present");
 
+	// Step frame counter and wait until the next slot of frame resources is
+	// no longer used by the GPU
 	device->frame_no++;
+	vgpu_device_t::frame_data_t& next_frame = curr_frame(device);
+
+	device->frame_stats.last_wait_us = 0;
+	if (next_frame.fence_submitted)
+	{
+		if (vkGetFenceStatus(device->vk_device, next_frame.fence) == VK_NOT_READY)
+		{
+			uint64_t wait_start = vgpu_time_us();
+			res = vkWaitForFences(device->vk_device, 1, &next_frame.fence, VK_TRUE, UINT64_MAX);
+			VGPU_ASSERT(device, res == VK_SUCCESS, "Failed to wait for frame fence");
+			device->frame_stats.last_wait_us = vgpu_time_us() - wait_start;
+			device->frame_stats.total_wait_us += device->frame_stats.last_wait_us;
+			device->frame_stats.num_waits++;
+		}
+
+		res = vkResetFences(device->vk_device, 1, &next_frame.fence);
+		VGPU_ASSERT(device, res == VK_SUCCESS, "Failed to reset frame fence");
+		next_frame.fence_submitted = false;
+	}
+
+	process_delay_release_queue(device, next_frame);
 
 	res = vkAcquireNextImageKHR(device->vk_device, device->swapchain, UINT64_MAX, device->present_semaphore[device->frame_no % VGPU_MULTI_BUFFERING], VK_NULL_HANDLE, &device->swapchain_image_index);
 	VGPU_ASSERT(device, res == VK_SUCCESS, "Failed to acquire next swapchain image");
@@ -666,12 +1190,63 @@ void vgpu_get_caps(vgpu_device_t* device, vgpu_caps_t* out_caps)
 	memcpy(out_caps, &device->caps, sizeof(vgpu_caps_t));
 }
 
+void vgpu_get_frame_stats(vgpu_device_t* device, vgpu_frame_stats_t* out_stats)
+{
+	memcpy(out_stats, &device->frame_stats, sizeof(vgpu_frame_stats_t));
+}
+
+bool vgpu_save_pipeline_cache(vgpu_device_t* device)
+{
+	return store_pipeline_cache(device);
+}
+
+void vgpu_get_memory_stats(vgpu_device_t* device, vgpu_memory_stats_t* out_stats)
+{
+	AcquireSRWLockExclusive(&device->memory_lock);
+	memcpy(out_stats, &device->memory_stats, sizeof(vgpu_memory_stats_t));
+	ReleaseSRWLockExclusive(&device->memory_lock);
+}
+
 /******************************************************************************\
 *
 *  Thread context handling
 *
 \******************************************************************************/
 
+static void create_staging_buffer(vgpu_device_t* device, vgpu_vk_staging_buffer_t* staging, VkDeviceSize size)
+{
+	VkBufferCreateInfo create_info =
+	{
+		VGPU_VK_ADD_TYPE(VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO),
+		0,
+		size,
+		VK_BUFFER_USAGE_TRANSFER_SRC_BIT,
+		VK_SHARING_MODE_EXCLUSIVE,
+		1,
+		&device->graphics_queue_node_index,
+	};
+	VkResult res = vkCreateBuffer(device->vk_device, &create_info, &device->vk_allocator, &staging->buffer);
+	VGPU_ASSERT(device, res == VK_SUCCESS, "Failed to create staging buffer");
+
+	VkMemoryRequirements memory_req;
+	vkGetBufferMemoryRequirements(device->vk_device, staging->buffer, &memory_req);
+	alloc_memory(device, &memory_req, VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT, VGPU_VK_MEMORY_KIND_LINEAR, false, &staging->allocation);
+
+	res = vkBindBufferMemory(device->vk_device, staging->buffer, staging->allocation.block->memory, staging->allocation.offset);
+	VGPU_ASSERT(device, res == VK_SUCCESS, "Failed to bind staging buffer memory");
+
+	staging->data = mapped_memory(device, &staging->allocation);
+	staging->size = size;
+	staging->offset = 0;
+}
+
+static void release_staging_buffer(vgpu_device_t* device, vgpu_vk_staging_buffer_t* staging)
+{
+	delay_release(device, staging->buffer, VK_NULL_HANDLE, &staging->allocation);
+	staging->buffer = VK_NULL_HANDLE;
+	staging->data = nullptr;
+}
+
 vgpu_thread_context_t* vgpu_create_thread_context(vgpu_device_t* device, const vgpu_create_thread_context_params_t* params)
 {
 	vgpu_thread_context_t* thread_context = VGPU_NEW(device->allocator, vgpu_thread_context_t);
@@ -687,9 +1262,12 @@ vgpu_thread_context_t* vgpu_create_thread_context(vgpu_device_t* device, const v
 		VkResult res = vkCreateCommandPool(device->vk_device, &cmd_pool_info, &device->vk_allocator, &thread_context->command_pool[i]);
 		VGPU_ASSERT(device, res == VK_SUCCESS, "Failed to create command pool");
 
-		thread_context->free[i].create(device->allocator, 8);
-		thread_context->pending[i].create(device->allocator, 8);
+		thread_context->free[i].create(device->allocator);
+		thread_context->pending[i].create(device->allocator);
+		vgpu_linear_allocator_create(&thread_context->frame_allocator[i], device->allocator, VGPU_FRAME_ALLOCATOR_CHUNK_SIZE);
+		create_staging_buffer(device, &thread_context->staging[i], VGPU_VK_STAGING_BUFFER_SIZE);
 	}
+	thread_context->frame_id = 0;
 
 	return thread_context;
 }
@@ -698,36 +1276,47 @@ void vgpu_destroy_thread_context(vgpu_device_t* device, vgpu_thread_context_t* t
 {
 	// TODO: wait for completion?
 	for (uint32_t i = 0; i < VGPU_MULTI_BUFFERING; ++i)
+	{
 		vkDestroyCommandPool(device->vk_device, thread_context->command_pool[i], &device->vk_allocator);
+		vgpu_linear_allocator_destroy(&thread_context->frame_allocator[i]);
+		release_staging_buffer(device, &thread_context->staging[i]);
+	}
 
 	VGPU_DELETE(device->allocator, vgpu_thread_context_t, thread_context);
 }
 
 void vgpu_prepare_thread_context(vgpu_device_t* device, vgpu_thread_context_t* thread_context)
 {
-	size_t id = device->frame_no % VGPU_MULTI_BUFFERING;
+	uint32_t id = (uint32_t)(device->frame_no % VGPU_MULTI_BUFFERING);
 	VkResult res = vkResetCommandPool(device->vk_device, thread_context->command_pool[id], 0);
 	VGPU_ASSERT(device, res == VK_SUCCESS, "Failed to reset command pool");
 
-	// TODO: we would wait for a fence on the whole frame here
+	thread_context->frame_id = id;
+	vgpu_linear_allocator_reset(&thread_context->frame_allocator[id]);
+	thread_context->staging[id].offset = 0;
+
+	// vgpu_present already waited for the frame fence of this slot
 	while (thread_context->pending[id].any())
 	{
 		VkCommandBuffer command_buffer = thread_context->pending[id].back();
 		thread_context->pending[id].remove_back();
-		thread_context->free[id].append(command_buffer);
+		thread_context->free[id].push_back(command_buffer);
 	}
 }
 
+vgpu_allocator_t* vgpu_get_thread_frame_allocator(vgpu_thread_context_t* thread_context)
+{
+	return &thread_context->frame_allocator[thread_context->frame_id].base;
+}
+
 /******************************************************************************\
  *
  *  Buffer handling
  *
 \******************************************************************************/
 
-vgpu_buffer_t* vgpu_create_buffer(vgpu_device_t* device, const vgpu_create_buffer_params_t* params)
+static void init_buffer(vgpu_device_t* device, vgpu_buffer_t* buffer, const vgpu_create_buffer_params_t* params)
 {
-	vgpu_buffer_t* buffer = VGPU_ALLOC_TYPE(device->allocator, vgpu_buffer_t);
-
 	VkBufferCreateInfo create_info =
 	{
 		VGPU_VK_ADD_TYPE(VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO),
@@ -744,32 +1333,48 @@ vgpu_buffer_t* vgpu_create_buffer(vgpu_device_t* device, const vgpu_create_buffe
 	if (params->flags & VGPU_BUFFER_FLAG_CONSTANT_BUFFER)
 		create_info.usage |= VK_BUFFER_USAGE_UNIFORM_BUFFER_BIT;
 
+	// Dynamic buffers are written by the CPU directly, everything else lives
+	// in device local memory and is written through the staging buffer
+	buffer->device_local = params->usage != VGPU_USAGE_DYNAMIC;
+	if (buffer->device_local)
+		create_info.usage |= VK_BUFFER_USAGE_TRANSFER_DST_BIT;
+
 	VkResult res = vkCreateBuffer(device->vk_device, &create_info, &device->vk_allocator, &buffer->buffer);
 	VGPU_ASSERT(device, res == VK_SUCCESS, "Failed to create buffer");
 
 	VkMemoryRequirements memory_req;
 	vkGetBufferMemoryRequirements(device->vk_device, buffer->buffer, &memory_req);
 
-	VkMemoryAllocateInfo alloc_info =
-	{
-		VGPU_VK_ADD_TYPE(VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO),
-		memory_req.size,
-		vgpu_vk_memory_type_from_properties(device, memory_req.memoryTypeBits, VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT),
-	};
-	res = vkAllocateMemory(device->vk_device, &alloc_info, &device->vk_allocator, &buffer->mem);
-	VGPU_ASSERT(device, res == VK_SUCCESS, "Failed to allocate buffer memory");
+	VkMemoryPropertyFlags property_flags = buffer->device_local ? VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT : VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT;
+	if (!alloc_memory(device, &memory_req, property_flags, VGPU_VK_MEMORY_KIND_LINEAR, false, &buffer->allocation))
+		return;
 
-	res = vkBindBufferMemory(device->vk_device, buffer->buffer, buffer->mem, 0);
+	res = vkBindBufferMemory(device->vk_device, buffer->buffer, buffer->allocation.block->memory, buffer->allocation.offset);
 	VGPU_ASSERT(device, res == VK_SUCCESS, "Failed to bind buffer memory");
+}
 
+vgpu_buffer_t* vgpu_create_buffer(vgpu_device_t* device, const vgpu_create_buffer_params_t* params)
+{
+	vgpu_buffer_t* buffer = VGPU_ALLOC_TYPE(device->allocator, vgpu_buffer_t);
+	init_buffer(device, buffer, params);
 	return buffer;
 }
 
+static void release_buffer(vgpu_device_t* device, vgpu_buffer_t* buffer)
+{
+	delay_release(device, buffer->buffer, VK_NULL_HANDLE, &buffer->allocation);
+	buffer->buffer = VK_NULL_HANDLE;
+}
+
 void vgpu_destroy_buffer(vgpu_device_t* device, vgpu_buffer_t* buffer)
 {
+	release_buffer(device, buffer);
 	VGPU_FREE(device->allocator, buffer);
 }
 
+// Buffer handle entry points on top of init_buffer and release_buffer
+#include "vgpu_buffer_handles.h"
+
 /******************************************************************************\
  *
  *  Resource table handling
@@ -787,6 +1392,11 @@ void vgpu_destroy_resource_table(vgpu_device_t* device, vgpu_resource_table_t* r
 	VGPU_FREE(device->allocator, resource_table);
 }
 
+void vgpu_compact_resource_tables(vgpu_device_t* device, uint32_t time_budget_us)
+{
+	// Nothing to compact, resource tables are not backed by a shared heap
+}
+
 /******************************************************************************\
 *
 *  Root layout handling
@@ -855,16 +1465,15 @@ vgpu_texture_t* vgpu_create_texture(vgpu_device_t* device, const vgpu_create_tex
 	VkMemoryRequirements mem_reqs;
 	vkGetImageMemoryRequirements(device->vk_device, texture->image, &mem_reqs);
 
-	VkMemoryAllocateInfo mem_alloc =
+	bool dedicated = params->is_render_target && mem_reqs.size >= VGPU_VK_DEDICATED_RENDER_TARGET_SIZE;
+	if (!alloc_memory(device, &mem_reqs, 0, VGPU_VK_MEMORY_KIND_OPTIMAL, dedicated, &texture->allocation))
 	{
-		VGPU_VK_ADD_TYPE(VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO),
-		mem_reqs.size,
-		vgpu_vk_memory_type_from_properties(device, mem_reqs.memoryTypeBits, 0),
-	};
-	res = vkAllocateMemory(device->vk_device, &mem_alloc, NULL, &texture->mem);
-	VGPU_ASSERT(device, res == VK_SUCCESS, "Failed to allocate memory for image");
+		vkDestroyImage(device->vk_device, texture->image, &device->vk_allocator);
+		VGPU_FREE(device->allocator, texture);
+		return nullptr;
+	}
 
-	res = vkBindImageMemory(device->vk_device, texture->image, texture->mem, 0);
+	res = vkBindImageMemory(device->vk_device, texture->image, texture->allocation.block->memory, texture->allocation.offset);
 	VGPU_ASSERT(device, res == VK_SUCCESS, "Failed to bind memory for image");
 
 	memcpy(texture->clear_value.color.float32, params->clear_value.color, sizeof(texture->clear_value.color.float32));
@@ -874,8 +1483,7 @@ vgpu_texture_t* vgpu_create_texture(vgpu_device_t* device, const vgpu_create_tex
 
 void vgpu_destroy_texture(vgpu_device_t* device, vgpu_texture_t* texture)
 {
-	vkDestroyImage(device->vk_device, texture->image, &device->vk_allocator);
-	vkFreeMemory(device->vk_device, texture->mem, &device->vk_allocator);
+	delay_release(device, VK_NULL_HANDLE, texture->image, &texture->allocation);
 	VGPU_FREE(device->allocator, texture);
 }
 
@@ -1096,7 +1704,7 @@ vgpu_pipeline_t* vgpu_create_pipeline(vgpu_device_t* device, const vgpu_create_p
 		VK_NULL_HANDLE, // base_pipeline_handle
 		0, // base_pipeline_index
 	};
-	VkResult res = vkCreateGraphicsPipelines(device->vk_device, VK_NULL_HANDLE, 1, &create_info, &device->vk_allocator, &pipeline->vk_pipeline);
+	VkResult res = vkCreateGraphicsPipelines(device->vk_device, device->pipeline_cache, 1, &create_info, &device->vk_allocator, &pipeline->vk_pipeline);
 	VGPU_ASSERT(device, res == VK_SUCCESS, "Failed to create graphics pipeline");
 
 	return pipeline;
@@ -1108,6 +1716,11 @@ void vgpu_destroy_pipeline(vgpu_device_t* device, vgpu_pipeline_t* pipeline)
 	VGPU_FREE(device->allocator, pipeline);
 }
 
+bool vgpu_is_pipeline_ready(vgpu_device_t* device, vgpu_pipeline_t* pipeline)
+{
+	return true;
+}
+
 /******************************************************************************\
 *
 *  Render pass handling
@@ -1252,6 +1865,24 @@ vgpu_render_pass_t* vgpu_create_render_pass(vgpu_device_t* device, const vgpu_cr
 	res = vkCreateRenderPass(device->vk_device, &pass_create_info, &device->vk_allocator, &render_pass->render_pass);
 	VGPU_ASSERT(device, res == VK_SUCCESS, "Failed to create render pass");
 
+	// Only the load ops differ, so the framebuffers work with both passes
+	bool clears = false;
+	for (uint32_t i = 0; i < attachment_count; ++i)
+	{
+		clears |= attachments[i].loadOp == VK_ATTACHMENT_LOAD_OP_CLEAR || attachments[i].stencilLoadOp == VK_ATTACHMENT_LOAD_OP_CLEAR;
+		if (attachments[i].loadOp == VK_ATTACHMENT_LOAD_OP_CLEAR)
+			attachments[i].loadOp = VK_ATTACHMENT_LOAD_OP_LOAD;
+		if (attachments[i].stencilLoadOp == VK_ATTACHMENT_LOAD_OP_CLEAR)
+			attachments[i].stencilLoadOp = VK_ATTACHMENT_LOAD_OP_LOAD;
+	}
+
+	render_pass->load_render_pass = render_pass->render_pass;
+	if (clears)
+	{
+		res = vkCreateRenderPass(device->vk_device, &pass_create_info, &device->vk_allocator, &render_pass->load_render_pass);
+		VGPU_ASSERT(device, res == VK_SUCCESS, "Failed to create render pass");
+	}
+
 	uint32_t end_count = render_pass->has_framebuffer ? VGPU_MULTI_BUFFERING : 1;
 	for (uint32_t f = 0; f < end_count; ++f)
 	{
@@ -1283,6 +1914,8 @@ vgpu_render_pass_t* vgpu_create_render_pass(vgpu_device_t* device, const vgpu_cr
 
 void vgpu_destroy_render_pass(vgpu_device_t* device, vgpu_render_pass_t* render_pass)
 {
+	if (render_pass->load_render_pass != render_pass->render_pass)
+		vkDestroyRenderPass(device->vk_device, render_pass->load_render_pass, &device->vk_allocator);
 	vkDestroyRenderPass(device->vk_device, render_pass->render_pass, &device->vk_allocator);
 	VGPU_FREE(device->allocator, render_pass);
 }
@@ -1300,6 +1933,7 @@ vgpu_command_list_t* vgpu_create_command_list(vgpu_device_t* device, const vgpu_
 	command_list->thread_context = nullptr;
 	command_list->command_buffer = VK_NULL_HANDLE;
 	command_list->curr_pass = nullptr;
+	command_list->in_render_pass = false;
 
 	return command_list;
 }
@@ -1321,11 +1955,11 @@ bool vgpu_is_command_list_type_supported(vgpu_device_t* device, vgpu_command_lis
 *
 \******************************************************************************/
 
-void vgpu_begin_command_list(vgpu_thread_context_t* thread_context, vgpu_command_list_t* command_list, vgpu_render_pass_t* render_pass)
+static VkCommandBuffer alloc_command_buffer(vgpu_device_t* device, vgpu_thread_context_t* thread_context)
 {
-	size_t id = command_list->device->frame_no % VGPU_MULTI_BUFFERING;
-	
-	VGPU_ASSERT(command_list->device, command_list->command_buffer == VK_NULL_HANDLE, "Command list already begun");
+	size_t id = device->frame_no % VGPU_MULTI_BUFFERING;
+
+	VkCommandBuffer command_buffer = VK_NULL_HANDLE;
 	if (thread_context->free[id].empty())
 	{
 		VkCommandBufferAllocateInfo command_buffer_info =
@@ -1335,14 +1969,21 @@ void vgpu_begin_command_list(vgpu_thread_context_t* thread_context, vgpu_command
 			VK_COMMAND_BUFFER_LEVEL_PRIMARY,
 			1
 		};
-		VkResult res = vkAllocateCommandBuffers(command_list->device->vk_device, &command_buffer_info, &command_list->command_buffer);
+		VkResult res = vkAllocateCommandBuffers(device->vk_device, &command_buffer_info, &command_buffer);
+		VGPU_ASSERT(device, res == VK_SUCCESS, "Failed to allocate command buffer");
 	}
 	else
 	{
-		command_list->command_buffer = thread_context->free[id].back();
+		command_buffer = thread_context->free[id].back();
 		thread_context->free[id].remove_back();
 	}
+	return command_buffer;
+}
 
+void vgpu_begin_command_list(vgpu_thread_context_t* thread_context, vgpu_command_list_t* command_list, vgpu_render_pass_t* render_pass)
+{
+	VGPU_ASSERT(command_list->device, command_list->command_buffer == VK_NULL_HANDLE, "Command list already begun");
+	command_list->command_buffer = alloc_command_buffer(command_list->device, thread_context);
 	command_list->thread_context = thread_context;
 
 	VkCommandBufferInheritanceInfo inheritance_info =
@@ -1366,29 +2007,107 @@ void vgpu_begin_command_list(vgpu_thread_context_t* thread_context, vgpu_command
 	VGPU_ASSERT(command_list->device, res == VK_SUCCESS, "Failed to begin command buffer");
 
 	command_list->curr_pass = render_pass;
+	command_list->in_render_pass = false;
 	command_list->present_semaphore_needed = false;
 }
 
 void vgpu_end_command_list(vgpu_command_list_t* command_list)
 {
+	if (command_list->in_render_pass)
+		vkCmdEndRenderPass(command_list->command_buffer);
+
 	VkResult res = vkEndCommandBuffer(command_list->command_buffer);
 	VGPU_ASSERT(command_list->device, res == VK_SUCCESS, "Failed to end command buffer");
 
 	command_list->curr_pass = nullptr;
+	command_list->in_render_pass = false;
 }
 
+static void begin_render_pass(vgpu_command_list_t* command_list, vgpu_render_pass_t* render_pass, VkRenderPass vk_render_pass)
+{
+	VkRenderPassBeginInfo info =
+	{
+		VGPU_VK_ADD_TYPE(VK_STRUCTURE_TYPE_RENDER_PASS_BEGIN_INFO),
+		vk_render_pass,
+		render_pass->framebuffer[render_pass->has_framebuffer ? command_list->device->swapchain_image_index : 0],
+		{ { 0, 0 }, { 1280, 720 } },
+		render_pass->num_color_targets + (render_pass->depth_stencil_target ? 1 : 0),
+		render_pass->clear_values,
+	};
+	vkCmdBeginRenderPass(command_list->command_buffer, &info, VK_SUBPASS_CONTENTS_INLINE);
+	command_list->curr_pass = render_pass;
+	command_list->in_render_pass = true;
+}
+
+struct vgpu_vk_lock_data_t
+{
+	VkBuffer staging_buffer;
+	VkDeviceSize staging_offset;
+};
+
 void* vgpu_lock_buffer(vgpu_command_list_t* command_list, vgpu_lock_buffer_params_t* params)
 {
-	// TODO: handle memory that is not host accessible
-	void* data = nullptr;
-	VkResult res = vkMapMemory(command_list->device->vk_device, params->buffer->mem, params->offset, params->num_bytes, 0, &data);
-	VGPU_ASSERT(command_list->device, res == VK_SUCCESS, "Failed to map memory for buffer");
-	return data;
+	vgpu_device_t* device = command_list->device;
+	if (!params->buffer->device_local)
+		return mapped_memory(device, &params->buffer->allocation) + params->offset;
+
+	vgpu_vk_staging_buffer_t* staging = &command_list->thread_context->staging[command_list->thread_context->frame_id];
+	if (staging->offset + params->num_bytes > staging->size)
+	{
+		// Not enough space, the old buffer is released once this frame is done
+		VkDeviceSize size = VGPU_ALIGN_UP(staging->size * 2 > params->num_bytes ? staging->size * 2 : params->num_bytes, 0x10000);
+		release_staging_buffer(device, staging);
+		create_staging_buffer(device, staging, size);
+	}
+
+	vgpu_vk_lock_data_t lock_data;
+	lock_data.staging_buffer = staging->buffer;
+	lock_data.staging_offset = staging->offset;
+	memcpy(params->unlock_data, &lock_data, sizeof(lock_data));
+
+	staging->offset = VGPU_ALIGN_UP(staging->offset + params->num_bytes, 16);
+	return staging->data + lock_data.staging_offset;
 }
 
 void vgpu_unlock_buffer(vgpu_command_list_t* command_list, const vgpu_lock_buffer_params_t* params)
 {
-	vkUnmapMemory(command_list->device->vk_device, params->buffer->mem);
+	if (!params->buffer->device_local)
+	{
+		flush_memory(command_list->device, &params->buffer->allocation, params->offset, params->num_bytes);
+		return;
+	}
+
+	vgpu_vk_lock_data_t lock_data;
+	memcpy(&lock_data, params->unlock_data, sizeof(lock_data));
+
+	VkBufferCopy region =
+	{
+		lock_data.staging_offset,
+		params->offset,
+		params->num_bytes,
+	};
+
+	// Copies are not allowed inside of a render pass. Suspend it, the attachments
+	// are loaded again when it resumes.
+	VGPU_ASSERT(command_list->device, command_list->in_render_pass || command_list->curr_pass == nullptr, "Cannot upload to a DEFAULT buffer inside of a render pass passed to vgpu_begin_command_list");
+	if (command_list->in_render_pass)
+		vkCmdEndRenderPass(command_list->command_buffer);
+
+	// The copy is recorded in order with the rest of the list like on DX12, so
+	// it has to wait for earlier commands that read the old contents and be
+	// done before later ones read the new contents
+	vkCmdPipelineBarrier(command_list->command_buffer, VK_PIPELINE_STAGE_ALL_COMMANDS_BIT, VK_PIPELINE_STAGE_TRANSFER_BIT, 0, 0, nullptr, 0, nullptr, 0, nullptr);
+	vkCmdCopyBuffer(command_list->command_buffer, lock_data.staging_buffer, params->buffer->buffer, 1, &region);
+	VkMemoryBarrier barrier =
+	{
+		VGPU_VK_ADD_TYPE(VK_STRUCTURE_TYPE_MEMORY_BARRIER),
+		VK_ACCESS_TRANSFER_WRITE_BIT,
+		VK_ACCESS_INDIRECT_COMMAND_READ_BIT | VK_ACCESS_INDEX_READ_BIT | VK_ACCESS_VERTEX_ATTRIBUTE_READ_BIT | VK_ACCESS_UNIFORM_READ_BIT | VK_ACCESS_SHADER_READ_BIT | VK_ACCESS_TRANSFER_WRITE_BIT,
+	};
+	vkCmdPipelineBarrier(command_list->command_buffer, VK_PIPELINE_STAGE_TRANSFER_BIT, VK_PIPELINE_STAGE_ALL_COMMANDS_BIT, 0, 1, &barrier, 0, nullptr, 0, nullptr);
+
+	if (command_list->in_render_pass)
+		begin_render_pass(command_list, command_list->curr_pass, command_list->curr_pass->load_render_pass);
 }
 
 void vgpu_set_buffer_data(vgpu_command_list_t* command_list, vgpu_buffer_t* buffer, size_t offset, const void* data, size_t num_bytes)
@@ -1432,12 +2151,22 @@ void vgpu_draw_indexed(vgpu_command_list_t* command_list, uint32_t first_instanc
 
 void vgpu_draw_indirect(vgpu_command_list_t* command_list, vgpu_buffer_t* buffer, uint64_t offset, uint32_t count)
 {
-	//vkCmdDrawIndirect(command_list->command_buffer, buffer->buffer, offset, count, 128);
+	//vkCmdDrawIndirect(command_list->command_buffer, buffer->buffer, offset, count, sizeof(vgpu_draw_indirect_args_t));
 }
 
 void vgpu_draw_indexed_indirect(vgpu_command_list_t* command_list, vgpu_buffer_t* buffer, uint64_t offset, uint32_t count)
 {
-	//vkCmdDrawIndexedIndirect(command_list->command_buffer, buffer->buffer, offset, count, 128); // TODO: stride
+	//vkCmdDrawIndexedIndirect(command_list->command_buffer, buffer->buffer, offset, count, sizeof(vgpu_draw_indexed_indirect_args_t));
+}
+
+void vgpu_draw_indirect_count(vgpu_command_list_t* command_list, vgpu_buffer_t* buffer, uint64_t offset, vgpu_buffer_t* count_buffer, uint64_t count_offset, uint32_t max_count)
+{
+	//vkCmdDrawIndirectCountKHR(command_list->command_buffer, buffer->buffer, offset, count_buffer->buffer, count_offset, max_count, sizeof(vgpu_draw_indirect_args_t));
+}
+
+void vgpu_draw_indexed_indirect_count(vgpu_command_list_t* command_list, vgpu_buffer_t* buffer, uint64_t offset, vgpu_buffer_t* count_buffer, uint64_t count_offset, uint32_t max_count)
+{
+	//vkCmdDrawIndexedIndirectCountKHR(command_list->command_buffer, buffer->buffer, offset, count_buffer->buffer, count_offset, max_count, sizeof(vgpu_draw_indexed_indirect_args_t));
 }
 
 void vgpu_clear_render_pass(vgpu_command_list_t* command_list, vgpu_render_pass_t* render_pass)
@@ -1477,20 +2206,10 @@ void vgpu_clear_render_pass(vgpu_command_list_t* command_list, vgpu_render_pass_
 
 void vgpu_set_render_pass(vgpu_command_list_t* command_list, vgpu_render_pass_t* render_pass)
 {
-	if(command_list->curr_pass)
+	if(command_list->in_render_pass)
 		vkCmdEndRenderPass(command_list->command_buffer);
 
-	VkRenderPassBeginInfo info =
-	{
-		VGPU_VK_ADD_TYPE(VK_STRUCTURE_TYPE_RENDER_PASS_BEGIN_INFO),
-		render_pass->render_pass,
-		render_pass->framebuffer[render_pass->has_framebuffer ? command_list->device->swapchain_image_index : 0],
-		{ { 0, 0 }, { 1280, 720 } },
-		render_pass->num_color_targets + (render_pass->depth_stencil_target ? 1 : 0),
-		render_pass->clear_values,
-	};
-	vkCmdBeginRenderPass(command_list->command_buffer, &info, VK_SUBPASS_CONTENTS_INLINE);
-	command_list->curr_pass = render_pass;
+	begin_render_pass(command_list, render_pass, render_pass->render_pass);
 }
 
 void vgpu_transition_buffer(vgpu_command_list_t* command_list, vgpu_buffer_t* buffer, vgpu_resource_state_t state_before, vgpu_resource_state_t state_after)